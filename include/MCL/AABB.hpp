@@ -25,6 +25,7 @@
 #include "Vec.h"
 #include <memory>
 #include <cassert>
+#include <vector>
 
 namespace mcl {
 
@@ -114,24 +115,42 @@ public:
 		return true;
 	}
 
-	trimesh::vec center(){ return (min+max)*0.5f; }
+	trimesh::vec center() const { return (min+max)*0.5f; }
 
-	AABB& operator+(const trimesh::vec& p){
-		if( valid ){ min.min(p); max.max(p); }
-		else{ min = p; max = p; }
-		valid = true;
+	// Used for the surface area heuristic, zero if the box is empty
+	float surface_area() const {
+		if( !valid ){ return 0.f; }
+		trimesh::vec d = max-min;
+		return 2.f*( d[0]*d[1] + d[1]*d[2] + d[2]*d[0] );
 	}
 
+	AABB& operator+(const trimesh::vec& p){ return (*this) += p; }
+
+	// Note: trimesh's Vec::min/max take an omp critical section, so the
+	// bounds are grown component-wise. This makes AABB safe to use in parallel.
 	AABB& operator+=(const AABB& aabb){
-		if( valid ){ min.min( aabb.min ); max.max( aabb.max ); }
+		if( !aabb.valid ){ return *this; }
+		if( valid ){
+			for( int i=0; i<3; ++i ){
+				min[i] = std::min( min[i], aabb.min[i] );
+				max[i] = std::max( max[i], aabb.max[i] );
+			}
+		}
 		else{ min = aabb.min; max = aabb.max; }
 		valid = true;
+		return *this;
 	}
 
 	AABB& operator+=(const trimesh::vec& p){
-		if( valid ){ min.min(p); max.max(p); }
+		if( valid ){
+			for( int i=0; i<3; ++i ){
+				min[i] = std::min( min[i], p[i] );
+				max[i] = std::max( max[i], p[i] );
+			}
+		}
 		else{ min = p; max = p; }
 		valid = true;
+		return *this;
 	}
 
 	bool valid;
@@ -27,11 +27,16 @@
 #include <memory>
 #include <chrono>
 #include <bitset>
+#include <atomic>
+#include <numeric>
+#include <limits>
+#include <queue>
+#include <algorithm>
 
 
 namespace mcl {
 
-typedef long morton_type;
+typedef unsigned long long morton_type;
 typedef unsigned long long morton_encode_type;
 
 namespace helper {
@@ -46,62 +51,567 @@ namespace helper {
 		return ( bs[bit]==1 );
 	}
 
+	// Number of zero bits above the highest set bit, 64 if x is zero
+	static inline int count_leading_zeros( unsigned long long x ){
+		if( x == 0 ){ return 64; }
+#if defined(__GNUC__)
+		return __builtin_clzll( x );
+#else
+		int n = 0;
+		while( !( x & (1ull << 63) ) ){ x <<= 1; ++n; }
+		return n;
+#endif
+	}
+
+	// Number of zero bits below the lowest set bit, 64 if x is zero
+	static inline int count_trailing_zeros( unsigned long long x ){
+		if( x == 0 ){ return 64; }
+#if defined(__GNUC__)
+		return __builtin_ctzll( x );
+#else
+		int n = 0;
+		while( !( x & 1ull ) ){ x >>= 1; ++n; }
+		return n;
+#endif
+	}
+
+	// Moves the lower 21 bits of x so that there are two zero bits between each of them
+	static inline morton_type spread_bits( morton_encode_type x ){
+		x &= 0x1fffff;
+		x = ( x | x << 32 ) & 0x1f00000000ffffull;
+		x = ( x | x << 16 ) & 0x1f0000ff0000ffull;
+		x = ( x | x << 8 ) & 0x100f00f00f00f00full;
+		x = ( x | x << 4 ) & 0x10c30c30c30c30c3ull;
+		x = ( x | x << 2 ) & 0x1249249249249249ull;
+		return x;
+	}
+
 }
 
+// Number of bits per axis, the codes are 63 bits wide
+static const int morton_bits = 21;
+static const morton_encode_type morton_max = ( morton_encode_type(1) << morton_bits ) - 1;
+
+// Interleaves the lower 21 bits of each axis, x is the least significant.
+// See BVHBuilder::morton_codes for a batched version that uses BMI2 when available.
 static inline morton_type morton_encode(const morton_encode_type x, const morton_encode_type y, const morton_encode_type z){
-	int n_iters = sizeof(morton_type)*8;
-	// Step through the bits and assign them. The x2 for i is required to round-robinish interleaving
-	// and differs from typical morton encoding. Without them, I got thin slices along the x and z axes.
-	morton_type result = 0;
-	for( morton_type i = 0; i<n_iters; ++i ){
-		result |= (x & (morton_type(1) << i)) << i*2
-			| (y & (morton_type(1) << i)) << (i*2 + 1)
-			| (z & (morton_type(1) << i)) << (i*2 + 2);
-	}
-	return result;
+	return helper::spread_bits( x ) | ( helper::spread_bits( y ) << 1 ) | ( helper::spread_bits( z ) << 2 );
 }
 
 
 
-class BVHNode {
+//
+//	Flattened BVH node, 32 bytes with inline bounds.
+//	Nodes are stored depth first, so the left child of an interior node is always
+//	the next node in the array and only the right child needs an offset.
+//
+struct FlatNode {
+	trimesh::vec bmin;
+	int offset; // interior: index of right child, leaf: first entry in prim_indices
+	trimesh::vec bmax;
+	int n_prims; // zero for interior nodes
+
+	inline bool is_leaf() const { return n_prims > 0; }
+	inline AABB bounds() const { AABB aabb( bmin, bmax ); aabb.valid=true; return aabb; }
+};
+static_assert( sizeof(FlatNode)==32, "FlatNode should be 32 bytes" );
+
+
+//
+//	Quality and build statistics of a FlatBVH. Histograms are indexed by
+//	depth (root is 0) and by number of primitives in a leaf.
+//
+struct BVHStats {
+	BVHStats() : n_nodes(0), n_leaves(0), n_refs(0), max_depth(0), sah_cost(0.0), sibling_overlap(0.0), memory(0) {}
+	int n_nodes, n_leaves;
+	int n_refs; // entries in prim_indices, more than the primitives if any are duplicated
+	int max_depth;
+	std::vector< int > depth_histogram; // leaves at each depth
+	std::vector< int > leaf_histogram; // leaves with each number of primitives
+	double sah_cost;
+	double sibling_overlap; // surface area of child overlaps over the area of interior nodes
+	size_t memory; // bytes of nodes, prim_indices and prims
+	std::vector< std::pair< std::string, double > > timings; // seconds of each build phase, in order
+
+	double build_time() const;
+	double avg_leaf_size() const { return n_leaves ? double(n_refs)/double(n_leaves) : 0.0; }
+
+	// Adds the time since start as a phase and resets start
+	void add_timing( const std::string &phase, std::chrono::time_point<std::chrono::system_clock> &start );
+
+	void print( std::ostream &os=std::cout ) const;
+};
+
+
+//
+//	Triangle of a mesh in a BVH, by vertex index into the mesh's TriangleView
+//
+struct FlatTriangle {
+	int v[3];
+	int mesh; // index into BVHPrimitives::meshes
+};
+static_assert( sizeof(FlatTriangle)==16, "FlatTriangle should be 16 bytes" );
+
+
+//
+//	Primitives of a BVH. Mesh triangles are stored as indices and tested without virtual
+//	calls, and other objects are kept as they are. Primitive indices (as in prim_indices)
+//	count the triangles first and then the objects, so for a single mesh primitive i is face i.
+//	Ray and point queries see the triangles of a swept mesh at their start positions.
+//
+class BVHPrimitives {
+public:
+	std::vector< FlatTriangle > tris;
+	std::vector< TriangleView > meshes;
+	std::vector< std::shared_ptr<BaseObject> > prims; // primitives that aren't mesh triangles
+
+	// Adds the triangles of objects with a triangle view, and the primitives of the rest
+	void add_objects( const std::vector< std::shared_ptr<BaseObject> > &objects );
+
+	inline int num_prims() const { return tris.size() + prims.size(); }
+	inline bool is_triangle( const int prim ) const { return prim < int(tris.size()); }
+
+	// Index of a triangle primitive in its mesh's faces
+	inline int face( const int prim ) const { return prim - meshes[ tris[prim].mesh ].first_tri; }
+
+	// Vertex i of a triangle primitive
+	inline const trimesh::vec &vertex( const int prim, const int i ) const {
+		return (*meshes[ tris[prim].mesh ].vertices)[ tris[prim].v[i] ];
+	}
+
+	// True for a triangle of a swept mesh (see TriangleView::end_vertices)
+	inline bool is_swept( const int prim ) const {
+		return is_triangle( prim ) && meshes[ tris[prim].mesh ].end_vertices != NULL;
+	}
+
+	// Bounds of a primitive, which for a swept triangle cover it at both ends of the sweep
+	inline void prim_aabb( const int prim, trimesh::vec &bmin, trimesh::vec &bmax ) const {
+		if( !is_triangle( prim ) ){ prims[ prim-tris.size() ]->get_aabb( bmin, bmax ); return; }
+		const trimesh::vec &p0 = vertex( prim, 0 ), &p1 = vertex( prim, 1 ), &p2 = vertex( prim, 2 );
+		for( int i=0; i<3; ++i ){
+			bmin[i] = std::min( p0[i], std::min( p1[i], p2[i] ) );
+			bmax[i] = std::max( p0[i], std::max( p1[i], p2[i] ) );
+		}
+		const std::vector< trimesh::point > *x1 = meshes[ tris[prim].mesh ].end_vertices;
+		if( x1 == NULL ){ return; }
+		const FlatTriangle &tri = tris[prim];
+		for( int j=0; j<3; ++j ){
+			const trimesh::vec &p = (*x1)[ tri.v[j] ];
+			for( int i=0; i<3; ++i ){ bmin[i] = std::min( bmin[i], p[i] ); bmax[i] = std::max( bmax[i], p[i] ); }
+		}
+	}
+
+	inline bool prim_triangle( const int prim, trimesh::vec &p0, trimesh::vec &p1, trimesh::vec &p2 ) const {
+		if( !is_triangle( prim ) ){ return prims[ prim-tris.size() ]->get_triangle( p0, p1, p2 ); }
+		p0 = vertex( prim, 0 ); p1 = vertex( prim, 1 ); p2 = vertex( prim, 2 );
+		return true;
+	}
+
+	inline bool prim_ray_intersect( const int prim, intersect::Ray &ray, intersect::Payload &payload ) const {
+		if( !is_triangle( prim ) ){
+			if( !prims[ prim-tris.size() ]->ray_intersect( ray, payload ) ){ return false; }
+			payload.object = prim;
+			return true;
+		}
+		if( !intersect::ray_triangle( ray, vertex( prim, 0 ), vertex( prim, 1 ), vertex( prim, 2 ), payload ) ){ return false; }
+		payload.prim = prim;
+		payload.object = -1;
+		return true;
+	}
+
+	// Position, interpolated normal and material of a hit from traversing the bvh
+	inline void get_surface( const intersect::Ray &ray, const intersect::Payload &payload, intersect::SurfaceHit &hit ) const {
+		if( payload.object >= 0 ){ prims[ payload.object-tris.size() ]->get_surface( ray, payload, hit ); return; }
+		const FlatTriangle &tri = tris[ payload.prim ];
+		const TriangleView &mesh = meshes[ tri.mesh ];
+		hit.point = ray.origin + ray.direction * float( payload.t_max );
+		if( mesh.normals == NULL ){
+			const trimesh::vec &p0 = vertex( payload.prim, 0 );
+			hit.n = ( vertex( payload.prim, 1 ) - p0 ).cross( vertex( payload.prim, 2 ) - p0 );
+			trimesh::normalize( hit.n );
+		} else {
+			const std::vector< trimesh::vec > &n = *mesh.normals;
+			hit.n = ( 1.f - payload.u - payload.v ) * n[ tri.v[0] ] + payload.u * n[ tri.v[1] ] + payload.v * n[ tri.v[2] ];
+		}
+		hit.material = mesh.material;
+	}
+
+	inline bool prim_occluded( const int prim, intersect::Ray &ray, double t_min, double t_max ) const {
+		if( !is_triangle( prim ) ){ return prims[ prim-tris.size() ]->ray_occluded( ray, t_min, t_max ); }
+		return intersect::ray_triangle_occluded( ray, vertex( prim, 0 ), vertex( prim, 1 ), vertex( prim, 2 ), t_min, t_max );
+	}
+
+	// Bytes used by the primitives, not counting the meshes or objects they refer to
+	size_t prim_memory() const {
+		return tris.size()*sizeof(FlatTriangle) + meshes.size()*sizeof(TriangleView) + prims.size()*sizeof(prims[0]);
+	}
+
+	void clear_prims(){ tris.clear(); meshes.clear(); prims.clear(); }
+};
+
+
+//
+//	Compact BVH stored as a contiguous node array (see FlatNode).
+//	Leaves reference a range of prim_indices, which is the reordered list
+//	of primitive indices. The root is nodes[0], and the tree is empty if nodes is.
+//
+class FlatBVH : public BVHPrimitives {
 public:
-	BVHNode() : aabb( new AABB ), m_split(0), num_objects(0) { left_child=NULL; right_child=NULL; }
-	virtual ~BVHNode(){}
+	std::vector< FlatNode > nodes;
+	std::vector< int > prim_indices;
 
-	void get_edges( std::vector<trimesh::vec> &edges );
-	const std::shared_ptr<AABB> bounds(){ return aabb; }
+	// Fills the vector with edges of all boxes below (and including) the node
+	void get_edges( std::vector<trimesh::vec> &edges, int node=0 ) const;
 
-	std::shared_ptr<BVHNode> left_child;
-	std::shared_ptr<BVHNode> right_child;
-	std::shared_ptr<AABB> aabb;
+	// Bounds of the whole tree
+	AABB bounds() const { return nodes.size() ? nodes[0].bounds() : AABB(); }
 
-	int m_split; // split axis, used for Object Median BVH build.
-	std::vector< std::shared_ptr<BaseObject> > m_objects;
+	// Expected cost of a ray query by the surface area heuristic, relative
+	// to the cost of a single primitive intersection.
+	double sah_cost( float traversal_cost=1.f ) const;
 
-	// Number of primitives (not nodes) below this node on the tree.
-	int num_objects;
+	// Fills everything but the timings of the stats
+	void get_stats( BVHStats &stats, float traversal_cost=1.f ) const;
+
+	void clear(){ nodes.clear(); prim_indices.clear(); clear_prims(); }
+};
+
+
+//
+//	Node of a wide BVH with up to N children. Child bounds are stored per axis (SoA)
+//	so that all of them can be tested against a ray at once. Empty slots have inverted
+//	infinite bounds so they are never hit.
+//
+template< int N > struct WideNode {
+	float bmin[3][N];
+	float bmax[3][N];
+	int child[N]; // interior child: index into nodes, leaf child: first entry in prim_indices
+	int n_prims[N]; // zero for interior children, -1 for empty slots
+};
 
-	// Object Median split, round robin axis
-	void spatial_split( const std::vector< std::shared_ptr<BaseObject> > &objects,
-		const std::vector< int > &queue, const int split_axis, const int max_depth );
 
-	// Use the parallel sorting construction (Lauterbach et al. 2009)
-	void lbvh_split( const int bit, const std::vector< std::shared_ptr<BaseObject> > &prims,
-		const std::vector< std::pair< morton_type, int > > &morton_codes, const int max_depth );
+//
+//	BVH with 4 (SSE) or 8 (AVX) children per node, made by collapsing a binary FlatBVH
+//	(see BVHBuilder::make_tree_wide). The root is nodes[0], and leaves keep the prim_indices
+//	ranges of the binary tree.
+//
+template< int N > class WideBVH : public BVHPrimitives {
+public:
+	typedef WideNode<N> Node;
+	std::vector< Node > nodes;
+	std::vector< int > prim_indices;
 
+	void clear(){ nodes.clear(); prim_indices.clear(); clear_prims(); }
+};
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
+
+
+//
+//	Wide node with child bounds quantized to 8 or 16 bits (T) on a grid over the node bounds,
+//	decoded as origin + q*scale. Rounding is outward so decoded boxes always contain the exact ones.
+//	A BVH8 node is 120 bytes with 8 bit bounds, instead of 256.
+//
+template< int N, typename T > struct QuantizedNode {
+	float origin[3];
+	float scale[3];
+	T qmin[3][N];
+	T qmax[3][N];
+	int child[N]; // as in WideNode, -1 for empty slots
+	unsigned short n_prims[N]; // zero for interior children and empty slots
+};
+
+
+//
+//	WideBVH with quantized nodes (see BVHBuilder::make_tree_quantized), for scenes
+//	where the size of the tree matters more than a few extra operations per node.
+//
+template< int N, typename T > class QuantizedBVH : public BVHPrimitives {
+public:
+	typedef QuantizedNode<N,T> Node;
+	std::vector< Node > nodes;
+	std::vector< int > prim_indices;
+
+	void clear(){ nodes.clear(); prim_indices.clear(); clear_prims(); }
+};
+typedef QuantizedBVH< 4, unsigned char > QBVH4;
+typedef QuantizedBVH< 8, unsigned char > QBVH8;
+typedef QuantizedBVH< 4, unsigned short > QBVH4_16;
+typedef QuantizedBVH< 8, unsigned short > QBVH8_16;
+
+
+//
+//	Node of a DynamicBVH. Nodes are kept in a pool and linked by index,
+//	removed nodes are reused through a free list.
+//
+struct DynamicNode {
+	AABB aabb;
+	int parent; // -1 for the root
+	int left, right; // -1 for leaves
+	int prim; // leaf: index into prims, interior: -1
+
+	inline bool is_leaf() const { return left < 0; }
+};
+
+
+//
+//	BVH that is updated one primitive at a time, for scenes where objects come and go.
+//	Insertion picks the sibling that adds the least surface area to the tree (branch and bound,
+//	Bittner et al. 2013) and rotates nodes on the way back up to the root. Removal replaces
+//	the parent of the leaf with its sibling. The handle returned by insert is the index into prims.
+//
+class DynamicBVH {
+public:
+	DynamicBVH() : root(-1) {}
+
+	std::vector< DynamicNode > nodes;
+	std::vector< std::shared_ptr<BaseObject> > prims; // NULL if removed
+	int root; // -1 if empty
+
+	// Inserts a primitive and returns its handle
+	int insert( std::shared_ptr<BaseObject> prim );
+
+	// Removes a primitive by the handle returned from insert
+	void remove( int handle );
+
+	// Number of primitives in the tree
+	int size() const { return prims.size() - free_prims.size(); }
+
+	// Fills the vector with edges of all boxes below (and including) the node, -1 for the root
+	void get_edges( std::vector<trimesh::vec> &edges, int node=-1 ) const;
+
+	// Bounds of the whole tree
+	AABB bounds() const { return root >= 0 ? nodes[root].aabb : AABB(); }
+
+	// Surface of a hit from traversing the tree, payload.object is the handle that was hit
+	void get_surface( const intersect::Ray &ray, const intersect::Payload &payload, intersect::SurfaceHit &hit ) const {
+		prims[ payload.object ]->get_surface( ray, payload, hit );
+	}
+
+	// Same as FlatBVH::sah_cost
+	double sah_cost( float traversal_cost=1.f ) const;
+
+	void clear(){ nodes.clear(); prims.clear(); root=-1; free_nodes.clear(); free_prims.clear(); prim_leaf.clear(); }
+
+private:
+	std::vector< int > free_nodes, free_prims;
+	std::vector< int > prim_leaf; // handle -> leaf node
+
+	int alloc_node();
+
+	// Leaf or interior node that is the cheapest sibling for a new box
+	int find_sibling( const AABB &aabb ) const;
+
+	// Recomputes bounds and rotates nodes from node up to the root
+	void refit_up( int node );
+	void rotate( int node );
+};
+
+
+//
+//	Object placed in a scene by a transform, for two level bvhs. The bottom level bvh (blas) is built
+//	over the object in its own space and can be shared by many instances. Rays are moved into object
+//	space to traverse it, so moving an instance only changes the top level.
+//
+class BVHInstance : public BaseObject {
+public:
+	BVHInstance( std::shared_ptr<BaseObject> object_, std::shared_ptr<FlatBVH> blas_, const trimesh::xform &xf_=trimesh::xform() ) :
+		object(object_), blas(blas_) { set_xform( xf_ ); }
+
+	std::shared_ptr<BaseObject> object; // geometry in object space
+	std::shared_ptr<FlatBVH> blas; // bvh of object
+
+	std::string get_type() const { return "instance"; }
+	std::string get_material() const { return object->get_material(); }
+	int get_material_id() const { return object->get_material_id(); }
+
+	// World space bounds of the bottom level
+	void get_aabb( trimesh::vec &bmin, trimesh::vec &bmax ){ bmin = world_aabb.min; bmax = world_aabb.max; }
+
+	// Object to world transform, apply_xform composes with the current one
+	void set_xform( const trimesh::xform &xf_ );
+	const trimesh::xform &get_xform() const { return xf; }
+	void apply_xform( const trimesh::xform &xf_ ){ set_xform( xf_ * xf ); }
+
+	// The payload's prim is the triangle hit in blas, which should be made from meshes
+	bool ray_intersect( intersect::Ray &ray, intersect::Payload &payload );
+	bool ray_occluded( intersect::Ray &ray, double t_min, double t_max );
+
+	// World space hit point and normal
+	void get_surface( const intersect::Ray &ray, const intersect::Payload &payload, intersect::SurfaceHit &hit );
+
+private:
+	trimesh::xform xf, inv_xf, dir_xf, normal_xf;
+	AABB world_aabb;
 };
 
 
 class BVHTraversal {
 public:
-	static bool ray_intersect( std::shared_ptr<BVHNode> node, intersect::Ray &ray, intersect::Payload &payload );
+	// Closest hit with an explicit stack. The nearer child is visited first and subtrees
+	// that start past the closest hit so far are skipped. The payload is never copied.
+	static bool ray_intersect( const FlatBVH &bvh, intersect::Ray &ray, intersect::Payload &payload );
+
+	// Traces a packet of N coherent rays (N = 4, 8 or 16) together, testing each box and triangle
+	// against all of them with SSE. Boxes are culled for the whole packet first by interval arithmetic
+	// over the packet's origins and directions. Packets with directions in more than one octant are
+	// traced one ray at a time, and so are subtrees that fewer than max(2,N/4) of the rays reach.
+	// Payloads are filled like ray_intersect, returns a bit mask of the rays that hit.
+	template< int N > static int ray_intersect_packet( const FlatBVH &bvh, intersect::Ray *rays, intersect::Payload *payloads );
+
+	// Traces rays in packets of packet_size (4, 8 or 16) in parallel. Consecutive rays should be
+	// coherent, like tiles of pixels. Payloads are reset unless there is one for every ray.
+	static void ray_intersect_packets( const FlatBVH &bvh, std::vector< intersect::Ray > &rays,
+		std::vector< intersect::Payload > &payloads, int packet_size=8 );
+
+	// Closest hits of a large number of incoherent rays. Rays are binned by their direction octant
+	// and the cell of their origin (2^origin_bits cells per axis of the origins' bounds), then
+	// traced in that order in batches spread over threads, so that nearby rays share cached nodes.
+	static void ray_intersect_stream( const FlatBVH &bvh, const intersect::RayStream &rays,
+		intersect::HitStream &hits, int origin_bits=6 );
+
+	// Recursive traversal of both children at every node, kept for comparison
+	static bool ray_intersect_recursive( const FlatBVH &bvh, intersect::Ray &ray, intersect::Payload &payload );
+
+	static bool ray_intersect( const DynamicBVH &bvh, intersect::Ray &ray, intersect::Payload &payload );
+
+	// Any hit within (t_min,t_max) for shadow and visibility rays. Returns at the first
+	// primitive hit and never fills a payload. For a point light, use the unnormalized
+	// direction to the light with t_max=1 (minus an epsilon).
+	static bool occluded( const FlatBVH &bvh, intersect::Ray &ray, double t_min=1e-8, double t_max=9999999.0 );
+
+	// Occlusion of a batch of rays in parallel, each with its own t_max.
+	// Results are 1 for occluded rays and 0 otherwise.
+	static void occluded( const FlatBVH &bvh, std::vector< intersect::Ray > &rays, const std::vector< double > &t_max,
+		std::vector< char > &results, double t_min=1e-8 );
+
+	// Iterative traversal that tests all children of a node with one SIMD slab test and visits
+	// the nearest first. BVH8 uses AVX if the cpu has it, and two SSE tests otherwise.
+	static bool ray_intersect( const BVH4 &bvh, intersect::Ray &ray, intersect::Payload &payload );
+	static bool ray_intersect( const BVH8 &bvh, intersect::Ray &ray, intersect::Payload &payload );
+
+	// Same as the wide traversal, bounds are decoded for each node that is visited
+	template< int N, typename T > static bool ray_intersect( const QuantizedBVH<N,T> &bvh, intersect::Ray &ray, intersect::Payload &payload );
+
+	// True if the cpu supports AVX, checked once
+	static bool has_avx();
+
+private:
+	static bool ray_intersect( const FlatBVH &bvh, int node, intersect::Ray &ray, intersect::Payload &payload );
+	static bool ray_intersect( const DynamicBVH &bvh, int node, intersect::Ray &ray, intersect::Payload &payload );
 };
 
 
 class BVHBuilder {
 public:
-	static int make_tree_lbvh( std::shared_ptr<BVHNode> &root, const std::vector< std::shared_ptr<BaseObject> > &objects ); // returns num nodes in tree
-	static int make_tree_spatial( std::shared_ptr<BVHNode> &root, const std::vector< std::shared_ptr<BaseObject> > &objects ); // returns num nodes in tree
+	// The make_tree functions and optimize_treelets return the stats of the
+	// finished tree, with timings of each build phase.
+
+	// Parallel radix tree construction (Karras 2012) directly into a FlatBVH.
+	// Internal nodes are built in one pass, then bounds are computed bottom up.
+	static BVHStats make_tree_lbvh( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects );
+
+	// Object median split with round robin axes, one primitive per leaf.
+	// Subtrees with more than task_size primitives are built as omp tasks.
+	static BVHStats make_tree_spatial( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects );
+
+	// Binned surface area heuristic (Wald 2007), built directly into the FlatBVH.
+	// A node becomes a leaf when it has at most max_leaf_size primitives and no split is
+	// cheaper than intersecting all of them. Traversal cost is relative to one intersection.
+	static BVHStats make_tree_sah( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects,
+		int max_leaf_size=4, float traversal_cost=1.f, int n_bins=16 );
+
+	// Split BVH (Stich et al. 2009). Same as make_tree_sah, but where the children of the best object split
+	// overlap by more than min_overlap of the root's surface area, spatial splits are binned as well.
+	// Primitives straddling a spatial split are clipped to each side and referenced by both, up to
+	// max_duplication*n_prims extra references. Triangles are clipped exactly, other primitives by their bounds.
+	static BVHStats make_tree_sbvh( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects,
+		int max_leaf_size=4, float traversal_cost=1.f, int n_bins=16, float max_duplication=0.3f, float min_overlap=1e-5f );
+
+	// Quantizes the centroids to 2^21 cells per axis of the bounds and computes their morton codes,
+	// paired with the centroid index. Uses BMI2 (pdep) if the cpu has it and use_bmi2 is true.
+	static void morton_codes( const std::vector< trimesh::vec > &centroids, const AABB &bounds,
+		std::vector< std::pair< morton_type, int > > &codes, bool use_bmi2=true );
+
+	// Parallel LSD radix sort of morton codes. Equal codes keep their relative order.
+	static void radix_sort( std::vector< std::pair< morton_type, int > > &codes );
+
+	// True if the cpu supports BMI2, checked once
+	static bool has_bmi2();
+
+	// Improves a finished tree by restructuring treelets of up to 7 leaves for the lowest SAH cost
+	// (Karras & Aila 2013). Each round visits nodes bottom up, in parallel over subtrees, and only forms
+	// treelets at nodes with at least 7*2^round primitives. Subtrees with at most max_leaf_size primitives
+	// may be collapsed into leaves. Works on any builder's output.
+	static BVHStats optimize_treelets( FlatBVH &bvh, int iterations=3, int max_leaf_size=4, float traversal_cost=1.f );
+
+	// Collapses a binary tree into a wide one, each wide node pulls up the
+	// binary nodes with the largest surface area until it has N children.
+	template< int N > static int make_tree_wide( const FlatBVH &bvh, WideBVH<N> &wide ); // returns num nodes in tree
+
+	// Quantizes the child bounds of a wide tree, keeping its layout. Leaves must have less than 2^16 primitives.
+	template< int N, typename T > static int make_tree_quantized( const WideBVH<N> &wide, QuantizedBVH<N,T> &qbvh ); // returns num nodes in tree
+
+	// Recomputes the bounds of every node from the current primitive bounds, bottom up.
+	// The tree topology is kept, so the primitives must be the same as when it was built.
+	static void refit( FlatBVH &bvh );
+
+private:
+	// Fills bounds and centroids of each primitive, returns the bounds of the centroids
+	static AABB prim_bounds( const BVHPrimitives &prims,
+		std::vector< AABB > &prim_aabbs, std::vector< trimesh::vec > &centroids );
+
+	static void lbvh_preorder( const int node, const int pre, const int n_internal, const std::vector<int> &left,
+		const std::vector<int> &right, const std::vector<int> &first, std::vector<int> &flat_idx );
+
+	// Subtrees with more primitives (or nodes, for refit) than this are split into omp tasks
+	static const int task_size = 4096;
+
+	static AABB refit_node( FlatBVH &bvh, const int node );
+
+	// Builds the subtree at node and returns the number of nodes in it
+	static int median_split( FlatBVH &bvh, std::vector<int> &scratch, const std::vector< AABB > &prim_aabbs,
+		const std::vector< trimesh::vec > &centroids, const int node, const int begin, const int end, const int split_axis );
+
+	static AABB range_bounds( const std::vector<int> &indices, const std::vector< AABB > &prim_aabbs,
+		const int begin, const int end, const bool parallel );
+
+	// Partitions indices [begin,end) by centroid <= center with tasks, returns the split
+	static int parallel_partition( std::vector<int> &indices, std::vector<int> &scratch, const std::vector< trimesh::vec > &centroids,
+		const int begin, const int end, const int axis, const float center );
+
+	// Working copy of a FlatBVH for treelet restructuring. Indexed by node in the
+	// original array, left is -1 for leaves. Costs are not normalized by the root area.
+	struct TreeletTree {
+		std::vector<int> left, right, n_prims;
+		std::vector< AABB > aabbs;
+		std::vector< float > costs;
+		std::vector< char > collapsed;
+		int max_leaf_size;
+		float traversal_cost;
+	};
+	static const int treelet_size = 7;
+	static void optimize_subtree( TreeletTree &tree, const int node, const int min_prims );
+	static void optimize_treelet( TreeletTree &tree, const int node );
+	static int emit_treelets( const FlatBVH &old_bvh, const TreeletTree &tree, FlatBVH &bvh, const int node );
+	static void gather_prims( const FlatBVH &old_bvh, const TreeletTree &tree, FlatBVH &bvh, const int node );
+
+	template< int N > static int collapse_wide( const FlatBVH &bvh, WideBVH<N> &wide, const int node );
+
+	static int sah_split( FlatBVH &bvh, const std::vector< AABB > &prim_aabbs, const std::vector< trimesh::vec > &centroids,
+		const int begin, const int end, const int max_leaf_size, const float traversal_cost, const int n_bins );
+
+	// A (possibly clipped) primitive reference of the split bvh, and the build parameters.
+	// Triangles have their three vertices in tri_verts, other primitives (and swept triangles) have null.
+	struct SBVHRef { AABB aabb; int prim; };
+	struct SBVHState {
+		std::vector< const trimesh::vec* > tri_verts;
+		int max_leaf_size, n_bins, budget;
+		float traversal_cost, min_overlap_area;
+	};
+	static const int sbvh_max_depth = 64; // no spatial splits below this
+	static int sbvh_split( FlatBVH &bvh, SBVHState &state, std::vector< SBVHRef > &refs, const int depth );
+	static AABB clip_ref( const SBVHState &state, const SBVHRef &ref, const int axis, const float lo, const float hi );
 };
 
 
@@ -0,0 +1,69 @@
+// Copyright 2016 Matthew Overby.
+// 
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#ifndef MCLSCENE_BVHCACHE_H
+#define MCLSCENE_BVHCACHE_H 1
+
+#include "BVH.hpp"
+
+namespace mcl {
+
+//
+//	Saves a built FlatBVH to a binary file and loads it back with mmap.
+//	The file stores the nodes and primitive order along with a hash of the geometry
+//	and a description of the builder, and only loads if both match.
+//
+class BVHCache {
+public:
+	// Hash of the primitive bounds and triangle vertices in order, which is what the builders
+	// look at (the sbvh clips the triangles themselves). The same input makes the same tree,
+	// so this is used as the cache key.
+	static unsigned long long geometry_hash( const BVHPrimitives &prims );
+
+	// Writes the tree to filename, returns true on success.
+	// Builder is the type and parameters of the build, e.g. "sah".
+	static bool save( std::string filename, const FlatBVH &bvh, unsigned long long hash, std::string builder );
+
+	// Maps the file and fills the nodes and prim_indices of the bvh if the hash and builder match.
+	// The bvh must already have the primitives that the hash was made from. Files with child
+	// offsets or primitive indices out of range are rejected. Returns true on success.
+	static bool load( std::string filename, FlatBVH &bvh, unsigned long long hash, std::string builder );
+
+private:
+	// Start of the file, the node and index arrays follow it
+	struct Header {
+		char magic[8];
+		unsigned int version;
+		unsigned int node_size; // sizeof(FlatNode), catches layout changes
+		unsigned long long hash;
+		char builder[64];
+		long long n_prims;
+		long long n_nodes;
+		long long n_indices;
+	};
+	static const unsigned int version = 1;
+	static void make_header( Header &header, const FlatBVH &bvh, unsigned long long hash, const std::string &builder );
+};
+
+} // end namespace mcl
+
+#endif
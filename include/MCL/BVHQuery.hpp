@@ -0,0 +1,110 @@
+// Copyright 2016 Matthew Overby.
+// 
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#ifndef MCLSCENE_BVHQUERY_H
+#define MCLSCENE_BVHQUERY_H 1
+
+#include "BVH.hpp"
+#include <limits>
+#include <functional>
+
+namespace mcl {
+
+//
+//	Nearest point on the surface to a query point
+//
+struct ClosestPoint {
+	ClosestPoint() : prim(-1), point(0,0,0), bary(0,0,0), dist(std::numeric_limits<float>::max()) {}
+	int prim; // primitive index in the bvh, -1 if nothing was found. For a single mesh this is the face index.
+	trimesh::vec point;
+	trimesh::vec bary; // weights of the triangle's p0, p1 and p2 that give point
+	float dist;
+};
+
+
+//
+//	Overlapping pairs of primitives between two trees or within one. The buffers are
+//	kept between queries, so reusing the same OverlapPairs every frame does not allocate.
+//
+struct OverlapPairs {
+	std::vector< std::pair<int,int> > pairs; // primitive indices, sorted
+	std::vector< std::vector< std::pair<int,int> > > thread_pairs; // filled by each thread
+	std::vector< AABB > aabbs_a, aabbs_b; // bounds of the primitives
+};
+
+
+//
+//	Spatial queries on a FlatBVH other than rays. All of them only read the tree,
+//	so they can run from many threads at once on the same bvh.
+//
+class BVHQuery {
+public:
+	// Closest point to p on the triangle (a,b,c) from the Voronoi regions of its
+	// vertices and edges (Ericson 2005). Bary gets the weights of a, b and c.
+	static trimesh::vec closest_point_triangle( const trimesh::vec &p, const trimesh::vec &a,
+		const trimesh::vec &b, const trimesh::vec &c, trimesh::vec &bary );
+
+	// Closest point on the primitives of the bvh that is within max_dist of point.
+	// Nodes are visited best first from a heap ordered by their distance to the point,
+	// and the search ends once the nearest node is farther than the best point so far.
+	// Primitives that aren't triangles (get_triangle is false) are skipped. Returns true if one was found.
+	static bool closest_point( const FlatBVH &bvh, const trimesh::vec &point, ClosestPoint &result,
+		float max_dist=std::numeric_limits<float>::max() );
+
+	// Closest points of many query points in parallel, reusing a heap on each thread
+	static void closest_points( const FlatBVH &bvh, const std::vector< trimesh::vec > &points,
+		std::vector< ClosestPoint > &results, float max_dist=std::numeric_limits<float>::max() );
+
+	// Appends the primitive index of every primitive whose bounds overlap the box
+	// or sphere to prims, which is not cleared, and returns the number added. References that
+	// a split bvh duplicated are only added once. Nothing is allocated if prims has the capacity.
+	// A split bvh culls by the bounds of its clipped references, so a primitive whose box
+	// overlaps the query but whose surface stays outside of it may be left out.
+	static int overlap_box( const FlatBVH &bvh, const AABB &box, std::vector<int> &prims );
+	static int overlap_sphere( const FlatBVH &bvh, const trimesh::vec &center, float radius, std::vector<int> &prims );
+
+	// Calls the visitor with the index of every primitive whose bounds overlap the box or sphere,
+	// and stops if it returns false. Duplicated references are visited more than once.
+	static void overlap_box( const FlatBVH &bvh, const AABB &box, const std::function<bool (int)> &visitor );
+	static void overlap_sphere( const FlatBVH &bvh, const trimesh::vec &center, float radius, const std::function<bool (int)> &visitor );
+
+	// Pairs of primitives (index in a, index in b) whose bounds overlap, found by
+	// descending both trees at once into the larger node. Pairs of subtrees near the roots are
+	// visited as omp tasks. Returns the number of pairs in result.pairs. Split bvhs cull by their
+	// clipped references like the range queries do.
+	static int overlap( const FlatBVH &a, const FlatBVH &b, OverlapPairs &result );
+
+	// Pairs (i<j) of primitives in one tree whose bounds overlap. With skip_adjacent, triangles
+	// of the same mesh that share a vertex index are left out, since they always touch. Separate
+	// parts that only meet at coincident vertex positions are still reported, and primitives
+	// that aren't mesh triangles are never adjacent.
+	static int self_overlap( const FlatBVH &bvh, OverlapPairs &result, bool skip_adjacent=true );
+
+private:
+	// Heap of (squared distance, node), smallest on top
+	typedef std::vector< std::pair< float, int > > NodeHeap;
+	static bool closest_point( const FlatBVH &bvh, const trimesh::vec &point, ClosestPoint &result, float max_dist, NodeHeap &heap );
+};
+
+} // end namespace mcl
+
+#endif
@@ -0,0 +1,94 @@
+// Copyright 2016 Matthew Overby.
+// 
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#ifndef MCLSCENE_CCD_H
+#define MCLSCENE_CCD_H 1
+
+#include "BVHQuery.hpp"
+#include "TriMesh.h"
+
+namespace mcl {
+
+//
+//	Triangles moving linearly from x0 to x1 over a timestep, as one object to build a bvh from.
+//	The bvh holds the faces as a triangle view with x1 as the end positions, so each triangle is
+//	bounded at both ends of the step without an object for it. Positions are read from the arrays
+//	every time, so after they change BVHBuilder::refit updates the tree. Primitive i is faces[i].
+//
+class SweptMesh : public BaseObject {
+public:
+	// The arrays are not copied and must outlive the mesh and any bvh made from it
+	SweptMesh( const std::vector< trimesh::vec > &x0_, const std::vector< trimesh::vec > &x1_,
+		const std::vector< trimesh::TriMesh::Face > &faces_ ) : x0(&x0_), x1(&x1_), faces(&faces_) {}
+	std::string get_type() const { return "sweptmesh"; }
+
+	void get_aabb( trimesh::vec &bmin, trimesh::vec &bmax );
+
+	bool get_triangle_view( TriangleView &view );
+
+private:
+	const std::vector< trimesh::vec > *x0, *x1;
+	const std::vector< trimesh::TriMesh::Face > *faces;
+};
+
+
+//
+//	Continuous collision detection between the surface triangles of a mesh whose vertices move
+//	linearly from x0 to x1, e.g. a TetMesh's vertices and faces with the end of step positions.
+//	Times of impact are in [0,1] over the step.
+//
+class CCD {
+public:
+	struct Impact {
+		enum { VertexFace, EdgeEdge };
+		int type;
+		int v[4]; // vertex-face: the vertex then the face's vertices, edge-edge: both vertices of each edge
+		double toi;
+	};
+
+	// Makes swept triangles of the faces and builds a bvh over them. When the positions change
+	// (but not the faces), BVHBuilder::refit( bvh ) is enough to update it.
+	static void make_swept_bvh( FlatBVH &bvh, const std::vector< trimesh::vec > &x0,
+		const std::vector< trimesh::vec > &x1, const std::vector< trimesh::TriMesh::Face > &faces );
+
+	// Earliest time the vertex p comes within thickness of the triangle (a,b,c), found from the roots
+	// of the cubic for when they are coplanar. Returns false if they don't collide during the step.
+	static bool vertex_face_toi( const trimesh::vec &p0, const trimesh::vec &a0, const trimesh::vec &b0, const trimesh::vec &c0,
+		const trimesh::vec &p1, const trimesh::vec &a1, const trimesh::vec &b1, const trimesh::vec &c1,
+		double &toi, double thickness=1e-6 );
+
+	// Earliest time the edges (a,b) and (c,d) come within thickness of each other
+	static bool edge_edge_toi( const trimesh::vec &a0, const trimesh::vec &b0, const trimesh::vec &c0, const trimesh::vec &d0,
+		const trimesh::vec &a1, const trimesh::vec &b1, const trimesh::vec &c1, const trimesh::vec &d1,
+		double &toi, double thickness=1e-6 );
+
+	// Self collisions of the surface over the step. Triangle pairs come from the swept bvh (made with
+	// make_swept_bvh from the same arrays), and are broken into vertex-face and edge-edge pairs that don't
+	// share a vertex. The cubics of all pairs are made and culled by their Bernstein coefficients in SIMD
+	// loops, then the rest are solved in parallel. Impacts are sorted by time, returns how many there are.
+	static int self_impacts( const FlatBVH &swept_bvh, const std::vector< trimesh::vec > &x0, const std::vector< trimesh::vec > &x1,
+		const std::vector< trimesh::TriMesh::Face > &faces, std::vector< Impact > &impacts, double thickness=1e-6 );
+};
+
+} // end namespace mcl
+
+#endif
@@ -33,6 +33,21 @@
 ///
 namespace mcl {
 
+//
+//	Triangles of a mesh by vertex index, so that a BVH can hold them without an object
+//	for each one. The arrays belong to the mesh and must outlive any BVH made from it.
+//
+struct TriangleView {
+	TriangleView() : vertices(NULL), end_vertices(NULL), normals(NULL), faces(NULL), material(-1), first_tri(0) {}
+	const std::vector< trimesh::point > *vertices;
+	const std::vector< trimesh::point > *end_vertices; // positions at the end of a sweep, NULL if the mesh isn't moving
+	const std::vector< trimesh::vec > *normals; // NULL to use the face normals
+	const std::vector< trimesh::TriMesh::Face > *faces;
+	int material; // interned id, see BaseObject::get_material_id
+	int first_tri; // primitive index of faces[0] in the BVH, set when the mesh is added to one
+};
+
+
 //
 //	Base, pure virtual
 //
@@ -47,6 +62,33 @@ public:
 	virtual std::string get_material() const { return ""; }
 	virtual bool ray_intersect( intersect::Ray &ray, intersect::Payload &payload ){ return false; }
 
+	// Integer id of get_material(), which SceneManager interns when the object is added (-1 if not)
+	virtual int get_material_id() const { return -1; }
+	virtual void set_material_id( int id ){}
+
+	// Position, normal and material of a hit that ray_intersect filled the payload with.
+	// Only needed for the final hit of a ray, so traversal doesn't compute them for every closer one.
+	virtual void get_surface( const intersect::Ray &ray, const intersect::Payload &payload, intersect::SurfaceHit &hit ){
+		hit.point = ray.origin + ray.direction * float( payload.t_max );
+		hit.n = trimesh::vec( 0, 0, 0 );
+		hit.material = get_material_id();
+	}
+
+	// True if there is any hit within (t_min,t_max). Objects that can test
+	// without filling a payload should override this.
+	virtual bool ray_occluded( intersect::Ray &ray, double t_min, double t_max ){
+		intersect::Payload payload; payload.t_min = t_min; payload.t_max = t_max;
+		return ray_intersect( ray, payload );
+	}
+
+	// Vertices of a triangle primitive, false if the object is not one. Lets SIMD code
+	// test many rays against a triangle without going through ray_intersect.
+	virtual bool get_triangle( trimesh::vec &p0, trimesh::vec &p1, trimesh::vec &p2 ) const { return false; }
+
+	// Meshes fill the view and return true, and BVHs then store their faces as indices
+	// instead of calling get_primitives.
+	virtual bool get_triangle_view( TriangleView &view ){ return false; }
+
 	// If an object is made up of other (smaller) objects, they are needed for BVH construction
 	virtual void get_primitives( std::vector< std::shared_ptr<BaseObject> > &prims ){ prims.push_back( shared_from_this() ); }
 };
@@ -23,6 +23,7 @@
 #define MCLSCENE_RAYINTERSECT_H 1
 
 #include <memory>
+#include <vector>
 #include <Vec.h>
 
 namespace mcl {
@@ -33,16 +34,55 @@ namespace intersect {
 		trimesh::vec origin, direction;
 	};
 
+	// Closest hit so far. Traversal only keeps what is needed to compare and find hits, the
+	// position, normal and material are looked up for the final hit with get_surface.
 	struct Payload {
-		Payload(){ t_min=1e-8; t_max=9999999.0; }
+		Payload(){ t_min=1e-8; t_max=9999999.0; prim=-1; object=-1; u=0.f; v=0.f; }
 		double t_min, t_max;
-		trimesh::vec n, hit_point;
-		std::string material;
+		int prim; // triangle that was hit, as a primitive index of the bvh that holds it
+		int object; // primitive index of the object (e.g. an instance) that was hit, -1 if it was a triangle
+		float u, v; // barycentric weights of the second and third vertex
 	};
 
-	// ray -> triangle without early exit
+	// Surface at a hit, from get_surface of the bvh or object that was traced
+	struct SurfaceHit {
+		SurfaceHit() : material(-1) {}
+		trimesh::vec point, n;
+		int material; // interned id (see SceneManager::material_id), -1 if none
+	};
+
+	// Many rays in SoA layout, each with its own t range
+	struct RayStream {
+		std::vector< float > origin[3], direction[3], t_min, t_max;
+
+		int size() const { return t_min.size(); }
+		void resize( int n ){
+			for( int j=0; j<3; ++j ){ origin[j].resize( n ); direction[j].resize( n ); }
+			t_min.resize( n, 1e-8f ); t_max.resize( n, 9999999.f );
+		}
+		void set( int i, const Ray &ray, float t_min_=1e-8f, float t_max_=9999999.f ){
+			for( int j=0; j<3; ++j ){ origin[j][i] = ray.origin[j]; direction[j][i] = ray.direction[j]; }
+			t_min[i] = t_min_; t_max[i] = t_max_;
+		}
+		void push_back( const Ray &ray, float t_min_=1e-8f, float t_max_=9999999.f ){ resize( size()+1 ); set( size()-1, ray, t_min_, t_max_ ); }
+		Ray get( int i ) const {
+			Ray ray;
+			for( int j=0; j<3; ++j ){ ray.origin[j] = origin[j][i]; ray.direction[j] = direction[j][i]; }
+			return ray;
+		}
+	};
+
+	// Closest hits of a RayStream, in the same order. Misses have prim -1 and t = t_max.
+	// Prim is the primitive index of the hit in the bvh, and n is its interpolated normal.
+	struct HitStream {
+		std::vector< float > t;
+		std::vector< int > prim;
+		std::vector< trimesh::vec > n;
+	};
+
+	// ray -> triangle without early exit, sets the distance and barycentrics of a closer hit
 	static inline bool ray_triangle( const Ray &ray, const trimesh::vec &p0, const trimesh::vec &p1, const trimesh::vec &p2,
-		const trimesh::vec &n0, const trimesh::vec &n1, const trimesh::vec &n2, Payload &payload ){
+		Payload &payload ){
 		using namespace trimesh;
 
 		const vec e0 = p1 - p0;
@@ -54,15 +94,14 @@ namespace intersect {
 
 		float beta  = i.dot( e1 );
 		float gamma = i.dot( e0 );
-		float alpha = 1.f - beta - gamma;
 
 		float t = n.dot( e2 );
 		bool hit = ( (t<payload.t_max) & (t>payload.t_min) & (beta>=0.0f) & (gamma>=0.0f) & (beta+gamma<=1) );
 
 		if( hit ){
-			payload.n = alpha*n0 + beta*n1 + gamma*n2;
 			payload.t_max = t;
-			payload.hit_point = ray.origin + ray.direction*t;
+			payload.u = beta;
+			payload.v = gamma;
 			return true;
 		}
 
@@ -70,6 +109,25 @@ namespace intersect {
 
 	} // end  ray -> triangle
 
+	// ray -> triangle for any hit within (t_min,t_max), without a payload
+	static inline bool ray_triangle_occluded( const Ray &ray, const trimesh::vec &p0, const trimesh::vec &p1, const trimesh::vec &p2,
+		const double t_min, const double t_max ){
+		using namespace trimesh;
+
+		const vec e0 = p1 - p0;
+		const vec e1 = p0 - p2;
+		const vec n = e1.cross( e0 );
+
+		const vec e2 = ( 1.0f / n.dot( ray.direction ) ) * ( p0 - ray.origin );
+		const vec i  = ray.direction.cross( e2 );
+
+		float beta  = i.dot( e1 );
+		float gamma = i.dot( e0 );
+		float t = n.dot( e2 );
+		return ( (t<t_max) & (t>t_min) & (beta>=0.0f) & (gamma>=0.0f) & (beta+gamma<=1) );
+
+	} // end  ray -> triangle occluded
+
 } // end namespace intersect
 
 } // end namespace mcl
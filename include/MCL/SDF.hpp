@@ -0,0 +1,98 @@
+// Copyright 2016 Matthew Overby.
+// 
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#ifndef MCLSCENE_SDF_H
+#define MCLSCENE_SDF_H 1
+
+#include "BVHQuery.hpp"
+#include <unordered_map>
+
+namespace mcl {
+
+//
+//	Sparse narrow band signed distance field. Samples are voxel_size apart and stored in
+//	bricks of brick_size^3 cells, and only bricks within band of the surface are kept.
+//	Distances are negative inside. Bricks store the samples on their far faces too, so
+//	a lookup never reads more than one brick.
+//
+class SDF {
+public:
+	SDF() : origin(0,0,0), voxel_size(0.f), band(0.f) {}
+
+	static const int brick_size = 8; // cells on a side of a brick
+	static const int brick_samples = (brick_size+1)*(brick_size+1)*(brick_size+1);
+
+	// Makes the field of the triangles in the bvh, e.g. scene.get_bvh() or a tree built from a
+	// TriangleMesh or the surface of a TetMesh. Distances come from BVHQuery::closest_point, and signs
+	// from the parity of crossings of rays in three directions. Along each row of samples the sign is
+	// carried over when the two distances show that the surface can't be between them.
+	// Bricks are built in parallel. The surface should be closed, signs are not well defined
+	// around holes and can differ from a per sample parity there.
+	void make( const FlatBVH &bvh, float voxel_size, float band );
+
+	// Trilinear distance at p, and its gradient. Returns false if p is not in a stored brick.
+	// Bricks reach past the band, and samples farther than band from the surface hold +/-band,
+	// so a true return with |dist| near band only means p is at least that far away.
+	bool distance( const trimesh::vec &p, float &dist ) const;
+	bool distance( const trimesh::vec &p, float &dist, trimesh::vec &grad ) const;
+
+	int num_bricks() const { return brick_keys.size(); }
+	void clear(){ brick_map.clear(); brick_keys.clear(); values.clear(); }
+
+	// Binary file of the bricks. Hash is stored with them and load fails if it doesn't match,
+	// e.g. BVHCache::geometry_hash of the mesh's triangles. Both return true on success.
+	bool save( std::string filename, unsigned long long hash=0 ) const;
+	bool load( std::string filename, unsigned long long hash=0 );
+
+	trimesh::vec origin; // position of sample (0,0,0)
+	float voxel_size, band;
+
+private:
+	// Start of the file, the brick keys and values follow it
+	struct Header {
+		char magic[8];
+		unsigned int version;
+		int brick_size;
+		unsigned long long hash;
+		float origin[3];
+		float voxel_size, band;
+		long long n_bricks;
+	};
+	static const unsigned int version = 1;
+
+	// Bricks are keyed by their coordinates, 21 bits each
+	static inline unsigned long long brick_key( int x, int y, int z ){
+		return ( (unsigned long long)x << 42 ) | ( (unsigned long long)y << 21 ) | (unsigned long long)z;
+	}
+
+	// Finds the brick that holds the cell around p, its local cell and the weights within it.
+	// Returns NULL if the brick isn't stored.
+	const float *find_cell( const trimesh::vec &p, int *cell, float *frac ) const;
+
+	std::unordered_map< unsigned long long, int > brick_map; // key to index into brick_keys
+	std::vector< unsigned long long > brick_keys;
+	std::vector< float > values; // brick_samples per brick, x fastest
+};
+
+} // end namespace mcl
+
+#endif
@@ -24,6 +24,8 @@
 
 #include "bsphere.h" // in trimesh2
 #include "BVH.hpp"
+#include "BVHCache.hpp"
+#include "BVHQuery.hpp"
 //#include <boost/function.hpp>
 #include "Camera.hpp"
 #include "Light.hpp"
@@ -53,7 +55,7 @@ typedef std::function<std::shared_ptr<BaseMaterial> ( Component &component )> Bu
 class SceneManager {
 
 	public:
-		SceneManager() { root_bvh=NULL; bsphere.r=0.f; }
+		SceneManager() { root_bvh=NULL; dynamic_bvh=NULL; instance_bvh=NULL; bvh_mode=1; bvh_cost=0.0; bsphere.r=0.f; }
 
 		//
 		// Load a configuration file, can be called multiple times for different files.
@@ -65,10 +67,55 @@ class SceneManager {
 		bool load( std::string xmlfile, bool auto_build=true );
 
 		//
-		// Computes bounding volume heirarchy (AABB)
-		// Type is either spatial (object median) or linear
+		// Computes bounding volume heirarchy (AABB), stored as a flat node array.
+		// Type is either spatial (object median), linear, sah (surface area heuristic),
+		// trbvh (linear followed by treelet restructuring), or sbvh (sah with spatial splits,
+		// for meshes with long triangles).
 		//
-		std::shared_ptr<BVHNode> get_bvh( bool recompute=false, std::string type="linear" );
+		std::shared_ptr<FlatBVH> get_bvh( bool recompute=false, std::string type="linear" );
+
+		//
+		// Stats of the last get_bvh build (or cache load), see BVHStats.
+		//
+		const BVHStats &get_bvh_stats() const { return bvh_stats; }
+
+		//
+		// Two level bvh. Each object gets a bvh of its own that is built once (sah), and the top level
+		// is a bvh over the instances, built by type. Instances are made for new objects on each call.
+		// After moving instances (BVHInstance::set_xform) or adding more of them, only the
+		// top level needs to be rebuilt with recompute=true.
+		//
+		std::shared_ptr<FlatBVH> get_instance_bvh( bool recompute=false, std::string type="sah" );
+		std::vector< std::shared_ptr<BVHInstance> > instances;
+
+		//
+		// Directory of the on-disk bvh cache, empty (default) to disable it. When set, get_bvh
+		// loads a tree that was saved for the same geometry and type instead of building it,
+		// and saves the tree after every build otherwise.
+		//
+		void set_bvh_cache( std::string directory ){ bvh_cache_dir = directory; }
+
+		//
+		// Updates the bvh bounds after object vertices have moved, without changing the tree.
+		// Topology must be the same as when the bvh was built. If the SAH cost has grown
+		// past rebuild_ratio times the cost of the last build, the bvh is rebuilt instead.
+		//
+		std::shared_ptr<FlatBVH> refit_bvh( float rebuild_ratio=1.5f );
+
+		//
+		// BVH that is updated in place by add_object and remove_object instead of being rebuilt.
+		// It is made by inserting the primitives of all objects on the first call.
+		//
+		std::shared_ptr<DynamicBVH> get_dynamic_bvh( bool recompute=false );
+
+		//
+		// Adds or removes an object after the scene was built. The primitives of the object
+		// are inserted into (or removed from) the dynamic bvh, if it has been made.
+		// The bvh from get_bvh is out of date after this and is rebuilt on its next call.
+		// remove_object returns false if the object is not in the scene.
+		//
+		void add_object( std::shared_ptr<BaseObject> obj, std::string name="" );
+		bool remove_object( std::shared_ptr<BaseObject> obj );
 
 		//
 		// Computes an exact world bounding sphere
@@ -112,17 +159,37 @@ class SceneManager {
 		std::unordered_map< std::string, std::shared_ptr<BaseCamera> > cameras_map; // name -> camera
 		std::unordered_map< std::string, std::shared_ptr<BaseLight> > lights_map; // name -> light
 
+		//
+		// Material names are interned to integer ids, which objects are given by add_object
+		// and ray hits report (see intersect::SurfaceHit). material_id adds the name if it is new,
+		// and returns -1 for an empty name. get_material is NULL if no material has the name.
+		//
+		int material_id( const std::string &name );
+		std::shared_ptr<BaseMaterial> get_material( int id );
+		std::vector< std::string > material_names; // id -> name
+
 		//
 		// Vector of trimeshes for objects that have the get_TriMesh() function,
-		// filled by the build_meshes() function which is called by build_components().
+		// filled by the build_meshes() function which is called by build_components(),
+		// and by add_object for meshes added later.
 		// I use this for OpenGL rendering of scenes.
 		//
 		std::vector< std::shared_ptr<trimesh::TriMesh> > meshes;
 
 	protected:
 		// Root bvh is created by build_bvh
-		void build_bvh( int split_mode ); // 0=object median, 1=linear (parallel)
-		std::shared_ptr<BVHNode> root_bvh;
+		void build_bvh( int split_mode ); // 0=object median, 1=linear (parallel), 2=sah, 3=trbvh, 4=sbvh
+		std::shared_ptr<FlatBVH> root_bvh;
+		int bvh_mode; // split mode of the last build
+		double bvh_cost; // SAH cost of the last build, used by refit_bvh
+		BVHStats bvh_stats;
+		std::string bvh_cache_dir;
+		std::shared_ptr<FlatBVH> instance_bvh;
+		std::unordered_map< BaseObject*, std::shared_ptr<FlatBVH> > object_blas; // bottom levels of get_instance_bvh
+		std::shared_ptr<DynamicBVH> dynamic_bvh;
+		std::unordered_map< BaseObject*, std::vector<int> > dynamic_handles; // object -> handles in dynamic_bvh
+		std::unordered_map< std::string, int > material_ids; // name -> id
+		void insert_dynamic( std::shared_ptr<BaseObject> obj );
 
 		// Builder vectors
 		void build_meshes(); // fills the meshes vector, called by build_components
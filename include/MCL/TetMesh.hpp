@@ -45,7 +45,7 @@ public:
 	std::vector< trimesh::TriMesh::Face > &faces; // surface triangles
 
 	TetMesh( std::string mat="" ) : tris(new trimesh::TriMesh), vertices(tris->vertices), normals(tris->normals), faces(tris->faces),
-		material(mat), aabb(new AABB) {}
+		material(mat), material_id(-1), aabb(new AABB) {}
 
 	std::string get_type() const { return "tetmesh"; }
 
@@ -64,8 +64,16 @@ public:
 
 	std::string get_material() const { return material; }
 
+	int get_material_id() const { return material_id; }
+
+	// Triangle refs made before are remade with the new id
+	void set_material_id( int id ){ material_id = id; tri_refs.clear(); }
+
 	void get_aabb( trimesh::vec &bmin, trimesh::vec &bmax );
 
+	bool get_triangle_view( TriangleView &view );
+
+	// Only made for callers that need an object per triangle, BVHs use the triangle view
 	void get_primitives( std::vector< std::shared_ptr<BaseObject> > &prims ){
 		if( tri_refs.size() != faces.size() ){ make_tri_refs(); }
 		prims.insert( prims.end(), tri_refs.begin(), tri_refs.end() );
@@ -73,6 +81,7 @@ public:
 
 private:
 	std::string material;
+	int material_id;
 	std::shared_ptr<AABB> aabb;
 
 	bool load_node( std::string filename );
@@ -34,23 +34,38 @@ namespace mcl {
 class TriangleRef : public BaseObject {
 public:
 	TriangleRef( trimesh::vec *p0_, trimesh::vec *p1_, trimesh::vec *p2_,
-		trimesh::vec *n0_, trimesh::vec *n1_, trimesh::vec *n2_, std::string mat="" ) :
+		trimesh::vec *n0_, trimesh::vec *n1_, trimesh::vec *n2_, int mat=-1 ) :
 		p0(p0_), p1(p1_), p2(p2_), n0(n0_), n1(n1_), n2(n2_), material(mat) {}
 
 	std::string get_type() const { return "triangle"; }
 
 	trimesh::vec *p0, *p1, *p2, *n0, *n1, *n2;
-	std::string material;
+	int material; // interned id of the mesh's material
 
 	void get_aabb( trimesh::vec &bmin, trimesh::vec &bmax ){
 		AABB aabb; aabb += *p0; aabb += *p1; aabb += *p2;
 		bmin = aabb.min; bmax = aabb.max;
 	}
 
+	int get_material_id() const { return material; }
+
 	bool ray_intersect( intersect::Ray &ray, intersect::Payload &payload ){
-		bool hit = intersect::ray_triangle( ray, *p0, *p1, *p2, *n0, *n1, *n2, payload );
-		if( hit ){ payload.material = material; }
-		return hit;
+		return intersect::ray_triangle( ray, *p0, *p1, *p2, payload );
+	}
+
+	void get_surface( const intersect::Ray &ray, const intersect::Payload &payload, intersect::SurfaceHit &hit ){
+		hit.point = ray.origin + ray.direction * float( payload.t_max );
+		hit.n = ( 1.f - payload.u - payload.v ) * (*n0) + payload.u * (*n1) + payload.v * (*n2);
+		hit.material = material;
+	}
+
+	bool ray_occluded( intersect::Ray &ray, double t_min, double t_max ){
+		return intersect::ray_triangle_occluded( ray, *p0, *p1, *p2, t_min, t_max );
+	}
+
+	bool get_triangle( trimesh::vec &p0_, trimesh::vec &p1_, trimesh::vec &p2_ ) const {
+		p0_ = *p0; p1_ = *p1; p2_ = *p2;
+		return true;
 	}
 };
 
@@ -63,7 +78,7 @@ private: std::shared_ptr<trimesh::TriMesh> tris; // tris is actually the data co
 public:
 	TriangleMesh( std::shared_ptr<trimesh::TriMesh> tm, std::string mat="" ) :
 		tris(tm), vertices(tm->vertices), normals(tm->normals), faces(tm->faces),
-		material(mat), aabb(new AABB) {}
+		aabb(new AABB), material(mat), material_id(-1) {}
 
 	// Mesh data
 	std::vector<trimesh::point> &vertices;
@@ -78,8 +93,16 @@ public:
 
 	std::string get_material() const { return material; }
 
+	int get_material_id() const { return material_id; }
+
+	// Triangle refs made before are remade with the new id
+	void set_material_id( int id ){ material_id = id; tri_refs.clear(); }
+
 	void get_aabb( trimesh::vec &bmin, trimesh::vec &bmax );
 
+	bool get_triangle_view( TriangleView &view );
+
+	// Only made for callers that need an object per triangle, BVHs use the triangle view
 	void get_primitives( std::vector< std::shared_ptr<BaseObject> > &prims ){
 		if( tri_refs.size() != faces.size() ){ make_tri_refs(); }
 		prims.insert( prims.end(), tri_refs.begin(), tri_refs.end() );
@@ -88,6 +111,7 @@ public:
 private:
 	std::shared_ptr<AABB> aabb;
 	std::string material;
+	int material_id;
 
 	// Triangle refs are used for BVH hook-in.
 	void make_tri_refs();
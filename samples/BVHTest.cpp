@@ -10,6 +10,7 @@ int main(int argc, char *argv[]){
 	std::vector<std::string> types;
 	types.push_back( "spatial" );
 	types.push_back( "linear" );
+	types.push_back( "sah" );
 
 	for( int i=0; i<types.size(); ++i ){
 
@@ -34,7 +35,7 @@ int main(int argc, char *argv[]){
 			// Time the rebuild
 			std::chrono::time_point<std::chrono::system_clock> start, end;
 			start = std::chrono::system_clock::now();
-			std::shared_ptr<BVHNode> bvh = scene.get_bvh(true,types[i]);
+			std::shared_ptr<FlatBVH> bvh = scene.get_bvh(true,types[i]);
 			end = std::chrono::system_clock::now();
 			std::chrono::duration<double> elapsed_seconds = end-start;
 
@@ -42,7 +43,7 @@ int main(int argc, char *argv[]){
 			// the number of nodes in the tree.
 			oss << 0 << "\t" << elapsed_seconds.count();
 			std::string line = oss.str();
-			std::cout << types[i] << ", " << j << ":\t" << line << std::endl;
+			std::cout << types[i] << ", " << j << ":\t" << line << "\tsah_cost: " << bvh->sah_cost() << std::endl;
 
 			// Skip first iteration: overly fast because it skips reallocations
 			// with deletes in my trimesh geometry class.
@@ -63,9 +64,10 @@ void clip_mesh( mcl::SceneManager &scene ){
 
 	if( scene.objects.size() != 1 ){ return; }
 
-	std::shared_ptr<BVHNode> bvh = scene.get_bvh(false);
+	std::shared_ptr<FlatBVH> bvh = scene.get_bvh(false);
 	trimesh::TriMesh *mesh = scene.objects[0]->get_TriMesh().get();
-	trimesh::box b( bvh->aabb->min ); b+=bvh->aabb->max;
+	AABB bounds = bvh->bounds();
+	trimesh::box b( bounds.min ); b+=bounds.max;
 	b.min[1] += ((b.max[1]-b.min[1])*0.05f); // increase the bmin and clip
 	trimesh::clip( mesh, b );
 	trimesh::remove_unused_vertices( mesh );
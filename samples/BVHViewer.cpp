@@ -41,21 +41,19 @@ int main(int argc, char *argv[]){
 
 void render_callback(){
 
-	std::shared_ptr<BVHNode> bvh = scene.get_bvh();
+	std::shared_ptr<FlatBVH> bvh = scene.get_bvh();
+	if( bvh->nodes.size()==0 ){ return; }
 	if( !view_all ){
 		edges.clear();
+		int node = 0;
 		for( int i=0; i<traversal.size(); ++i ){
 			bool right = traversal[i];
-			if( right ){
-				if( bvh->right_child != NULL ){ bvh = bvh->right_child; }
-				else{ traversal.pop_back(); }
-			} else {
-				if( bvh->left_child != NULL ){ bvh = bvh->left_child; }
-				else{ traversal.pop_back(); }
-			}
+			if( bvh->nodes[node].is_leaf() ){ traversal.pop_back(); }
+			else if( right ){ node = bvh->nodes[node].offset; }
+			else { node = node+1; }
 		}
 	
-		bvh->aabb->get_edges( edges );
+		bvh->nodes[node].bounds().get_edges( edges );
 	} else if( edges.size()<=24 ) {
 		bvh->get_edges( edges );
 	}
@@ -118,8 +116,8 @@ void scale_mesh( std::string dir ){
 
 	scene.objects[0]->apply_xform( scale );
 
-	// Recomputed bounding volumes
-	scene.get_bvh(true,bvh_mode);
+	// Recomputed bounding volumes, the topology didn't change so a refit is enough
+	scene.refit_bvh();
 	scene.get_bsphere(true);
 
 }
@@ -130,9 +128,10 @@ void refine_mesh( std::string amt ){
 	edges.clear();
 	if( scene.objects.size() != 1 ){ return; }
 
-	std::shared_ptr<BVHNode> bvh = scene.get_bvh();
+	std::shared_ptr<FlatBVH> bvh = scene.get_bvh();
 	trimesh::TriMesh *mesh = scene.objects[0]->get_TriMesh().get();
-	trimesh::box b( bvh->aabb->min ); b+=bvh->aabb->max;
+	AABB bounds = bvh->bounds();
+	trimesh::box b( bounds.min ); b+=bounds.max;
 	b.min[1] += ((b.max[1]-b.min[1])*0.05f);
 
 	std::cout << "Clipping mesh. Vertices before: " << scene.objects[0]->get_TriMesh()->vertices.size() << std::flush;
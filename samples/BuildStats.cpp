@@ -0,0 +1,55 @@
+#include "MCL/SceneManager.hpp"
+#include "TriMesh_algo.h"
+
+using namespace mcl;
+
+//
+//	Builds each type of BVH for a scene and prints its stats, followed by a table
+//	comparing the builders relative to the one with the lowest SAH cost.
+//	Usage: bvh_stats <scene.xml> <subdivisions>
+//	Subdivisions are loop subdivision steps on every mesh, to make a larger scene out of a small one.
+//
+int main(int argc, char *argv[]){
+
+	std::string file = std::string(MCLSCENE_SRC_DIR) + "/conf/Bunny.xml";
+	if( argc > 1 ){ file = std::string(argv[1]); }
+	int n_subdiv = 0;
+	if( argc > 2 ){ n_subdiv = std::stoi( argv[2] ); }
+
+	SceneManager scene;
+	if( !scene.load( file ) ){ return 0; }
+	for( int i=0; i<scene.objects.size(); ++i ){
+		std::shared_ptr<trimesh::TriMesh> mesh = scene.objects[i]->get_TriMesh();
+		if( mesh == NULL ){ continue; }
+		for( int j=0; j<n_subdiv; ++j ){ trimesh::subdiv( mesh.get() ); }
+	}
+
+	std::vector<std::string> types;
+	types.push_back( "spatial" );
+	types.push_back( "linear" );
+	types.push_back( "trbvh" );
+	types.push_back( "sah" );
+	types.push_back( "sbvh" );
+
+	std::vector< BVHStats > stats;
+	for( int i=0; i<types.size(); ++i ){
+		scene.get_bvh( true, types[i] );
+		stats.push_back( scene.get_bvh_stats() );
+		printf( "\n%s:\n", types[i].c_str() );
+		stats.back().print();
+		printf( "\n" );
+	}
+
+	int best = 0;
+	for( int i=1; i<stats.size(); ++i ){ if( stats[i].sah_cost < stats[best].sah_cost ){ best = i; } }
+
+	printf( "type\tnodes\tleaves\tdepth\tleaf size\tMB\toverlap\tbuild (s)\tSAH cost\n" );
+	for( int i=0; i<stats.size(); ++i ){
+		const BVHStats &s = stats[i];
+		printf( "%s\t%d\t%d\t%d\t%.2f\t\t%.2f\t%.3f\t%f\t%f (%.2fx)%s\n", types[i].c_str(), s.n_nodes, s.n_leaves,
+			s.max_depth, s.avg_leaf_size(), double(s.memory)/(1024.0*1024.0), s.sibling_overlap, s.build_time(),
+			s.sah_cost, s.sah_cost / stats[best].sah_cost, i==best ? "\tlowest" : "" );
+	}
+
+	return 0;
+}
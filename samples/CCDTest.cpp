@@ -0,0 +1,156 @@
+#include "MCL/CCD.hpp"
+#include <algorithm>
+#include <random>
+
+using namespace mcl;
+
+typedef trimesh::TriMesh::Face Face;
+typedef trimesh::vec vec;
+
+// Counts a mismatch if the time of impact isn't the expected one (negative for no impact)
+static int check_toi( const char *name, bool hit, double toi, double expected ){
+	const bool ok = hit ? ( expected >= 0.0 && std::abs( toi-expected ) < 1e-6 ) : expected < 0.0;
+	printf( "%s: %s %f, expected %f\n", name, hit ? "impact at" : "no impact", hit ? toi : -1.0, expected );
+	return ok ? 0 : 1;
+}
+
+// Two sheets of (n+1)^2 vertices, the second falls through the first over the step
+static void make_sheets( const int n, std::vector< vec > &x0, std::vector< vec > &x1, std::vector< Face > &faces ){
+	std::mt19937 gen( 0 );
+	std::uniform_real_distribution<float> rand( -1.f, 1.f );
+	for( int s=0; s<2; ++s ){
+		const int base = x0.size();
+		for( int j=0; j<=n; ++j ){
+			for( int i=0; i<=n; ++i ){
+				const float x = i/float(n), y = j/float(n);
+				if( s==0 ){
+					x0.push_back( vec( x, y, 0.f ) );
+					x1.push_back( x0.back() + vec( rand(gen), rand(gen), rand(gen) )*0.002f );
+				}
+				else {
+					const float xs = x*0.8f + 0.1f, ys = y*0.8f + 0.1f;
+					x0.push_back( vec( xs, ys, 0.5f + 0.1f*xs ) );
+					x1.push_back( vec( xs, ys, -0.5f + 0.1f*xs ) );
+				}
+			}
+		}
+		for( int j=0; j<n; ++j ){
+			for( int i=0; i<n; ++i ){
+				const int a = base + j*(n+1) + i;
+				faces.push_back( Face( a, a+1, a+n+2 ) );
+				faces.push_back( Face( a, a+n+2, a+n+1 ) );
+			}
+		}
+	}
+}
+
+// Impacts of all vertex-face and edge-edge pairs that don't share a vertex, with their vertices ordered as in self_impacts
+static void brute_force( const std::vector< vec > &x0, const std::vector< vec > &x1, const std::vector< Face > &faces,
+	std::vector< CCD::Impact > &impacts ){
+
+	impacts.clear();
+	for( int v=0; v<x0.size(); ++v ){
+		for( int f=0; f<faces.size(); ++f ){
+			const Face &g = faces[f];
+			double toi;
+			if( g.indexof( v ) >= 0 ){ continue; }
+			if( !CCD::vertex_face_toi( x0[v], x0[g[0]], x0[g[1]], x0[g[2]], x1[v], x1[g[0]], x1[g[1]], x1[g[2]], toi ) ){ continue; }
+			CCD::Impact impact = { CCD::Impact::VertexFace, { v, g[0], g[1], g[2] }, toi };
+			impacts.push_back( impact );
+		}
+	}
+
+	std::vector< std::pair<int,int> > edges;
+	for( int f=0; f<faces.size(); ++f ){
+		for( int j=0; j<3; ++j ){
+			const int a = faces[f][j], b = faces[f][(j+1)%3];
+			edges.push_back( std::make_pair( std::min( a, b ), std::max( a, b ) ) );
+		}
+	}
+	std::sort( edges.begin(), edges.end() );
+	edges.erase( std::unique( edges.begin(), edges.end() ), edges.end() );
+	for( int i=0; i<edges.size(); ++i ){
+		for( int j=i+1; j<edges.size(); ++j ){
+			const std::pair<int,int> &a = edges[i], &b = edges[j];
+			if( a.first==b.first || a.first==b.second || a.second==b.first || a.second==b.second ){ continue; }
+			double toi;
+			if( !CCD::edge_edge_toi( x0[a.first], x0[a.second], x0[b.first], x0[b.second],
+				x1[a.first], x1[a.second], x1[b.first], x1[b.second], toi ) ){ continue; }
+			CCD::Impact impact = { CCD::Impact::EdgeEdge, { a.first, a.second, b.first, b.second }, toi };
+			impacts.push_back( impact );
+		}
+	}
+}
+
+// True if both have the same impacts at the same times
+static bool same_impacts( const std::vector< CCD::Impact > &a, const std::vector< CCD::Impact > &b ){
+	if( a.size() != b.size() ){ return false; }
+	std::vector< std::vector<double> > sa, sb;
+	for( int i=0; i<a.size(); ++i ){
+		double ka[6] = { double(a[i].type), double(a[i].v[0]), double(a[i].v[1]), double(a[i].v[2]), double(a[i].v[3]), a[i].toi };
+		double kb[6] = { double(b[i].type), double(b[i].v[0]), double(b[i].v[1]), double(b[i].v[2]), double(b[i].v[3]), b[i].toi };
+		sa.push_back( std::vector<double>( ka, ka+6 ) );
+		sb.push_back( std::vector<double>( kb, kb+6 ) );
+	}
+	std::sort( sa.begin(), sa.end() );
+	std::sort( sb.begin(), sb.end() );
+	return sa == sb;
+}
+
+//
+//	Checks the vertex-face and edge-edge times of impact on cases with a known answer, then
+//	the self impacts of a sheet falling through another against all element pairs, before and
+//	after the positions change and the swept bvh is refit. Returns 1 on a mismatch.
+//	Usage: test_ccd
+//
+int main(int argc, char *argv[]){
+
+	int n_wrong = 0;
+	double toi = -1.0;
+	bool hit;
+
+	// A point falling through a still triangle halfway, and past it
+	hit = CCD::vertex_face_toi( vec(0.2,0.2,1), vec(0,0,0), vec(1,0,0), vec(0,1,0),
+		vec(0.2,0.2,-1), vec(0,0,0), vec(1,0,0), vec(0,1,0), toi );
+	n_wrong += check_toi( "vertex-face", hit, toi, 0.5 );
+	hit = CCD::vertex_face_toi( vec(0.8,0.8,1), vec(0,0,0), vec(1,0,0), vec(0,1,0),
+		vec(0.8,0.8,-1), vec(0,0,0), vec(1,0,0), vec(0,1,0), toi );
+	n_wrong += check_toi( "vertex-face miss", hit, toi, -1.0 );
+
+	// A triangle rising into a still point three quarters of the way
+	hit = CCD::vertex_face_toi( vec(0.2,0.2,0.75), vec(0,0,0), vec(1,0,0), vec(0,1,0),
+		vec(0.2,0.2,0.75), vec(0,0,1), vec(1,0,1), vec(0,1,1), toi );
+	n_wrong += check_toi( "moving face", hit, toi, 0.75 );
+
+	// Crossed edges meeting a quarter of the way, and parallel edges that never do
+	hit = CCD::edge_edge_toi( vec(-1,0,1), vec(1,0,1), vec(0,-1,0), vec(0,1,0),
+		vec(-1,0,-3), vec(1,0,-3), vec(0,-1,0), vec(0,1,0), toi );
+	n_wrong += check_toi( "edge-edge", hit, toi, 0.25 );
+	hit = CCD::edge_edge_toi( vec(-1,0,1), vec(1,0,1), vec(-1,0.5,0), vec(1,0.5,0),
+		vec(-1,0,-1), vec(1,0,-1), vec(-1,0.5,0), vec(1,0.5,0), toi );
+	n_wrong += check_toi( "edge-edge miss", hit, toi, -1.0 );
+
+	std::vector< vec > x0, x1;
+	std::vector< Face > faces;
+	make_sheets( 10, x0, x1, faces );
+	FlatBVH bvh;
+	CCD::make_swept_bvh( bvh, x0, x1, faces );
+
+	for( int step=0; step<2; ++step ){
+		if( step==1 ){
+			// Slower, so only the lower side of the second sheet gets through the first
+			for( int i=0; i<x1.size()/2; ++i ){ x1[x1.size()/2+i][2] = x0[x1.size()/2+i][2] - 0.56f; }
+			BVHBuilder::refit( bvh );
+		}
+		std::vector< CCD::Impact > impacts, expected;
+		CCD::self_impacts( bvh, x0, x1, faces, impacts );
+		brute_force( x0, x1, faces, expected );
+		const bool sorted = std::is_sorted( impacts.begin(), impacts.end(),
+			[]( const CCD::Impact &a, const CCD::Impact &b ){ return a.toi < b.toi; } );
+		if( !sorted || !same_impacts( impacts, expected ) ){ ++n_wrong; }
+		printf( "step %d: %d impacts, %d by brute force, earliest %f\n", step, int(impacts.size()),
+			int(expected.size()), impacts.size() ? impacts[0].toi : -1.0 );
+	}
+
+	return n_wrong > 0 ? 1 : 0;
+}
@@ -0,0 +1,68 @@
+#include "MCL/SceneManager.hpp"
+#include "MCL/BVHQuery.hpp"
+#include <random>
+
+using namespace mcl;
+
+// Distance from point to the nearest triangle of the bvh, by testing all of them
+static float brute_force_dist( const FlatBVH &bvh, const trimesh::vec &point ){
+	float best = std::numeric_limits<float>::max();
+	for( int p=0; p<bvh.num_prims(); ++p ){
+		trimesh::vec p0, p1, p2, bary;
+		if( !bvh.prim_triangle( p, p0, p1, p2 ) ){ continue; }
+		best = std::min( best, trimesh::dist( point, BVHQuery::closest_point_triangle( point, p0, p1, p2, bary ) ) );
+	}
+	return best;
+}
+
+//
+//	Checks closest points from the bvh against the nearest of all triangles, for points
+//	around and inside of the scene. The point must also be where its barycentric weights put
+//	it on the triangle, and a max_dist short of it must find nothing. Returns 1 on a mismatch.
+//	Usage: test_closest_point <scene.xml>
+//
+int main(int argc, char *argv[]){
+
+	std::string file = std::string(MCLSCENE_SRC_DIR) + "/conf/Bunny.xml";
+	if( argc > 1 ){ file = std::string(argv[1]); }
+
+	SceneManager scene;
+	if( !scene.load( file ) ){ return 1; }
+
+	std::vector<std::string> types;
+	types.push_back( "linear" );
+	types.push_back( "sah" );
+	types.push_back( "sbvh" );
+
+	int n_wrong = 0;
+	for( int t=0; t<types.size(); ++t ){
+
+		std::shared_ptr<FlatBVH> bvh = scene.get_bvh( true, types[t] );
+		AABB bounds = bvh->bounds();
+		trimesh::vec extent = bounds.max - bounds.min;
+		std::mt19937 gen( 0 );
+		std::uniform_real_distribution<float> rand( -0.5f, 1.5f );
+
+		std::vector< trimesh::vec > points( 256 );
+		for( int i=0; i<points.size(); ++i ){
+			points[i] = bounds.min + trimesh::vec( rand(gen), rand(gen), rand(gen) ) * extent;
+		}
+		std::vector< ClosestPoint > results;
+		BVHQuery::closest_points( *bvh, points, results );
+
+		int wrong = 0;
+		for( int i=0; i<points.size(); ++i ){
+			const ClosestPoint &cp = results[i];
+			if( cp.prim < 0 || std::abs( cp.dist - brute_force_dist( *bvh, points[i] ) ) > 1e-6f ){ ++wrong; continue; }
+			trimesh::vec p0, p1, p2;
+			bvh->prim_triangle( cp.prim, p0, p1, p2 );
+			if( trimesh::dist( p0*cp.bary[0] + p1*cp.bary[1] + p2*cp.bary[2], cp.point ) > 1e-5f ){ ++wrong; continue; }
+			ClosestPoint bounded;
+			if( BVHQuery::closest_point( *bvh, points[i], bounded, cp.dist*0.99f ) ){ ++wrong; }
+		}
+		printf( "%s: %d of %d closest points differ from brute force\n", types[t].c_str(), wrong, int(points.size()) );
+		n_wrong += wrong;
+	}
+
+	return n_wrong > 0 ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+
+#include "MCL/SceneManager.hpp"
+#include <random>
+#include <unordered_set>
+
+using namespace mcl;
+
+// The encoder used before 63-bit codes, 1024 cells per axis and a loop over every bit.
+// Shifts past the word width are skipped so that it is defined behavior.
+static inline morton_type legacy_morton_encode( const morton_encode_type x, const morton_encode_type y, const morton_encode_type z ){
+	int n_iters = sizeof(morton_type)*8;
+	morton_type result = 0;
+	for( morton_type i = 0; i<n_iters; ++i ){
+		if( i*3+2 >= n_iters ){ continue; }
+		result |= (x & (morton_type(1) << i)) << i*2
+			| (y & (morton_type(1) << i)) << (i*2 + 1)
+			| (z & (morton_type(1) << i)) << (i*2 + 2);
+	}
+	return result;
+}
+
+static void legacy_morton_codes( const std::vector< trimesh::vec > &centroids, const AABB &bounds,
+	std::vector< std::pair< morton_type, int > > &codes ){
+	trimesh::vec world_len = 1024.f / ( bounds.max - bounds.min );
+	codes.resize( centroids.size() );
+	#pragma omp parallel for
+	for( int i=0; i<centroids.size(); ++i ){
+		trimesh::vec cent = ( centroids[i] - bounds.min ) * world_len;
+		codes[i] = std::make_pair( legacy_morton_encode( morton_encode_type( cent[0] ),
+			morton_encode_type( cent[1] ), morton_encode_type( cent[2] ) ), i );
+	}
+}
+
+static int count_unique( const std::vector< std::pair< morton_type, int > > &codes ){
+	std::unordered_set< morton_type > unique;
+	for( int i=0; i<codes.size(); ++i ){ unique.insert( codes[i].first ); }
+	return unique.size();
+}
+
+template< typename F > static double time_it( int n_runs, F func ){
+	double best = std::numeric_limits<double>::max();
+	for( int i=0; i<n_runs; ++i ){
+		std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+		func();
+		std::chrono::duration<double> elapsed = std::chrono::system_clock::now()-start;
+		best = std::min( best, elapsed.count() );
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]){
+
+	// Use the triangle centroids of a scene if given, otherwise random points
+	std::vector< trimesh::vec > centroids;
+	AABB bounds;
+	if( argc > 1 ){
+		SceneManager scene;
+		if( !scene.load( std::string(argv[1]) ) ){ return 0; }
+		BVHPrimitives prims;
+		prims.add_objects( scene.objects );
+		for( int i=0; i<prims.num_prims(); ++i ){
+			trimesh::vec bmin, bmax; prims.prim_aabb( i, bmin, bmax );
+			centroids.push_back( (bmin+bmax)*0.5f );
+			bounds += centroids.back();
+		}
+	} else {
+		std::mt19937 gen( 0 );
+		std::uniform_real_distribution<float> rand( -1.f, 1.f );
+		centroids.resize( 1<<22 );
+		for( int i=0; i<centroids.size(); ++i ){
+			centroids[i] = trimesh::vec( rand(gen), rand(gen), rand(gen) );
+			bounds += centroids[i];
+		}
+	}
+	printf( "Morton codes for %d points\n", int(centroids.size()) );
+
+	const int n_runs = 5;
+	std::vector< std::pair< morton_type, int > > legacy, magic, bmi2;
+	double t_legacy = time_it( n_runs, [&](){ legacy_morton_codes( centroids, bounds, legacy ); } );
+	double t_magic = time_it( n_runs, [&](){ BVHBuilder::morton_codes( centroids, bounds, magic, false ); } );
+	printf( "legacy encode:\t%f s\t%d unique codes\n", t_legacy, count_unique( legacy ) );
+	printf( "magic encode:\t%f s\t%d unique codes\n", t_magic, count_unique( magic ) );
+	if( BVHBuilder::has_bmi2() ){
+		double t_bmi2 = time_it( n_runs, [&](){ BVHBuilder::morton_codes( centroids, bounds, bmi2, true ); } );
+		printf( "bmi2 encode:\t%f s\t%s\n", t_bmi2, bmi2==magic ? "same as magic" : "DIFFERS from magic" );
+	}
+	else { printf( "bmi2 encode:\tnot supported by this cpu\n" ); }
+
+	// Sort a copy each run
+	std::vector< std::pair< morton_type, int > > sorted, radix;
+	double t_sort = time_it( n_runs, [&](){ sorted = magic; std::sort( sorted.begin(), sorted.end() ); } );
+	double t_radix = time_it( n_runs, [&](){ radix = magic; BVHBuilder::radix_sort( radix ); } );
+	printf( "std::sort:\t%f s\n", t_sort );
+	printf( "radix sort:\t%f s\t%s\n", t_radix, radix==sorted ? "same as std::sort" : "DIFFERS from std::sort" );
+
+	return 0;
+}
+
@@ -0,0 +1,116 @@
+#include "MCL/SceneManager.hpp"
+#include "MCL/BVHQuery.hpp"
+#include <algorithm>
+
+using namespace mcl;
+
+typedef std::vector< std::pair<int,int> > PairList;
+
+static inline bool aabb_overlap( const FlatBVH &a, const int pa, const FlatBVH &b, const int pb ){
+	trimesh::vec amin, amax, bmin, bmax;
+	a.prim_aabb( pa, amin, amax );
+	b.prim_aabb( pb, bmin, bmax );
+	for( int i=0; i<3; ++i ){
+		if( amin[i] > bmax[i] || amax[i] < bmin[i] ){ return false; }
+	}
+	return true;
+}
+
+// True if the triangles are in the same mesh and share a vertex index
+static inline bool adjacent( const FlatBVH &bvh, const int pa, const int pb ){
+	const FlatTriangle &ta = bvh.tris[pa], &tb = bvh.tris[pb];
+	if( ta.mesh != tb.mesh ){ return false; }
+	for( int i=0; i<3; ++i ){
+		if( ta.v[i]==tb.v[0] || ta.v[i]==tb.v[1] || ta.v[i]==tb.v[2] ){ return true; }
+	}
+	return false;
+}
+
+// All pairs with overlapping bounds, between two trees or (if b is NULL) within one
+static void brute_force( const FlatBVH &a, const FlatBVH *b, bool skip_adjacent, PairList &pairs ){
+	pairs.clear();
+	for( int i=0; i<a.num_prims(); ++i ){
+		if( b ){
+			for( int j=0; j<b->num_prims(); ++j ){
+				if( aabb_overlap( a, i, *b, j ) ){ pairs.push_back( std::make_pair( i, j ) ); }
+			}
+			continue;
+		}
+		for( int j=i+1; j<a.num_prims(); ++j ){
+			if( skip_adjacent && adjacent( a, i, j ) ){ continue; }
+			if( aabb_overlap( a, i, a, j ) ){ pairs.push_back( std::make_pair( i, j ) ); }
+		}
+	}
+}
+
+// Same pairs, or for a split bvh (which culls by its clipped references) no pairs that the brute force didn't find
+static bool same_pairs( const PairList &found, const PairList &expected, bool split ){
+	if( split ){ return std::includes( expected.begin(), expected.end(), found.begin(), found.end() ); }
+	return found == expected;
+}
+
+static void make_tree( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects, const std::string &type ){
+	bvh.clear();
+	if( type == "sah" ){ BVHBuilder::make_tree_sah( bvh, objects ); }
+	else if( type == "sbvh" ){ BVHBuilder::make_tree_sbvh( bvh, objects ); }
+	else { BVHBuilder::make_tree_lbvh( bvh, objects ); }
+}
+
+//
+//	Checks overlap and self_overlap against all pairs of primitives. A sphere is tested against
+//	itself together with a capped cylinder that passes through it, and against a second tree
+//	with the cylinder. The self overlaps are checked with and without skipping adjacent triangles.
+//	Returns 1 on a mismatch.
+//	Usage: test_overlap
+//
+int main(int argc, char *argv[]){
+
+	std::shared_ptr<trimesh::TriMesh> sphere( new trimesh::TriMesh() );
+	std::shared_ptr<trimesh::TriMesh> cylinder( new trimesh::TriMesh() );
+	trimesh::make_sphere_polar( sphere.get(), 48, 48 );
+	trimesh::make_ccyl( cylinder.get(), 32, 24, 0.3f );
+	for( int i=0; i<cylinder->vertices.size(); ++i ){
+		trimesh::point &p = cylinder->vertices[i];
+		p = trimesh::point( 0.2f + p[2]*1.5f, p[1], p[0] );
+	}
+
+	std::vector< std::shared_ptr<BaseObject> > both, sphere_only, cylinder_only;
+	both.push_back( std::shared_ptr<BaseObject>( new TriangleMesh( sphere ) ) );
+	both.push_back( std::shared_ptr<BaseObject>( new TriangleMesh( cylinder ) ) );
+	sphere_only.push_back( both[0] );
+	cylinder_only.push_back( both[1] );
+
+	std::vector<std::string> types;
+	types.push_back( "linear" );
+	types.push_back( "sah" );
+	types.push_back( "sbvh" );
+
+	int n_wrong = 0;
+	for( int t=0; t<types.size(); ++t ){
+
+		FlatBVH bvh, a, b;
+		make_tree( bvh, both, types[t] );
+		make_tree( a, sphere_only, types[t] );
+		make_tree( b, cylinder_only, types[t] );
+		const bool split = types[t] == "sbvh";
+
+		PairList expected;
+		OverlapPairs result;
+		int wrong = 0;
+		for( int skip=0; skip<2; ++skip ){
+			brute_force( bvh, NULL, skip==1, expected );
+			BVHQuery::self_overlap( bvh, result, skip==1 );
+			if( !same_pairs( result.pairs, expected, split ) ){ ++wrong; }
+			printf( "%s self overlap%s: %d pairs, %d by brute force\n", types[t].c_str(), skip ? "" : " with adjacent",
+				int(result.pairs.size()), int(expected.size()) );
+		}
+
+		brute_force( a, &b, false, expected );
+		BVHQuery::overlap( a, b, result );
+		if( !same_pairs( result.pairs, expected, split ) ){ ++wrong; }
+		printf( "%s overlap: %d pairs, %d by brute force\n", types[t].c_str(), int(result.pairs.size()), int(expected.size()) );
+		n_wrong += wrong;
+	}
+
+	return n_wrong > 0 ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+#include "MCL/SceneManager.hpp"
+#include <random>
+
+using namespace mcl;
+
+// Number of rays whose packet result differs from tracing them one at a time
+static int count_mismatches( const FlatBVH &bvh, std::vector< intersect::Ray > &rays, int packet_size ){
+	std::vector< intersect::Payload > packets;
+	BVHTraversal::ray_intersect_packets( bvh, rays, packets, packet_size );
+	int n_wrong = 0;
+	for( int i=0; i<rays.size(); ++i ){
+		intersect::Payload single;
+		bool hit = BVHTraversal::ray_intersect( bvh, rays[i], single );
+		const intersect::Payload &p = packets[i];
+		if( hit != ( p.prim >= 0 || p.object >= 0 ) || p.t_max != single.t_max || p.prim != single.prim ||
+			p.object != single.object || p.u != single.u || p.v != single.v ){ ++n_wrong; }
+	}
+	return n_wrong;
+}
+
+//
+//	Checks that packets give the same hits as single rays. Each packet starts at a shared origin
+//	with directions in one octant, so it is traced as a packet from the root, but the directions
+//	fan out across the scene so that fewer and fewer rays reach the deeper nodes. Those packets
+//	diverge partway down the tree and finish one ray at a time. Returns 1 on a mismatch.
+//	Usage: test_packets <scene.xml>
+//
+int main(int argc, char *argv[]){
+
+	std::string file = std::string(MCLSCENE_SRC_DIR) + "/conf/Bunny.xml";
+	if( argc > 1 ){ file = std::string(argv[1]); }
+
+	SceneManager scene;
+	if( !scene.load( file ) ){ return 1; }
+
+	std::vector<std::string> types;
+	types.push_back( "linear" );
+	types.push_back( "sah" );
+	types.push_back( "sbvh" );
+
+	int n_wrong = 0;
+	for( int t=0; t<types.size(); ++t ){
+
+		std::shared_ptr<FlatBVH> bvh = scene.get_bvh( true, types[t] );
+		AABB bounds = bvh->bounds();
+		trimesh::vec extent = bounds.max - bounds.min;
+		std::mt19937 gen( 0 );
+		std::uniform_real_distribution<float> rand( 0.f, 1.f );
+
+		for( int packet_size=4; packet_size<=16; packet_size*=2 ){
+
+			// Fans from a corner outside the bounds towards points spread over the whole scene
+			std::vector< intersect::Ray > rays( packet_size*1024 );
+			for( int i=0; i<rays.size(); i+=packet_size ){
+				trimesh::vec origin = bounds.min - extent*( 0.1f + 0.2f*rand(gen) );
+				for( int k=0; k<packet_size; ++k ){
+					trimesh::vec target = bounds.min + trimesh::vec( rand(gen), rand(gen), rand(gen) ) * extent;
+					rays[i+k].origin = origin;
+					rays[i+k].direction = target - origin;
+				}
+			}
+			int wrong = count_mismatches( *bvh, rays, packet_size );
+			printf( "%s packet%d: %d of %d rays differ from single ray traversal\n", types[t].c_str(), packet_size, wrong, int(rays.size()) );
+			n_wrong += wrong;
+		}
+	}
+
+	return n_wrong > 0 ? 1 : 0;
+}
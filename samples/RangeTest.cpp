@@ -0,0 +1,103 @@
+#include "MCL/SceneManager.hpp"
+#include "MCL/BVHQuery.hpp"
+#include <random>
+#include <algorithm>
+
+using namespace mcl;
+
+// Squared distance from the point to the box, zero inside
+static float box_dist2( const trimesh::vec &bmin, const trimesh::vec &bmax, const trimesh::vec &p ){
+	float d2 = 0.f;
+	for( int i=0; i<3; ++i ){
+		const float d = std::max( 0.f, std::max( bmin[i]-p[i], p[i]-bmax[i] ) );
+		d2 += d*d;
+	}
+	return d2;
+}
+
+// Primitives whose bounds overlap the box (or the sphere if radius >= 0), by testing all of them
+static void brute_force( const FlatBVH &bvh, const AABB &box, const trimesh::vec &center, float radius, std::vector<int> &prims ){
+	prims.clear();
+	for( int p=0; p<bvh.num_prims(); ++p ){
+		trimesh::vec bmin, bmax;
+		bvh.prim_aabb( p, bmin, bmax );
+		bool overlap = true;
+		if( radius >= 0.f ){ overlap = box_dist2( bmin, bmax, center ) <= radius*radius; }
+		else {
+			for( int i=0; i<3; ++i ){
+				if( bmin[i] > box.max[i] || bmax[i] < box.min[i] ){ overlap = false; }
+			}
+		}
+		if( overlap ){ prims.push_back( p ); }
+	}
+}
+
+// True if the query found the same primitives, or for a split bvh (which culls by its clipped
+// references) if it found no primitive that the brute force didn't.
+static bool same_prims( std::vector<int> &found, const std::vector<int> &expected, bool split ){
+	std::sort( found.begin(), found.end() );
+	if( std::adjacent_find( found.begin(), found.end() ) != found.end() ){ return false; }
+	if( split ){ return std::includes( expected.begin(), expected.end(), found.begin(), found.end() ); }
+	return found == expected;
+}
+
+//
+//	Checks box and sphere queries against the bounds of every primitive, for boxes and spheres
+//	of many sizes around the scene. The visitor versions must visit the same primitives.
+//	Returns 1 on a mismatch.
+//	Usage: test_range <scene.xml>
+//
+int main(int argc, char *argv[]){
+
+	std::string file = std::string(MCLSCENE_SRC_DIR) + "/conf/Bunny.xml";
+	if( argc > 1 ){ file = std::string(argv[1]); }
+
+	SceneManager scene;
+	if( !scene.load( file ) ){ return 1; }
+
+	std::vector<std::string> types;
+	types.push_back( "linear" );
+	types.push_back( "sah" );
+	types.push_back( "sbvh" );
+
+	int n_wrong = 0;
+	for( int t=0; t<types.size(); ++t ){
+
+		std::shared_ptr<FlatBVH> bvh = scene.get_bvh( true, types[t] );
+		const bool split = bvh->prim_indices.size() > bvh->num_prims();
+		AABB bounds = bvh->bounds();
+		trimesh::vec extent = bounds.max - bounds.min;
+		std::mt19937 gen( 0 );
+		std::uniform_real_distribution<float> rand( -0.2f, 1.2f );
+		std::uniform_real_distribution<float> size( 0.f, 0.3f );
+
+		int wrong = 0;
+		const int n_queries = 256;
+		for( int i=0; i<n_queries; ++i ){
+			const trimesh::vec center = bounds.min + trimesh::vec( rand(gen), rand(gen), rand(gen) ) * extent;
+			const trimesh::vec half = trimesh::vec( size(gen), size(gen), size(gen) ) * extent;
+			const float radius = size(gen) * trimesh::len( extent );
+			AABB box( center-half, center+half );
+			std::vector<int> expected, found, visited;
+
+			brute_force( *bvh, box, center, -1.f, expected );
+			BVHQuery::overlap_box( *bvh, box, found );
+			BVHQuery::overlap_box( *bvh, box, [&visited]( int prim ){ visited.push_back( prim ); return true; } );
+			std::sort( visited.begin(), visited.end() );
+			visited.erase( std::unique( visited.begin(), visited.end() ), visited.end() );
+			if( !same_prims( found, expected, split ) || visited != found ){ ++wrong; }
+
+			brute_force( *bvh, box, center, radius, expected );
+			found.clear(); visited.clear();
+			BVHQuery::overlap_sphere( *bvh, center, radius, found );
+			BVHQuery::overlap_sphere( *bvh, center, radius, [&visited]( int prim ){ visited.push_back( prim ); return true; } );
+			std::sort( visited.begin(), visited.end() );
+			visited.erase( std::unique( visited.begin(), visited.end() ), visited.end() );
+			if( !same_prims( found, expected, split ) || visited != found ){ ++wrong; }
+		}
+		printf( "%s: %d of %d box and sphere queries differ from brute force\n", types[t].c_str(), wrong, 2*n_queries );
+		n_wrong += wrong;
+	}
+
+	return n_wrong > 0 ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+#include "MCL/SceneManager.hpp"
+#include "MCL/SDF.hpp"
+#include "MCL/BVHCache.hpp"
+#include <random>
+#include <cstdio>
+
+using namespace mcl;
+
+//
+//	Checks that distances from the field are within a voxel of the closest point on the mesh,
+//	for points around the surface that are inside of the band. Then saves and loads the field,
+//	which must give the same distances, and must not load with a different hash.
+//	Returns 1 on a mismatch.
+//	Usage: test_sdf <scene.xml>
+//
+int main(int argc, char *argv[]){
+
+	std::string file = std::string(MCLSCENE_SRC_DIR) + "/conf/Bunny.xml";
+	if( argc > 1 ){ file = std::string(argv[1]); }
+
+	SceneManager scene;
+	if( !scene.load( file ) ){ return 1; }
+	std::shared_ptr<FlatBVH> bvh = scene.get_bvh( true, "sah" );
+
+	AABB bounds = bvh->bounds();
+	const float voxel_size = trimesh::len( bounds.max - bounds.min ) / 64.f;
+	const float band = 3.f*voxel_size;
+	SDF sdf;
+	sdf.make( *bvh, voxel_size, band );
+
+	std::mt19937 gen( 0 );
+	std::uniform_real_distribution<float> rand( -1.f, 1.f );
+	std::vector< trimesh::vec > points;
+	for( int i=0; i<4096; ++i ){
+		trimesh::vec p0, p1, p2;
+		bvh->prim_triangle( gen() % bvh->num_prims(), p0, p1, p2 );
+		points.push_back( ( p0+p1+p2 )/3.f + trimesh::vec( rand(gen), rand(gen), rand(gen) )*band );
+	}
+
+	int n_wrong = 0, n_tested = 0;
+	for( int i=0; i<points.size(); ++i ){
+		ClosestPoint cp;
+		if( !BVHQuery::closest_point( *bvh, points[i], cp, band-voxel_size ) ){ continue; }
+		++n_tested;
+		float dist;
+		if( !sdf.distance( points[i], dist ) || std::abs( std::abs( dist ) - cp.dist ) > voxel_size ){ ++n_wrong; }
+	}
+	printf( "%d bricks: %d of %d distances are more than a voxel from the closest point\n", sdf.num_bricks(), n_wrong, n_tested );
+
+	const std::string filename = "test_sdf.sdf";
+	const unsigned long long hash = BVHCache::geometry_hash( *bvh );
+	SDF loaded, wrong_hash;
+	if( !sdf.save( filename, hash ) || !loaded.load( filename, hash ) || wrong_hash.load( filename, hash+1 ) ){ ++n_wrong; }
+	int n_differ = 0;
+	for( int i=0; i<points.size(); ++i ){
+		float d0 = 0.f, d1 = 0.f;
+		if( sdf.distance( points[i], d0 ) != loaded.distance( points[i], d1 ) || d0 != d1 ){ ++n_differ; }
+	}
+	std::remove( filename.c_str() );
+	printf( "saved and loaded: %d of %d distances differ\n", n_differ, int(points.size()) );
+	n_wrong += n_differ;
+
+	return n_wrong > 0 ? 1 : 0;
+}
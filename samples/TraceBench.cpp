@@ -0,0 +1,165 @@
+#include "MCL/SceneManager.hpp"
+#include "TriMesh_algo.h"
+#include <random>
+
+using namespace mcl;
+
+// Returns the time to trace all rays
+template< typename F > static double trace( std::vector< intersect::Ray > &rays, int &n_hits, F ray_intersect ){
+	n_hits = 0;
+	std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	for( int i=0; i<rays.size(); ++i ){
+		intersect::Payload payload;
+		if( ray_intersect( rays[i], payload ) ){ ++n_hits; }
+	}
+	std::chrono::duration<double> elapsed = std::chrono::system_clock::now()-start;
+	return elapsed.count();
+}
+
+template< typename T > static double megabytes( const std::vector<T> &nodes ){ return double( nodes.size()*sizeof(T) ) / ( 1024.0*1024.0 ); }
+
+//
+//	Builds each type of BVH for a scene and times tracing the same set of rays through it,
+//	and through the tree collapsed to BVH4 and BVH8 with float and quantized bounds.
+//	Coherent camera rays are also traced one at a time and in packets of 4, 8 and 16.
+//	Usage: bench_trace <scene.xml> <subdivisions>
+//	Subdivisions are loop subdivision steps on every mesh, to make a larger scene out of a small one.
+//
+int main(int argc, char *argv[]){
+
+	std::string file = std::string(MCLSCENE_SRC_DIR) + "/conf/Bunny.xml";
+	if( argc > 1 ){ file = std::string(argv[1]); }
+	int n_subdiv = 0;
+	if( argc > 2 ){ n_subdiv = std::stoi( argv[2] ); }
+
+	SceneManager scene;
+	if( !scene.load( file ) ){ return 0; }
+	for( int i=0; i<scene.objects.size(); ++i ){
+		std::shared_ptr<trimesh::TriMesh> mesh = scene.objects[i]->get_TriMesh();
+		if( mesh == NULL ){ continue; }
+		for( int j=0; j<n_subdiv; ++j ){ trimesh::subdiv( mesh.get() ); }
+	}
+
+	// Rays from a sphere around the scene towards points inside of it
+	std::vector< intersect::Ray > rays( 1<<18 );
+	{
+		AABB bounds = scene.get_bvh( true, "linear" )->bounds();
+		trimesh::vec center = bounds.center();
+		float radius = trimesh::len( bounds.max-bounds.min );
+		std::mt19937 gen( 0 );
+		std::uniform_real_distribution<float> rand( -1.f, 1.f );
+		for( int i=0; i<rays.size(); ++i ){
+			trimesh::vec dir( rand(gen), rand(gen), rand(gen) ); trimesh::normalize( dir );
+			trimesh::vec target = center + trimesh::vec( rand(gen), rand(gen), rand(gen) ) * ( bounds.max-bounds.min ) * 0.25f;
+			rays[i].origin = center + dir*radius;
+			rays[i].direction = target - rays[i].origin;
+			trimesh::normalize( rays[i].direction );
+		}
+	}
+
+	// Coherent camera rays (512x512) looking at the center of the scene, in 4x4 pixel tiles
+	const int res = 512;
+	std::vector< intersect::Ray > primary_rays( res*res );
+	{
+		AABB bounds = scene.get_bvh( false, "linear" )->bounds();
+		trimesh::vec center = bounds.center();
+		trimesh::vec eye = center + trimesh::vec( 0.1f, 0.1f, 0.6f ) * trimesh::len( bounds.max-bounds.min );
+		trimesh::vec forward = center-eye; trimesh::normalize( forward );
+		trimesh::vec right = forward.cross( trimesh::vec(0,1,0) ); trimesh::normalize( right );
+		trimesh::vec up = right.cross( forward );
+		int k = 0;
+		for( int ty=0; ty<res; ty+=4 ){ for( int tx=0; tx<res; tx+=4 ){
+			for( int y=ty; y<ty+4; ++y ){ for( int x=tx; x<tx+4; ++x ){
+				float u = ( x+0.5f )/float(res)*2.f - 1.f, v = ( y+0.5f )/float(res)*2.f - 1.f;
+				primary_rays[k].origin = eye;
+				primary_rays[k].direction = forward + right*(0.5f*u) + up*(0.5f*v);
+				++k;
+			}}
+		}}
+	}
+
+	std::vector<std::string> types;
+	types.push_back( "spatial" );
+	types.push_back( "linear" );
+	types.push_back( "trbvh" );
+	types.push_back( "sah" );
+	types.push_back( "sbvh" );
+
+	double linear_time = 0.0;
+	for( int i=0; i<types.size(); ++i ){
+
+		std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+		std::shared_ptr<FlatBVH> bvh = scene.get_bvh( true, types[i] );
+		std::chrono::duration<double> build_time = std::chrono::system_clock::now()-start;
+
+		int n_hits = 0;
+		double trace_time = trace( rays, n_hits, [&]( intersect::Ray &ray, intersect::Payload &payload ){
+			return BVHTraversal::ray_intersect( *bvh, ray, payload ); } );
+		if( types[i]=="linear" ){ linear_time = trace_time; }
+
+		printf( "%s:\t%d prims\t%d nodes (%.2f MB)\tbuild %f s\tsah cost %f\ttrace %f s (%.2f Mrays/s, %d hits)",
+			types[i].c_str(), bvh->num_prims(), int(bvh->nodes.size()), megabytes( bvh->nodes ), build_time.count(),
+			bvh->sah_cost(), trace_time, rays.size() / trace_time * 1e-6, n_hits );
+		if( linear_time > 0.0 ){ printf( "\t%.2fx linear", linear_time / trace_time ); }
+		printf( "\n" );
+
+		// Recursive traversal of the same tree
+		int n_hits_rec = 0;
+		double trace_time_rec = trace( rays, n_hits_rec, [&]( intersect::Ray &ray, intersect::Payload &payload ){
+			return BVHTraversal::ray_intersect_recursive( *bvh, ray, payload ); } );
+		printf( "\trecursive: trace %f s (%d hits), iterative is %.2fx faster\n", trace_time_rec, n_hits_rec, trace_time_rec / trace_time );
+
+		// Same rays as a stream, binned by origin and direction
+		{
+			intersect::RayStream stream;
+			stream.resize( rays.size() );
+			for( int j=0; j<rays.size(); ++j ){ stream.set( j, rays[j] ); }
+			intersect::HitStream hits;
+			std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+			BVHTraversal::ray_intersect_stream( *bvh, stream, hits );
+			std::chrono::duration<double> stream_time = std::chrono::system_clock::now()-start;
+			int n_hits_stream = 0;
+			for( int j=0; j<hits.prim.size(); ++j ){ n_hits_stream += hits.prim[j] >= 0; }
+			printf( "\tstream: trace %f s (%d hits), %.2fx single rays\n", stream_time.count(), n_hits_stream, trace_time / stream_time.count() );
+		}
+
+		// Primary rays one at a time and in packets
+		int n_hits_primary = 0;
+		double trace_time_primary = trace( primary_rays, n_hits_primary, [&]( intersect::Ray &ray, intersect::Payload &payload ){
+			return BVHTraversal::ray_intersect( *bvh, ray, payload ); } );
+		printf( "\tprimary: trace %f s (%d hits)", trace_time_primary, n_hits_primary );
+		for( int packet_size=4; packet_size<=16; packet_size*=2 ){
+			std::vector< intersect::Payload > payloads;
+			std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+			BVHTraversal::ray_intersect_packets( *bvh, primary_rays, payloads, packet_size );
+			std::chrono::duration<double> packet_time = std::chrono::system_clock::now()-start;
+			printf( "\tpacket%d: %f s (%.2fx)", packet_size, packet_time.count(), trace_time_primary / packet_time.count() );
+		}
+		printf( "\n" );
+
+		// Same tree collapsed to 4 and 8 children
+		BVH4 bvh4; BVHBuilder::make_tree_wide( *bvh, bvh4 );
+		BVH8 bvh8; BVHBuilder::make_tree_wide( *bvh, bvh8 );
+		int n_hits4 = 0, n_hits8 = 0;
+		double trace_time4 = trace( rays, n_hits4, [&]( intersect::Ray &ray, intersect::Payload &payload ){
+			return BVHTraversal::ray_intersect( bvh4, ray, payload ); } );
+		double trace_time8 = trace( rays, n_hits8, [&]( intersect::Ray &ray, intersect::Payload &payload ){
+			return BVHTraversal::ray_intersect( bvh8, ray, payload ); } );
+		printf( "\tbvh4: trace %f s (%.2fx binary, %d hits, %.2f MB)\tbvh8: trace %f s (%.2fx binary, %d hits, %.2f MB)\n",
+			trace_time4, trace_time / trace_time4, n_hits4, megabytes( bvh4.nodes ),
+			trace_time8, trace_time / trace_time8, n_hits8, megabytes( bvh8.nodes ) );
+
+		// And with 8 bit quantized bounds
+		QBVH4 qbvh4; BVHBuilder::make_tree_quantized( bvh4, qbvh4 );
+		QBVH8 qbvh8; BVHBuilder::make_tree_quantized( bvh8, qbvh8 );
+		trace_time4 = trace( rays, n_hits4, [&]( intersect::Ray &ray, intersect::Payload &payload ){
+			return BVHTraversal::ray_intersect( qbvh4, ray, payload ); } );
+		trace_time8 = trace( rays, n_hits8, [&]( intersect::Ray &ray, intersect::Payload &payload ){
+			return BVHTraversal::ray_intersect( qbvh8, ray, payload ); } );
+		printf( "\tqbvh4: trace %f s (%.2fx binary, %d hits, %.2f MB)\tqbvh8: trace %f s (%.2fx binary, %d hits, %.2f MB)\n",
+			trace_time4, trace_time / trace_time4, n_hits4, megabytes( qbvh4.nodes ),
+			trace_time8, trace_time / trace_time8, n_hits8, megabytes( qbvh8.nodes ) );
+	}
+
+	return 0;
+}
@@ -20,150 +20,375 @@
 // By Matt Overby (http://www.mattoverby.net)
 
 #include "MCL/BVH.hpp"
+#include <cstring>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 using namespace mcl;
 
 
-void BVHNode::get_edges( std::vector<trimesh::vec> &edges ){
-	aabb->get_edges( edges );
-	if( left_child != NULL ){ left_child->get_edges( edges ); }
-	if( right_child != NULL ){ right_child->get_edges( edges ); }
+void BVHPrimitives::add_objects( const std::vector< std::shared_ptr<BaseObject> > &objects ){
+	for( int i=0; i<objects.size(); ++i ){
+		TriangleView view;
+		if( !objects[i]->get_triangle_view( view ) ){ objects[i]->get_primitives( prims ); continue; }
+		const std::vector< trimesh::TriMesh::Face > &faces = *view.faces;
+		const int mesh = meshes.size();
+		view.first_tri = tris.size();
+		tris.reserve( tris.size() + faces.size() );
+		for( int f=0; f<faces.size(); ++f ){
+			FlatTriangle tri;
+			tri.v[0] = faces[f][0]; tri.v[1] = faces[f][1]; tri.v[2] = faces[f][2];
+			tri.mesh = mesh;
+			tris.push_back( tri );
+		}
+		meshes.push_back( view );
+	}
 }
 
-int n_nodes = 0;
-
-void BVHNode::spatial_split( const std::vector< std::shared_ptr<BaseObject> > &objects,
-	const std::vector< int > &queue, const int split_axis, const int max_depth ) {
-	using namespace trimesh;
 
-	m_split = split_axis;
+void FlatBVH::get_edges( std::vector<trimesh::vec> &edges, int node ) const {
+	if( node >= nodes.size() ){ return; }
+	nodes[node].bounds().get_edges( edges );
+	if( !nodes[node].is_leaf() ){
+		get_edges( edges, node+1 );
+		get_edges( edges, nodes[node].offset );
+	}
+}
 
-	// Create the aabb
-	std::vector< point > obj_centers( queue.size() ); // store the centers for later lookup
-	for( int i=0; i<queue.size(); ++i ){
-		vec bmin, bmax; objects[ queue[i] ]->get_aabb( bmin, bmax );
-		*aabb += bmin; *aabb += bmax;
-		obj_centers[i] = point( (bmin+bmax)*0.5f );
+double FlatBVH::sah_cost( float traversal_cost ) const {
+	if( nodes.size()==0 ){ return 0.0; }
+	double root_area = nodes[0].bounds().surface_area();
+	if( root_area <= 0.0 ){ return double( prim_indices.size() ); }
+	double cost = 0.0;
+	const int n_nodes = nodes.size();
+	#pragma omp parallel for reduction(+:cost)
+	for( int i=0; i<n_nodes; ++i ){
+		double area = nodes[i].bounds().surface_area() / root_area;
+		if( nodes[i].is_leaf() ){ cost += area * double( nodes[i].n_prims ); }
+		else{ cost += area * double( traversal_cost ); }
 	}
-	point center = aabb->center();
+	return cost;
+}
 
-	// If num faces == 1, we're done
-	if( queue.size()==0 ){ return; }
-	else if( queue.size()==1 || max_depth <= 0 ){
-		m_objects.reserve( queue.size() );
-		for( int i=0; i<queue.size(); ++i ){ m_objects.push_back( objects[ queue[i] ] ); }
-		return;
+
+void FlatBVH::get_stats( BVHStats &stats, float traversal_cost ) const {
+
+	stats.n_nodes = nodes.size();
+	stats.n_leaves = 0;
+	stats.n_refs = prim_indices.size();
+	stats.max_depth = 0;
+	stats.depth_histogram.clear();
+	stats.leaf_histogram.clear();
+	stats.sah_cost = sah_cost( traversal_cost );
+	stats.memory = nodes.size()*sizeof(FlatNode) + prim_indices.size()*sizeof(int) + prim_memory();
+
+	// Children are after their parent, so depths are known in one forward pass
+	std::vector< int > depth( nodes.size(), 0 );
+	double overlap_area = 0.0, interior_area = 0.0;
+	for( int i=0; i<nodes.size(); ++i ){
+		const FlatNode &node = nodes[i];
+		if( node.is_leaf() ){
+			stats.n_leaves++;
+			stats.max_depth = std::max( stats.max_depth, depth[i] );
+			if( stats.depth_histogram.size() <= depth[i] ){ stats.depth_histogram.resize( depth[i]+1, 0 ); }
+			if( stats.leaf_histogram.size() <= node.n_prims ){ stats.leaf_histogram.resize( node.n_prims+1, 0 ); }
+			stats.depth_histogram[ depth[i] ]++;
+			stats.leaf_histogram[ node.n_prims ]++;
+			continue;
+		}
+		depth[i+1] = depth[i]+1;
+		depth[node.offset] = depth[i]+1;
+
+		const FlatNode &l = nodes[i+1], &r = nodes[node.offset];
+		AABB overlap; overlap.valid = true;
+		for( int j=0; j<3; ++j ){
+			overlap.min[j] = std::max( l.bmin[j], r.bmin[j] );
+			overlap.max[j] = std::min( l.bmax[j], r.bmax[j] );
+			if( overlap.min[j] > overlap.max[j] ){ overlap.valid = false; }
+		}
+		overlap_area += overlap.surface_area();
+		interior_area += node.bounds().surface_area();
 	}
+	stats.sibling_overlap = interior_area > 0.0 ? overlap_area / interior_area : 0.0;
+
+} // end get stats
+
+
+double BVHStats::build_time() const {
+	double t = 0.0;
+	for( int i=0; i<timings.size(); ++i ){ t += timings[i].second; }
+	return t;
+}
+
+
+void BVHStats::add_timing( const std::string &phase, std::chrono::time_point<std::chrono::system_clock> &start ){
+	std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
+	std::chrono::duration<double> elapsed = now-start;
+	timings.push_back( std::make_pair( phase, elapsed.count() ) );
+	start = now;
+}
+
+
+void BVHStats::print( std::ostream &os ) const {
+
+	os << "nodes: " << n_nodes << ", leaves: " << n_leaves << ", references: " << n_refs << ", max depth: " << max_depth << "\n";
+	os << "SAH cost: " << sah_cost << ", sibling overlap: " << sibling_overlap << ", memory: " << double(memory)/(1024.0*1024.0) << " MB\n";
+	os << "build time: " << build_time() << "s";
+	for( int i=0; i<timings.size(); ++i ){ os << ( i==0 ? " (" : ", " ) << timings[i].first << " " << timings[i].second << "s"; }
+	os << ( timings.size() ? ")\n" : "\n" );
+	os << "leaves by depth:";
+	for( int i=0; i<depth_histogram.size(); ++i ){ if( depth_histogram[i] ){ os << " " << i << ":" << depth_histogram[i]; } }
+	os << "\nleaves by primitives:";
+	for( int i=0; i<leaf_histogram.size(); ++i ){ if( leaf_histogram[i] ){ os << " " << i << ":" << leaf_histogram[i]; } }
+	os << std::endl;
+
+} // end print
 
-	// Split faces
-	std::vector<int> left_queue, right_queue;
-	for( int i=0; i<queue.size(); ++i ){
-		double oc = obj_centers[i][split_axis];
-		if( oc <= center[ split_axis ] ){ left_queue.push_back( queue[i] ); }
-		else if( oc > center[ split_axis ] ){ right_queue.push_back( queue[i] ); }
+
+//
+//	BVH Traversal
+//
+
+
+// Stack of the iterative traversals. Only the farther child is pushed at each level, so
+// this is enough for any tree we build, and deeper trees go on in a new traversal of the
+// subtree when the stack is full.
+static const int flat_stack_size = 256;
+
+// Entry distance of the ray into the node within [t_min,t_max], false if it misses.
+// A NaN distance (the ray lies on a slab) is ignored by keeping the current interval.
+static inline bool flat_slab( const FlatNode &node, const float *origin, const float *inv_dir, const int *sign,
+	float t_min, float t_max, float &t_near ){
+	for( int j=0; j<3; ++j ){
+		const float near = sign[j] ? node.bmax[j] : node.bmin[j];
+		const float far = sign[j] ? node.bmin[j] : node.bmax[j];
+		t_min = std::max( t_min, ( near - origin[j] ) * inv_dir[j] );
+		t_max = std::min( t_max, ( far - origin[j] ) * inv_dir[j] );
 	}
+	t_near = t_min;
+	return t_min <= t_max;
+}
 
-	// Check to make sure things got sorted. Sometimes small meshes fail.
-	if( left_queue.size()==0 ){ left_queue.push_back( right_queue.back() ); right_queue.pop_back(); }
-	if( right_queue.size()==0 ){ right_queue.push_back( left_queue.back() ); left_queue.pop_back(); }
 
-	// Create the children
-	num_objects = left_queue.size()+right_queue.size();
-	left_child = std::shared_ptr<BVHNode>( new BVHNode() );
-	right_child = std::shared_ptr<BVHNode>( new BVHNode() );
-	left_child->spatial_split( objects, left_queue, ((split_axis+1)%3), max_depth-1 );
-	right_child->spatial_split( objects, right_queue, ((split_axis+1)%3), max_depth-1 );
-	n_nodes += 2;
+// Closest hit traversal of the subtree at root, also gives the index of the primitive that was hit
+static inline bool flat_ray_intersect( const FlatBVH &bvh, intersect::Ray &ray, intersect::Payload &payload, int &hit_prim, const int root=0 ){
 
-} // end build spatial split tree
+	if( bvh.nodes.size()==0 ){ return false; }
 
+	float origin[3], inv_dir[3];
+	int sign[3];
+	for( int j=0; j<3; ++j ){
+		origin[j] = ray.origin[j];
+		inv_dir[j] = 1.f / ray.direction[j];
+		sign[j] = ( inv_dir[j] < 0.f );
+	}
+
+	int stack_node[ flat_stack_size ];
+	float stack_t[ flat_stack_size ];
+	int n_stack = 0;
+	float t_root;
+	if( !flat_slab( bvh.nodes[root], origin, inv_dir, sign, payload.t_min, payload.t_max, t_root ) ){ return false; }
+	stack_node[0] = root; stack_t[0] = t_root;
+	n_stack = 1;
+	bool hit = false;
+
+	while( n_stack > 0 ){
+
+		--n_stack;
+		if( stack_t[n_stack] > payload.t_max ){ continue; }
+		if( n_stack+2 > flat_stack_size ){
+			if( flat_ray_intersect( bvh, ray, payload, hit_prim, stack_node[n_stack] ) ){ hit = true; }
+			continue;
+		}
+		const FlatNode &node = bvh.nodes[ stack_node[n_stack] ];
 
-float avg_balance = 0.f;
-int num_avg_balance = 0;
+		if( node.is_leaf() ){
+			for( int i=0; i<node.n_prims; ++i ){
+				int prim = bvh.prim_indices[ node.offset+i ];
+				if( bvh.prim_ray_intersect( prim, ray, payload ) ){ hit = true; hit_prim = prim; }
+			}
+			continue;
+		}
 
+		// Push the farther child first so the nearer one is visited next
+		const int left = stack_node[n_stack]+1, right = node.offset;
+		float t_left, t_right;
+		bool hit_left = flat_slab( bvh.nodes[left], origin, inv_dir, sign, payload.t_min, payload.t_max, t_left );
+		bool hit_right = flat_slab( bvh.nodes[right], origin, inv_dir, sign, payload.t_min, payload.t_max, t_right );
+		if( hit_left && hit_right ){
+			bool left_first = t_left <= t_right;
+			stack_node[n_stack] = left_first ? right : left; stack_t[n_stack] = left_first ? t_right : t_left; ++n_stack;
+			stack_node[n_stack] = left_first ? left : right; stack_t[n_stack] = left_first ? t_left : t_right; ++n_stack;
+		}
+		else if( hit_left ){ stack_node[n_stack] = left; stack_t[n_stack] = t_left; ++n_stack; }
+		else if( hit_right ){ stack_node[n_stack] = right; stack_t[n_stack] = t_right; ++n_stack; }
+	}
 
+	return hit;
 
-void BVHNode::lbvh_split( const int bit, const std::vector< std::shared_ptr<BaseObject> > &prims,
-	const std::vector< std::pair< morton_type, int > > &morton_codes, const int max_depth ){
+} // end flat ray intersect
 
-	// First, see what bit we're at. If it's the last bit of the morton code,
-	// this is a child and we should add the objects to the scene.
-	if( bit == 0 || max_depth <= 0 || morton_codes.size() == 1 ){
-		m_objects.reserve( morton_codes.size() );
-		for( int i=0; i<morton_codes.size(); ++i ){ m_objects.push_back( prims[ morton_codes[i].second ] ); }
-	} // end add objects
 
-	// Check the morton codes at the bit.
-	// 0 = left child, 1 = right child.
-	else{
-		std::vector< std::pair< morton_type, int > > left_codes, right_codes;
-		for( int i=0; i<morton_codes.size(); ++i ){
+bool BVHTraversal::ray_intersect( const FlatBVH &bvh, intersect::Ray &ray, intersect::Payload &payload ) {
+	int hit_prim = -1;
+	return flat_ray_intersect( bvh, ray, payload, hit_prim );
+}
+
 
-			if( helper::check_bit( morton_codes[i].first, bit ) ){
-				right_codes.push_back( morton_codes[i] );
+void BVHTraversal::ray_intersect_stream( const FlatBVH &bvh, const intersect::RayStream &rays,
+	intersect::HitStream &hits, int origin_bits ){
+
+	using namespace trimesh;
 
-//		std::cout << bit << ":\t" << std::bitset<8*8>( morton_codes[i].first ) << std::endl;
+	const int n_rays = rays.size();
+	hits.t.resize( n_rays );
+	hits.prim.resize( n_rays );
+	hits.n.resize( n_rays );
+	if( n_rays == 0 ){ return; }
+
+	// Bounds of the origins, for the cells
+	std::vector< vec > origins( n_rays );
+	AABB bounds;
+	#pragma omp parallel
+	{
+		AABB thread_bounds;
+		#pragma omp for
+		for( int i=0; i<n_rays; ++i ){
+			origins[i] = vec( rays.origin[0][i], rays.origin[1][i], rays.origin[2][i] );
+			thread_bounds += origins[i];
+		}
+		#pragma omp critical (stream_bounds)
+		{ bounds += thread_bounds; }
+	}
 
-			} else {
-				left_codes.push_back( morton_codes[i] );
+	// Keys are the octant above the morton code of the origin cell
+	origin_bits = std::max( 0, std::min( origin_bits, 19 ) );
+	std::vector< std::pair< morton_type, int > > keys;
+	BVHBuilder::morton_codes( origins, bounds, keys );
+	std::vector< vec >().swap( origins );
+	#pragma omp parallel for
+	for( int i=0; i<n_rays; ++i ){
+		const int ray = keys[i].second;
+		morton_type octant = ( rays.direction[0][ray] < 0.f ) | ( ( rays.direction[1][ray] < 0.f ) << 1 ) | ( ( rays.direction[2][ray] < 0.f ) << 2 );
+		morton_type cell = origin_bits > 0 ? keys[i].first >> ( 63 - 3*origin_bits ) : 0;
+		keys[i].first = ( octant << ( 3*origin_bits ) ) | cell;
+	}
+	BVHBuilder::radix_sort( keys );
+
+	// Batches of consecutive sorted rays are traced by one thread
+	const int batch_size = 256;
+	const int n_batches = ( n_rays + batch_size - 1 ) / batch_size;
+	#pragma omp parallel for schedule(dynamic,1)
+	for( int b=0; b<n_batches; ++b ){
+		const int end = std::min( n_rays, (b+1)*batch_size );
+		for( int k=b*batch_size; k<end; ++k ){
+			const int i = keys[k].second;
+			intersect::Ray ray = rays.get( i );
+			intersect::Payload payload;
+			payload.t_min = rays.t_min[i];
+			payload.t_max = rays.t_max[i];
+			int hit_prim = -1;
+			flat_ray_intersect( bvh, ray, payload, hit_prim );
+			hits.t[i] = payload.t_max;
+			hits.prim[i] = hit_prim;
+			hits.n[i] = vec(0,0,0);
+			if( hit_prim >= 0 ){
+				intersect::SurfaceHit surface;
+				bvh.get_surface( ray, payload, surface );
+				hits.n[i] = surface.n;
 			}
+		}
+	}
 
-		} // end sort morton codes
+} // end ray intersect stream
 
-		// Check to make sure things got sorted. Sometimes small meshes fail.
-		if( left_codes.size()==0 ){ left_codes.push_back( right_codes.back() ); right_codes.pop_back(); }
-		if( right_codes.size()==0 ){ right_codes.push_back( left_codes.back() ); left_codes.pop_back(); }
 
-		avg_balance += float(left_codes.size())/float(right_codes.size());
-		num_avg_balance++;
-		num_objects = left_codes.size()+right_codes.size();
+// Any hit traversal of the subtree at root
+static bool flat_occluded( const FlatBVH &bvh, intersect::Ray &ray, const double t_min, const double t_max, const int root ){
+
+	float origin[3], inv_dir[3];
+	int sign[3];
+	for( int j=0; j<3; ++j ){
+		origin[j] = ray.origin[j];
+		inv_dir[j] = 1.f / ray.direction[j];
+		sign[j] = ( inv_dir[j] < 0.f );
+	}
 
-		// Create the children
-		assert( left_codes.size() > 0 && right_codes.size() > 0 );
-		left_child = std::shared_ptr<BVHNode>( new BVHNode() );
-		right_child = std::shared_ptr<BVHNode>( new BVHNode() );
-		left_child->lbvh_split( bit-1, prims, left_codes, max_depth-1 );
-		right_child->lbvh_split( bit-1, prims, right_codes, max_depth-1 );
-		n_nodes += 2;
+	// Any hit will do, so children are not ordered
+	int stack[ flat_stack_size ];
+	stack[0] = root;
+	int n_stack = 1;
+	float t_near;
+	while( n_stack > 0 ){
+
+		const int idx = stack[ --n_stack ];
+		const FlatNode &node = bvh.nodes[idx];
+		if( !flat_slab( node, origin, inv_dir, sign, t_min, t_max, t_near ) ){ continue; }
+		if( n_stack+2 > flat_stack_size ){
+			if( flat_occluded( bvh, ray, t_min, t_max, idx ) ){ return true; }
+			continue;
+		}
 
-	} // end create childrend
+		if( node.is_leaf() ){
+			for( int i=0; i<node.n_prims; ++i ){
+				int prim = bvh.prim_indices[ node.offset+i ];
+				if( bvh.prim_occluded( prim, ray, t_min, t_max ) ){ return true; }
+			}
+			continue;
+		}
 
-	// Now that the tree is constructed, create the aabb
-	for( int i=0; i<m_objects.size(); ++i ){
-		trimesh::vec bmin, bmax; m_objects[i]->get_aabb( bmin, bmax );
-		*aabb += bmin; *aabb += bmax;
+		stack[ n_stack++ ] = node.offset;
+		stack[ n_stack++ ] = idx+1;
 	}
-	if( left_child != NULL ){ *aabb += *(left_child->aabb); }
-	if( right_child != NULL ){ *aabb += *(right_child->aabb); }
+
+	return false;
+
+} // end flat occluded
+
+
+bool BVHTraversal::occluded( const FlatBVH &bvh, intersect::Ray &ray, double t_min, double t_max ){
+	if( bvh.nodes.size()==0 ){ return false; }
+	return flat_occluded( bvh, ray, t_min, t_max, 0 );
 }
 
 
-//
-//	BVH Traversal
-//
+void BVHTraversal::occluded( const FlatBVH &bvh, std::vector< intersect::Ray > &rays, const std::vector< double > &t_max,
+	std::vector< char > &results, double t_min ){
+
+	const int n_rays = rays.size();
+	results.resize( n_rays );
+	#pragma omp parallel for schedule(dynamic,64)
+	for( int i=0; i<n_rays; ++i ){ results[i] = occluded( bvh, rays[i], t_min, t_max[i] ); }
 
+} // end occluded batch
 
-bool BVHTraversal::ray_intersect( std::shared_ptr<BVHNode> node, intersect::Ray &ray, intersect::Payload &payload ) {
+
+bool BVHTraversal::ray_intersect_recursive( const FlatBVH &bvh, intersect::Ray &ray, intersect::Payload &payload ) {
+	if( bvh.nodes.size()==0 ){ return false; }
+	return ray_intersect( bvh, 0, ray, payload );
+}
+
+
+bool BVHTraversal::ray_intersect( const FlatBVH &bvh, int node_idx, intersect::Ray &ray, intersect::Payload &payload ) {
+
+	const FlatNode &node = bvh.nodes[node_idx];
 
 	// See if we even hit the box
-	if( !node->aabb->ray_intersect( ray.origin, ray.direction, payload.t_min, payload.t_max ) ){ return false; }
+	if( !node.bounds().ray_intersect( ray.origin, ray.direction, payload.t_min, payload.t_max ) ){ return false; }
 
 	// If we have children, progress down the tree
-	if( node->left_child != NULL || node->right_child != NULL ){
+	if( !node.is_leaf() ){
 
 		intersect::Payload payload_l=payload; intersect::Payload payload_r=payload;
-		bool left_hit=false, right_hit=false;
-		if( node->left_child != NULL ){ left_hit = ray_intersect( node->left_child, ray, payload_l ); }
-		if( node->right_child != NULL ){ right_hit = ray_intersect( node->right_child, ray, payload_r ); }
+		bool left_hit = ray_intersect( bvh, node_idx+1, ray, payload_l );
+		bool right_hit = ray_intersect( bvh, node.offset, ray, payload_r );
 
 		// See which child is closer
 		if( left_hit && right_hit ){
-			if( payload_r.t_max < payload_l.t_max ){
-				payload = payload_r;
-				return true;
-			}
-			payload = payload_l;
+			if( payload_r.t_max < payload_l.t_max ){ payload = payload_r; }
+			else{ payload = payload_l; }
 			return true;
 		}
 		else if( right_hit ){
@@ -180,97 +405,2226 @@ bool BVHTraversal::ray_intersect( std::shared_ptr<BVHNode> node, intersect::Ray
 	// Otherwise it's a leaf node, check objects
 	else{
 		bool obj_hit = false;
-		for( int i=0; i<node->m_objects.size(); ++i ){
-			if( node->m_objects[i]->ray_intersect( ray, payload ) ){ obj_hit=true; }
+		for( int i=0; i<node.n_prims; ++i ){
+			int prim = bvh.prim_indices[ node.offset+i ];
+			if( bvh.prim_ray_intersect( prim, ray, payload ) ){ obj_hit=true; }
 		}
 		return obj_hit;
 	} // end ray_intersect objects
 
 	return false;
 
+} // end ray intersect flat
+
+
+bool BVHTraversal::ray_intersect( const DynamicBVH &bvh, intersect::Ray &ray, intersect::Payload &payload ) {
+	if( bvh.root < 0 ){ return false; }
+	return ray_intersect( bvh, bvh.root, ray, payload );
+}
+
+
+bool BVHTraversal::ray_intersect( const DynamicBVH &bvh, int node_idx, intersect::Ray &ray, intersect::Payload &payload ) {
+
+	const DynamicNode &node = bvh.nodes[node_idx];
+	if( !node.aabb.ray_intersect( ray.origin, ray.direction, payload.t_min, payload.t_max ) ){ return false; }
+
+	if( node.is_leaf() ){
+		if( !bvh.prims[ node.prim ]->ray_intersect( ray, payload ) ){ return false; }
+		payload.object = node.prim;
+		return true;
+	}
+
+	// The payload only keeps hits closer than t_max, so both children can share it
+	bool left_hit = ray_intersect( bvh, node.left, ray, payload );
+	bool right_hit = ray_intersect( bvh, node.right, ray, payload );
+	return ( left_hit || right_hit );
+
+} // end ray intersect dynamic
+
+
+//
+//	Two level instances
+//
+
+
+void BVHInstance::set_xform( const trimesh::xform &xf_ ){
+
+	xf = xf_;
+	inv_xf = trimesh::inv( xf );
+	dir_xf = trimesh::rot_only( inv_xf );
+	normal_xf = trimesh::norm_xf( xf );
+
+	// Bounds of the transformed corners of the object space bounds
+	world_aabb = AABB();
+	AABB aabb = blas->bounds();
+	if( !aabb.valid ){ return; }
+	for( int i=0; i<8; ++i ){
+		trimesh::vec corner( i&1 ? aabb.max[0] : aabb.min[0], i&2 ? aabb.max[1] : aabb.min[1], i&4 ? aabb.max[2] : aabb.min[2] );
+		world_aabb += xf * corner;
+	}
+
+} // end set xform
+
+
+bool BVHInstance::ray_intersect( intersect::Ray &ray, intersect::Payload &payload ){
+
+	// The direction is not normalized, so t is the same in both spaces
+	intersect::Ray local;
+	local.origin = inv_xf * ray.origin;
+	local.direction = dir_xf * ray.direction;
+	return BVHTraversal::ray_intersect( *blas, local, payload );
+
 } // end ray intersect
 
 
-int BVHBuilder::make_tree_lbvh( std::shared_ptr<BVHNode> &root, const std::vector< std::shared_ptr<BaseObject> > &objects ){
+void BVHInstance::get_surface( const intersect::Ray &ray, const intersect::Payload &payload, intersect::SurfaceHit &hit ){
+	intersect::Ray local;
+	local.origin = inv_xf * ray.origin;
+	local.direction = dir_xf * ray.direction;
+	intersect::Payload local_payload = payload;
+	local_payload.object = -1;
+	blas->get_surface( local, local_payload, hit );
+	hit.point = ray.origin + ray.direction * float( payload.t_max );
+	hit.n = normal_xf * hit.n;
+}
+
+
+bool BVHInstance::ray_occluded( intersect::Ray &ray, double t_min, double t_max ){
+	intersect::Ray local;
+	local.origin = inv_xf * ray.origin;
+	local.direction = dir_xf * ray.direction;
+	return BVHTraversal::occluded( *blas, local, t_min, t_max );
+}
+
+
+//
+//	Morton codes
+//
+
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define MCL_HAVE_BMI2 1
+#include <immintrin.h>
+
+// Compiled for BMI2 on its own so the rest of the library runs on any cpu
+__attribute__((target("bmi2")))
+static void morton_encode_bmi2( const std::vector< trimesh::vec > &centroids, const trimesh::vec &bmin,
+	const trimesh::vec &scale, std::vector< std::pair< morton_type, int > > &codes ){
+	const int n = centroids.size();
+	#pragma omp parallel for
+	for( int i=0; i<n; ++i ){
+		morton_encode_type c[3];
+		for( int j=0; j<3; ++j ){
+			c[j] = std::min( morton_encode_type( std::max( ( centroids[i][j] - bmin[j] ) * scale[j], 0.f ) ), morton_max );
+		}
+		morton_type code = _pdep_u64( c[0], 0x1249249249249249ull ) | _pdep_u64( c[1], 0x2492492492492492ull ) |
+			_pdep_u64( c[2], 0x4924924924924924ull );
+		codes[i] = std::make_pair( code, i );
+	}
+}
+#endif
+
+
+bool BVHBuilder::has_bmi2(){
+#ifdef MCL_HAVE_BMI2
+	static const bool bmi2 = __builtin_cpu_supports( "bmi2" );
+	return bmi2;
+#else
+	return false;
+#endif
+}
 
-	root.reset( new BVHNode );
 
-	n_nodes = 1;
+void BVHBuilder::morton_codes( const std::vector< trimesh::vec > &centroids, const AABB &bounds,
+	std::vector< std::pair< morton_type, int > > &codes, bool use_bmi2 ){
 
 	using namespace trimesh;
 
-	// Get all the primitives in the domain
-	std::vector< std::shared_ptr<BaseObject> > prims;
-	for( int i=0; i<objects.size(); ++i ){ objects[i]->get_primitives( prims ); }
+	// Scale each centroid to [0,morton_max], flat axes stay at zero
+	vec scale = bounds.max - bounds.min;
+	for( int i=0; i<3; ++i ){ scale[i] = scale[i] > 0.f ? float( morton_max ) / scale[i] : 0.f; }
+
+	const int n = centroids.size();
+	codes.resize( n );
+
+#ifdef MCL_HAVE_BMI2
+	if( use_bmi2 && has_bmi2() ){
+		morton_encode_bmi2( centroids, bounds.min, scale, codes );
+		return;
+	}
+#endif
+
+	#pragma omp parallel for
+	for( int i=0; i<n; ++i ){
+		morton_encode_type c[3];
+		for( int j=0; j<3; ++j ){
+			c[j] = std::min( morton_encode_type( std::max( ( centroids[i][j] - bounds.min[j] ) * scale[j], 0.f ) ), morton_max );
+		}
+		codes[i] = std::make_pair( morton_encode( c[0], c[1], c[2] ), i );
+	}
+
+} // end morton codes
+
+
+void BVHBuilder::radix_sort( std::vector< std::pair< morton_type, int > > &codes ){
+
+	const int n = codes.size();
+	if( n < 2 ){ return; }
+
+	// Small inputs aren't worth the passes
+	if( n < 1024 ){ std::stable_sort( codes.begin(), codes.end(),
+		[]( const std::pair< morton_type, int > &a, const std::pair< morton_type, int > &b ){ return a.first < b.first; } );
+		return;
+	}
+
+	const int radix_bits = 11;
+	const int n_buckets = 1 << radix_bits;
+	// Each block is counted and scattered by one thread
+	int n_blocks = 1;
+#ifdef _OPENMP
+	n_blocks = std::min( omp_get_max_threads(), n/1024 );
+#endif
+
+	std::vector< std::pair< morton_type, int > > buffer( n );
+	std::vector< int > counts( n_blocks*n_buckets );
+	std::pair< morton_type, int > *src = &codes[0], *dst = &buffer[0];
+
+	for( int shift=0; shift<64; shift+=radix_bits ){
+
+		// Count the digits of each block. The blocks are the same
+		// in both loops, which keeps the sort stable.
+		std::fill( counts.begin(), counts.end(), 0 );
+		#pragma omp parallel for schedule(static,1)
+		for( int t=0; t<n_blocks; ++t ){
+			int begin = ( long(n)*t ) / n_blocks, end = ( long(n)*(t+1) ) / n_blocks;
+			int *count = &counts[ t*n_buckets ];
+			for( int i=begin; i<end; ++i ){ count[ ( src[i].first >> shift ) & (n_buckets-1) ]++; }
+		}
+
+		// Skip the pass if every code has the same digit
+		bool skip = false;
+		for( int b=0; b<n_buckets && !skip; ++b ){
+			int total = 0;
+			for( int t=0; t<n_blocks; ++t ){ total += counts[ t*n_buckets+b ]; }
+			if( total == n ){ skip = true; }
+		}
+		if( skip ){ continue; }
+
+		// Exclusive scan, bucket major so each block writes after the earlier blocks
+		int sum = 0;
+		for( int b=0; b<n_buckets; ++b ){
+			for( int t=0; t<n_blocks; ++t ){
+				int c = counts[ t*n_buckets+b ];
+				counts[ t*n_buckets+b ] = sum;
+				sum += c;
+			}
+		}
+
+		#pragma omp parallel for schedule(static,1)
+		for( int t=0; t<n_blocks; ++t ){
+			int begin = ( long(n)*t ) / n_blocks, end = ( long(n)*(t+1) ) / n_blocks;
+			int *offset = &counts[ t*n_buckets ];
+			for( int i=begin; i<end; ++i ){ dst[ offset[ ( src[i].first >> shift ) & (n_buckets-1) ]++ ] = src[i]; }
+		}
+
+		std::swap( src, dst );
+
+	} // end loop passes
+
+	if( src != &codes[0] ){ codes.swap( buffer ); }
+
+} // end radix sort
+
+
+//
+//	Parallel radix tree LBVH (Karras 2012)
+//
+
+
+AABB BVHBuilder::prim_bounds( const BVHPrimitives &prims,
+	std::vector< AABB > &prim_aabbs, std::vector< trimesh::vec > &centroids ){
+
+	using namespace trimesh;
 
-	// Compute centroids
-	std::vector< vec > centroids( prims.size() );
-	AABB world_aabb;
-	for( int i=0; i<prims.size(); ++i ){
-		vec bmin, bmax; prims[i]->get_aabb( bmin, bmax );
-		world_aabb += bmin; world_aabb += bmax;
-		centroids[i]=( (bmin+bmax)*0.5f );
+	const int n_prims = prims.num_prims();
+	prim_aabbs.resize( n_prims );
+	centroids.resize( n_prims );
+	AABB centroid_aabb;
+
+	#pragma omp parallel
+	{
+		AABB thread_aabb;
+		#pragma omp for
+		for( int i=0; i<n_prims; ++i ){
+			vec bmin, bmax; prims.prim_aabb( i, bmin, bmax );
+			prim_aabbs[i] = AABB(); prim_aabbs[i] += bmin; prim_aabbs[i] += bmax;
+			centroids[i] = (bmin+bmax)*0.5f;
+			thread_aabb += centroids[i];
+		}
+		#pragma omp critical
+		{ centroid_aabb += thread_aabb; }
 	}
 
-	float max_scaled = 1024.f;
-	vec world_min( world_aabb.min );
-	vec world_max( world_aabb.max );
-	vec world_len = max_scaled / (world_max-world_min);
+	return centroid_aabb;
+
+} // end prim bounds
+
+
+BVHStats BVHBuilder::make_tree_lbvh( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects ){
+
+	using namespace trimesh;
+
+	BVHStats stats;
+	std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	bvh.clear();
+	bvh.add_objects( objects );
+	const int n_prims = bvh.num_prims();
+	if( n_prims == 0 ){ return stats; }
+
+	std::vector< AABB > prim_aabbs;
+	std::vector< vec > centroids;
+	AABB world_aabb = prim_bounds( bvh, prim_aabbs, centroids );
+	stats.add_timing( "prim bounds", start );
+
+	std::vector< std::pair< morton_type, int > > morton_codes;
+	BVHBuilder::morton_codes( centroids, world_aabb, morton_codes );
+	stats.add_timing( "morton codes", start );
+	radix_sort( morton_codes );
+	stats.add_timing( "radix sort", start );
+
+	// Leaves are stored in morton order, one primitive each
+	bvh.prim_indices.resize( n_prims );
+	#pragma omp parallel for
+	for( int i=0; i<n_prims; ++i ){ bvh.prim_indices[i] = morton_codes[i].second; }
+
+	// Internal nodes are [0,n-2], leaves are [n-1,2n-2] and the root is node 0.
+	const int n_internal = n_prims-1;
+	bvh.nodes.resize( 2*n_prims-1 );
+	std::vector< int > left( n_internal ), right( n_internal ), first( n_internal ), parent( 2*n_prims-1, -1 );
+
+	// Length of the common prefix of two codes, or -1 if j is out of range.
+	// Duplicate codes fall back to comparing their indices.
+	auto delta = [&]( int i, int j ) -> int {
+		if( j < 0 || j >= n_prims ){ return -1; }
+		morton_encode_type a = morton_codes[i].first, b = morton_codes[j].first;
+		if( a == b ){ return 64 + helper::count_leading_zeros( morton_encode_type( i ^ j ) ); }
+		return helper::count_leading_zeros( a ^ b );
+	};
+
+	// Build every internal node independently
+	#pragma omp parallel for
+	for( int i=0; i<n_internal; ++i ){
+
+		// Direction of the range and the prefix length of the sibling
+		int d = ( delta( i, i+1 ) - delta( i, i-1 ) ) > 0 ? 1 : -1;
+		int delta_min = delta( i, i-d );
+
+		// Find the other end of the range
+		int l_max = 2;
+		while( delta( i, i+l_max*d ) > delta_min ){ l_max *= 2; }
+		int l = 0;
+		for( int t=l_max/2; t>=1; t/=2 ){
+			if( delta( i, i+(l+t)*d ) > delta_min ){ l += t; }
+		}
+		int j = i + l*d;
+
+		// Find the split position
+		int delta_node = delta( i, j );
+		int s = 0, t = l;
+		do {
+			t = (t+1)/2;
+			if( delta( i, i+(s+t)*d ) > delta_node ){ s += t; }
+		} while( t > 1 );
+		int gamma = i + s*d + std::min( d, 0 );
+
+		first[i] = std::min( i, j );
+		left[i] = ( first[i] == gamma ) ? n_internal+gamma : gamma;
+		right[i] = ( std::max( i, j ) == gamma+1 ) ? n_internal+gamma+1 : gamma+1;
+		parent[ left[i] ] = i;
+		parent[ right[i] ] = i;
+
+	} // end build internal nodes
+	stats.add_timing( "hierarchy", start );
+
+	// Position of each node in the depth first array
+	std::vector< int > flat_idx( 2*n_prims-1 );
+	if( n_internal == 0 ){ flat_idx[0] = 0; }
+	else {
+		#pragma omp parallel
+		{
+			#pragma omp single
+			lbvh_preorder( 0, 0, n_internal, left, right, first, flat_idx );
+		}
+	}
 
-	// Assign morton codes
-	std::vector< std::pair< morton_type, int > > morton_codes( prims.size() );
+	// Bottom-up pass for the bounds. The second thread to reach a node
+	// knows both children are done and continues up the tree.
+	std::vector< std::atomic<int> > visits( std::max( n_internal, 1 ) );
 	#pragma omp parallel for
-	for( int i=0; i<prims.size(); ++i ){
+	for( int i=0; i<n_prims; ++i ){
+
+		int node = n_internal+i;
+		FlatNode &leaf = bvh.nodes[ flat_idx[node] ];
+		leaf.bmin = prim_aabbs[ bvh.prim_indices[i] ].min;
+		leaf.bmax = prim_aabbs[ bvh.prim_indices[i] ].max;
+		leaf.offset = i;
+		leaf.n_prims = 1;
+
+		while( parent[node] >= 0 ){
+			node = parent[node];
+			if( visits[node].fetch_add(1) == 0 ){ break; }
+			const FlatNode &l = bvh.nodes[ flat_idx[ left[node] ] ];
+			const FlatNode &r = bvh.nodes[ flat_idx[ right[node] ] ];
+			FlatNode &curr = bvh.nodes[ flat_idx[node] ];
+			for( int j=0; j<3; ++j ){
+				curr.bmin[j] = std::min( l.bmin[j], r.bmin[j] );
+				curr.bmax[j] = std::max( l.bmax[j], r.bmax[j] );
+			}
+			curr.offset = flat_idx[ right[node] ];
+			curr.n_prims = 0;
+		}
+
+	} // end compute bounds
+	stats.add_timing( "node bounds", start );
+
+	bvh.get_stats( stats );
+	return stats;
+
+} // end make tree lbvh
+
+
+void BVHBuilder::lbvh_preorder( const int node, const int pre, const int n_internal, const std::vector<int> &left,
+	const std::vector<int> &right, const std::vector<int> &first, std::vector<int> &flat_idx ){
+
+	flat_idx[node] = pre;
+	if( node >= n_internal ){ return; }
+
+	// The left subtree has one leaf per primitive before the right child's range,
+	// so it takes up 2*n_left-1 nodes in the array.
+	int l = left[node], r = right[node];
+	int r_first = r >= n_internal ? r-n_internal : first[r];
+	int n_left = r_first - first[node];
+	int r_pre = pre + 2*n_left;
+
+	// Spawn big subtrees as tasks, small ones are done in place
+	if( n_left > 4096 ){
+		#pragma omp task shared( left, right, first, flat_idx )
+		lbvh_preorder( l, pre+1, n_internal, left, right, first, flat_idx );
+	}
+	else { lbvh_preorder( l, pre+1, n_internal, left, right, first, flat_idx ); }
+	lbvh_preorder( r, r_pre, n_internal, left, right, first, flat_idx );
+
+	#pragma omp taskwait
+
+} // end lbvh preorder
+
+
+//
+//	Task parallel object median build
+//
+
+
+BVHStats BVHBuilder::make_tree_spatial( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects ){
+
+	using namespace trimesh;
+
+	BVHStats stats;
+	std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	bvh.clear();
+	bvh.add_objects( objects );
+	const int n_prims = bvh.num_prims();
+	if( n_prims == 0 ){ return stats; }
+
+	// Primitive bounds and centroids are computed once, and the split
+	// partitions a single index array in place.
+	std::vector< AABB > prim_aabbs;
+	std::vector< vec > centroids;
+	prim_bounds( bvh, prim_aabbs, centroids );
+	bvh.prim_indices.resize( n_prims );
+	std::iota( bvh.prim_indices.begin(), bvh.prim_indices.end(), 0 );
+	std::vector< int > scratch( n_prims );
+	stats.add_timing( "prim bounds", start );
+
+	// Every leaf has one primitive, so the tree has exactly 2n-1 nodes
+	// and each subtree knows where it goes in the array.
+	bvh.nodes.resize( 2*n_prims-1 );
+	#pragma omp parallel
+	{
+		#pragma omp single
+		median_split( bvh, scratch, prim_aabbs, centroids, 0, 0, n_prims, 0 );
+	}
+
+	stats.add_timing( "build", start );
+
+	bvh.get_stats( stats );
+	return stats;
+
+} // end make tree spatial
+
+
+int BVHBuilder::median_split( FlatBVH &bvh, std::vector<int> &scratch, const std::vector< AABB > &prim_aabbs,
+	const std::vector< trimesh::vec > &centroids, const int node, const int begin, const int end, const int split_axis ){
+
+	const int n = end-begin;
+	const bool parallel = n > task_size;
+
+	// Create the aabb
+	AABB aabb = range_bounds( bvh.prim_indices, prim_aabbs, begin, end, parallel );
+	bvh.nodes[node].bmin = aabb.min;
+	bvh.nodes[node].bmax = aabb.max;
 
-		// Scale the centroid to a value between 0 and max_scaled and convert to integer.
-		vec cent = centroids[i];
-		cent = ( cent - world_min ) * world_len;
-		morton_encode_type ix = morton_encode_type( cent[0] );
-		morton_encode_type iy = morton_encode_type( cent[1] );
-		morton_encode_type iz = morton_encode_type( cent[2] );
+	// If num faces == 1, we're done
+	if( n == 1 ){
+		bvh.nodes[node].offset = begin;
+		bvh.nodes[node].n_prims = 1;
+		return 1;
+	}
+
+	// Split faces about the center of the box
+	float center = aabb.center()[split_axis];
+	int mid = 0;
+	if( parallel ){ mid = parallel_partition( bvh.prim_indices, scratch, centroids, begin, end, split_axis, center ); }
+	else {
+		int *split = std::partition( &bvh.prim_indices[0]+begin, &bvh.prim_indices[0]+end, [&]( int prim ){
+			return centroids[prim][split_axis] <= center;
+		});
+		mid = split - &bvh.prim_indices[0];
+	}
 
-		morton_codes[i] = std::make_pair( morton_encode( ix, iy, iz ), i );
+	// Check to make sure things got sorted. Sometimes small meshes fail.
+	if( mid == begin || mid == end ){ mid = begin + n/2; }
+
+	// Create the children. The left subtree takes 2*n_left-1 nodes.
+	const int left = node+1;
+	const int right = node + 2*(mid-begin);
+	const int next_axis = (split_axis+1)%3;
+	bvh.nodes[node].offset = right;
+	bvh.nodes[node].n_prims = 0;
+
+	int left_nodes = 0, right_nodes = 0;
+	if( parallel ){
+		#pragma omp task shared( bvh, scratch, prim_aabbs, centroids, left_nodes )
+		left_nodes = median_split( bvh, scratch, prim_aabbs, centroids, left, begin, mid, next_axis );
 	}
+	else { left_nodes = median_split( bvh, scratch, prim_aabbs, centroids, left, begin, mid, next_axis ); }
+	right_nodes = median_split( bvh, scratch, prim_aabbs, centroids, right, mid, end, next_axis );
+
+	#pragma omp taskwait
+
+	return left_nodes + right_nodes + 1;
+
+} // end median split
 
-	// Find first non-zero most signficant bit
-	int start_bit = sizeof(morton_type)*8-1;
-	bool found=false;
-	for( start_bit; start_bit > 1 && !found; --start_bit ){
 
-		#pragma omp parallel for
-		for( int i=0; i<morton_codes.size(); ++i ){
-			if( helper::check_bit( morton_codes[i].first, start_bit ) ){
-				#pragma omp critical
-				{ found=true; }
+AABB BVHBuilder::range_bounds( const std::vector<int> &indices, const std::vector< AABB > &prim_aabbs,
+	const int begin, const int end, const bool parallel ){
+
+	AABB aabb;
+	if( !parallel || end-begin <= task_size ){
+		for( int i=begin; i<end; ++i ){ aabb += prim_aabbs[ indices[i] ]; }
+		return aabb;
+	}
+
+	// Split the range in halves and reduce them as tasks
+	const int mid = begin + (end-begin)/2;
+	AABB left;
+	#pragma omp task shared( indices, prim_aabbs, left )
+	left = range_bounds( indices, prim_aabbs, begin, mid, true );
+	aabb = range_bounds( indices, prim_aabbs, mid, end, true );
+	#pragma omp taskwait
+	aabb += left;
+	return aabb;
+
+} // end range bounds
+
+
+int BVHBuilder::parallel_partition( std::vector<int> &indices, std::vector<int> &scratch, const std::vector< trimesh::vec > &centroids,
+	const int begin, const int end, const int axis, const float center ){
+
+	// Count the left side of each block, then scatter both sides
+	// into the scratch range and copy it back.
+	const int block_size = task_size;
+	const int n_blocks = ( end-begin + block_size-1 ) / block_size;
+	std::vector< int > left_counts( n_blocks, 0 );
+
+	for( int b=0; b<n_blocks; ++b ){
+		#pragma omp task shared( indices, centroids, left_counts )
+		{
+			int b_end = std::min( begin+(b+1)*block_size, end );
+			for( int i=begin+b*block_size; i<b_end; ++i ){
+				if( centroids[ indices[i] ][axis] <= center ){ left_counts[b]++; }
+			}
+		}
+	}
+	#pragma omp taskwait
+
+	std::vector< int > left_offsets( n_blocks ), right_offsets( n_blocks );
+	int n_left = 0;
+	for( int b=0; b<n_blocks; ++b ){ left_offsets[b] = n_left; n_left += left_counts[b]; }
+	for( int b=0; b<n_blocks; ++b ){ right_offsets[b] = n_left + b*block_size - left_offsets[b]; }
+
+	for( int b=0; b<n_blocks; ++b ){
+		#pragma omp task shared( indices, scratch, centroids, left_offsets, right_offsets )
+		{
+			int l = begin + left_offsets[b], r = begin + right_offsets[b];
+			int b_end = std::min( begin+(b+1)*block_size, end );
+			for( int i=begin+b*block_size; i<b_end; ++i ){
+				if( centroids[ indices[i] ][axis] <= center ){ scratch[l++] = indices[i]; }
+				else{ scratch[r++] = indices[i]; }
 			}
 		}
+	}
+	#pragma omp taskwait
+
+	for( int b=0; b<n_blocks; ++b ){
+		#pragma omp task shared( indices, scratch )
+		{
+			int b_end = std::min( begin+(b+1)*block_size, end );
+			std::copy( &scratch[0]+begin+b*block_size, &scratch[0]+b_end, &indices[0]+begin+b*block_size );
+		}
+	}
+	#pragma omp taskwait
 
-	} // end find starting bit
+	return begin + n_left;
 
-	// Now that we have the morton codes, we can recursively build the BVH in a top down manner
-	root->lbvh_split( start_bit, prims, morton_codes, 10000 );
+} // end parallel partition
 
-	std::cout << "\nLBVH Balance: " << avg_balance / float(num_avg_balance) << std::endl;
-	std::cout << "Linear BVH made " << n_nodes << " nodes for " << prims.size() << " primitives." << std::endl;
 
-	return n_nodes;
+//
+//	Binned SAH build
+//
+
 
-}
+BVHStats BVHBuilder::make_tree_sah( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects,
+	int max_leaf_size, float traversal_cost, int n_bins ){
 
+	using namespace trimesh;
 
-int BVHBuilder::make_tree_spatial( std::shared_ptr<BVHNode> &root, const std::vector< std::shared_ptr<BaseObject> > &objects ){
+	BVHStats stats;
+	std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	bvh.clear();
+	bvh.add_objects( objects );
+	const int n_prims = bvh.num_prims();
+	if( n_prims == 0 ){ return stats; }
 
-	n_nodes = 1;
+	// Primitive bounds and centroids are computed once and reused at every level
+	std::vector< AABB > prim_aabbs;
+	std::vector< vec > centroids;
+	prim_bounds( bvh, prim_aabbs, centroids );
+	stats.add_timing( "prim bounds", start );
 
-	// Get all the primitives in the domain and start construction
-	std::vector< std::shared_ptr<BaseObject> > prims;
-	for( int i=0; i<objects.size(); ++i ){ objects[i]->get_primitives( prims ); }
-	std::vector< int > queue( prims.size() );
-	std::iota( std::begin(queue), std::end(queue), 0 );
-	root->spatial_split( prims, queue, 0, 10000 );
+	bvh.prim_indices.resize( n_prims );
+	std::iota( bvh.prim_indices.begin(), bvh.prim_indices.end(), 0 );
+	bvh.nodes.reserve( 2*n_prims );
+	sah_split( bvh, prim_aabbs, centroids, 0, n_prims, std::max( max_leaf_size, 1 ), traversal_cost, std::max( n_bins, 2 ) );
+	stats.add_timing( "build", start );
 
-	return n_nodes;
+	bvh.get_stats( stats, traversal_cost );
 
-	std::cout << "Object Median BVH made " << n_nodes << " nodes for " << prims.size() << " primitives." << std::endl;
-}
+	return stats;
+
+} // end make tree sah
+
+
+int BVHBuilder::sah_split( FlatBVH &bvh, const std::vector< AABB > &prim_aabbs, const std::vector< trimesh::vec > &centroids,
+	const int begin, const int end, const int max_leaf_size, const float traversal_cost, const int n_bins ){
+
+	using namespace trimesh;
+
+	// Node bounds and the bounds of centroids, which are used for binning
+	AABB node_aabb, cent_aabb;
+	for( int i=begin; i<end; ++i ){
+		int prim = bvh.prim_indices[i];
+		node_aabb += prim_aabbs[prim];
+		cent_aabb += centroids[prim];
+	}
+
+	int idx = bvh.nodes.size();
+	bvh.nodes.push_back( FlatNode() );
+	bvh.nodes[idx].bmin = node_aabb.min;
+	bvh.nodes[idx].bmax = node_aabb.max;
+
+	const int n = end-begin;
+	if( n == 1 ){
+		bvh.nodes[idx].offset = begin;
+		bvh.nodes[idx].n_prims = n;
+		return idx;
+	}
+
+	// Find the cheapest split plane over all axes
+	float best_cost = std::numeric_limits<float>::max();
+	int best_axis = -1, best_bin = -1;
+	std::vector< AABB > bin_aabbs( n_bins );
+	std::vector< int > bin_counts( n_bins );
+	std::vector< float > right_areas( n_bins );
+	std::vector< int > right_counts( n_bins );
+	for( int axis=0; axis<3; ++axis ){
+
+		float extent = cent_aabb.max[axis] - cent_aabb.min[axis];
+		if( extent <= 0.f ){ continue; }
+		float scale = float(n_bins) / extent;
+
+		std::fill( bin_aabbs.begin(), bin_aabbs.end(), AABB() );
+		std::fill( bin_counts.begin(), bin_counts.end(), 0 );
+		for( int i=begin; i<end; ++i ){
+			int prim = bvh.prim_indices[i];
+			int b = std::min( n_bins-1, int( (centroids[prim][axis]-cent_aabb.min[axis])*scale ) );
+			bin_aabbs[b] += prim_aabbs[prim];
+			bin_counts[b]++;
+		}
+
+		// Sweep from the right to get areas of all right partitions,
+		// then from the left to evaluate the cost of each plane.
+		AABB right; int right_count = 0;
+		for( int b=n_bins-1; b>0; --b ){
+			right += bin_aabbs[b]; right_count += bin_counts[b];
+			right_areas[b] = right.surface_area(); right_counts[b] = right_count;
+		}
+		AABB left; int left_count = 0;
+		for( int b=0; b<n_bins-1; ++b ){
+			left += bin_aabbs[b]; left_count += bin_counts[b];
+			if( left_count == 0 || right_counts[b+1] == 0 ){ continue; }
+			float cost = left.surface_area()*left_count + right_areas[b+1]*right_counts[b+1];
+			if( cost < best_cost ){ best_cost = cost; best_axis = axis; best_bin = b; }
+		}
+
+	} // end loop axes
+
+	// Terminate if intersecting everything is cheaper than the best split
+	float node_area = node_aabb.surface_area();
+	float leaf_cost = float(n);
+	float split_cost = node_area > 0.f ? traversal_cost + best_cost/node_area : traversal_cost;
+	if( n <= max_leaf_size && ( best_axis < 0 || split_cost >= leaf_cost ) ){
+		bvh.nodes[idx].offset = begin;
+		bvh.nodes[idx].n_prims = n;
+		return idx;
+	}
+
+	// Partition the primitive indices in place
+	int mid = begin + n/2;
+	if( best_axis >= 0 ){
+		float scale = float(n_bins) / ( cent_aabb.max[best_axis] - cent_aabb.min[best_axis] );
+		float cmin = cent_aabb.min[best_axis];
+		int *split = std::partition( &bvh.prim_indices[begin], &bvh.prim_indices[0]+end, [&]( int prim ){
+			return std::min( n_bins-1, int( (centroids[prim][best_axis]-cmin)*scale ) ) <= best_bin;
+		});
+		mid = split - &bvh.prim_indices[0];
+	}
+
+	// All centroids are in the same place, so split by count
+	if( mid == begin || mid == end ){ mid = begin + n/2; }
+
+	sah_split( bvh, prim_aabbs, centroids, begin, mid, max_leaf_size, traversal_cost, n_bins );
+	int right = sah_split( bvh, prim_aabbs, centroids, mid, end, max_leaf_size, traversal_cost, n_bins );
+	bvh.nodes[idx].offset = right;
+	bvh.nodes[idx].n_prims = 0;
+	return idx;
+
+} // end sah split
+
+
+//
+//	Split BVH (spatial splits with reference duplication)
+//
+
+
+BVHStats BVHBuilder::make_tree_sbvh( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects,
+	int max_leaf_size, float traversal_cost, int n_bins, float max_duplication, float min_overlap ){
+
+	using namespace trimesh;
+
+	BVHStats stats;
+	std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	bvh.clear();
+	bvh.add_objects( objects );
+	const int n_prims = bvh.num_prims();
+	if( n_prims == 0 ){ return stats; }
+
+	std::vector< AABB > prim_aabbs;
+	std::vector< vec > centroids;
+	prim_bounds( bvh, prim_aabbs, centroids );
+
+	SBVHState state;
+	state.max_leaf_size = std::max( max_leaf_size, 1 );
+	state.n_bins = std::max( n_bins, 2 );
+	state.budget = int( std::max( max_duplication, 0.f ) * float(n_prims) );
+	state.traversal_cost = traversal_cost;
+	state.tri_verts.resize( 3*n_prims, NULL );
+
+	std::vector< SBVHRef > refs( n_prims );
+	AABB root_aabb;
+	for( int i=0; i<n_prims; ++i ){
+		refs[i].aabb = prim_aabbs[i];
+		refs[i].prim = i;
+		root_aabb += prim_aabbs[i];
+		if( bvh.is_triangle( i ) && !bvh.is_swept( i ) ){
+			state.tri_verts[3*i] = &bvh.vertex( i, 0 );
+			state.tri_verts[3*i+1] = &bvh.vertex( i, 1 );
+			state.tri_verts[3*i+2] = &bvh.vertex( i, 2 );
+		}
+	}
+	state.min_overlap_area = min_overlap * root_aabb.surface_area();
+	stats.add_timing( "prim bounds", start );
+
+	bvh.prim_indices.reserve( n_prims + state.budget );
+	bvh.nodes.reserve( 2*n_prims );
+	sbvh_split( bvh, state, refs, 0 );
+	stats.add_timing( "build", start );
+
+	bvh.get_stats( stats, traversal_cost );
+
+	return stats;
+
+} // end make tree sbvh
+
+
+AABB BVHBuilder::clip_ref( const SBVHState &state, const SBVHRef &ref, const int axis, const float lo, const float hi ){
+
+	using namespace trimesh;
+
+	// Bounds of the primitive's part in the slab, within the reference's bounds
+	AABB aabb = ref.aabb;
+	aabb.min[axis] = std::max( aabb.min[axis], lo );
+	aabb.max[axis] = std::min( aabb.max[axis], hi );
+	const vec * const *verts = &state.tri_verts[ 3*ref.prim ];
+	if( verts[0] == NULL ){ return aabb; }
+
+	// Clip the triangle by both planes of the slab (Sutherland-Hodgman)
+	vec poly[2][9];
+	int n = 3;
+	poly[0][0] = *verts[0]; poly[0][1] = *verts[1]; poly[0][2] = *verts[2];
+	int curr = 0;
+	for( int side=0; side<2; ++side ){
+		float plane = side==0 ? lo : hi;
+		float sign = side==0 ? 1.f : -1.f;
+		int n_out = 0;
+		for( int i=0; i<n; ++i ){
+			const vec &a = poly[curr][i];
+			const vec &b = poly[curr][(i+1)%n];
+			float da = sign*( a[axis]-plane );
+			float db = sign*( b[axis]-plane );
+			if( da >= 0.f ){ poly[1-curr][n_out++] = a; }
+			if( ( da < 0.f && db > 0.f ) || ( da > 0.f && db < 0.f ) ){
+				vec p = a + ( b-a ) * ( da/( da-db ) );
+				p[axis] = plane;
+				poly[1-curr][n_out++] = p;
+			}
+		}
+		n = n_out;
+		curr = 1-curr;
+		if( n == 0 ){ return aabb; }
+	}
+
+	AABB clipped;
+	for( int i=0; i<n; ++i ){ clipped += poly[curr][i]; }
+	for( int i=0; i<3; ++i ){
+		aabb.min[i] = std::max( aabb.min[i], clipped.min[i] );
+		aabb.max[i] = std::min( aabb.max[i], clipped.max[i] );
+		if( aabb.min[i] > aabb.max[i] ){ aabb.min[i] = aabb.max[i] = clipped.min[i]; }
+	}
+	return aabb;
+
+} // end clip ref
+
+
+int BVHBuilder::sbvh_split( FlatBVH &bvh, SBVHState &state, std::vector< SBVHRef > &refs, const int depth ){
+
+	using namespace trimesh;
+
+	const int n = refs.size();
+	const int n_bins = state.n_bins;
+	AABB node_aabb, cent_aabb;
+	for( int i=0; i<n; ++i ){
+		node_aabb += refs[i].aabb;
+		cent_aabb += refs[i].aabb.center();
+	}
+
+	int idx = bvh.nodes.size();
+	bvh.nodes.push_back( FlatNode() );
+	bvh.nodes[idx].bmin = node_aabb.min;
+	bvh.nodes[idx].bmax = node_aabb.max;
+
+	// Leaves copy their references into prim_indices
+	bool leaf = n == 1;
+	int obj_axis = -1, obj_bin = -1, spatial_axis = -1, spatial_bin = -1;
+	float obj_cost = std::numeric_limits<float>::max(), spatial_cost = obj_cost;
+	if( !leaf ){
+
+		// Object split, same as sah_split but keeping the bounds of the best children
+		AABB obj_left, obj_right;
+		std::vector< AABB > bin_aabbs( n_bins ), right_aabbs( n_bins );
+		std::vector< int > bin_counts( n_bins ), right_counts( n_bins );
+		for( int axis=0; axis<3; ++axis ){
+
+			float extent = cent_aabb.max[axis] - cent_aabb.min[axis];
+			if( extent <= 0.f ){ continue; }
+			float scale = float(n_bins) / extent;
+
+			std::fill( bin_aabbs.begin(), bin_aabbs.end(), AABB() );
+			std::fill( bin_counts.begin(), bin_counts.end(), 0 );
+			for( int i=0; i<n; ++i ){
+				int b = std::min( n_bins-1, int( (refs[i].aabb.center()[axis]-cent_aabb.min[axis])*scale ) );
+				bin_aabbs[b] += refs[i].aabb;
+				bin_counts[b]++;
+			}
+
+			AABB right; int right_count = 0;
+			for( int b=n_bins-1; b>0; --b ){
+				right += bin_aabbs[b]; right_count += bin_counts[b];
+				right_aabbs[b] = right; right_counts[b] = right_count;
+			}
+			AABB left; int left_count = 0;
+			for( int b=0; b<n_bins-1; ++b ){
+				left += bin_aabbs[b]; left_count += bin_counts[b];
+				if( left_count == 0 || right_counts[b+1] == 0 ){ continue; }
+				float cost = left.surface_area()*left_count + right_aabbs[b+1].surface_area()*right_counts[b+1];
+				if( cost < obj_cost ){ obj_cost = cost; obj_axis = axis; obj_bin = b; obj_left = left; obj_right = right_aabbs[b+1]; }
+			}
+
+		} // end loop axes
+
+		// Spatial splits are only worth trying if the object split children overlap
+		AABB overlap;
+		if( obj_axis >= 0 ){
+			overlap.valid = true;
+			for( int i=0; i<3; ++i ){
+				overlap.min[i] = std::max( obj_left.min[i], obj_right.min[i] );
+				overlap.max[i] = std::min( obj_left.max[i], obj_right.max[i] );
+				if( overlap.min[i] > overlap.max[i] ){ overlap.valid = false; }
+			}
+		}
+		bool try_spatial = state.budget > 0 && depth < sbvh_max_depth &&
+			( obj_axis < 0 || overlap.surface_area() > state.min_overlap_area );
+
+		// Spatial split, references are clipped into every bin they overlap. Entry and
+		// exit counts give the number of references on each side of a plane.
+		std::vector< int > entries( n_bins ), exits( n_bins );
+		for( int axis=0; axis<3 && try_spatial; ++axis ){
+
+			float lo = node_aabb.min[axis];
+			float extent = node_aabb.max[axis] - lo;
+			if( extent <= 0.f ){ continue; }
+			float width = extent / float(n_bins);
+			float scale = float(n_bins) / extent;
+
+			std::fill( bin_aabbs.begin(), bin_aabbs.end(), AABB() );
+			std::fill( entries.begin(), entries.end(), 0 );
+			std::fill( exits.begin(), exits.end(), 0 );
+			for( int i=0; i<n; ++i ){
+				const SBVHRef &ref = refs[i];
+				int b0 = std::max( 0, std::min( n_bins-1, int( (ref.aabb.min[axis]-lo)*scale ) ) );
+				int b1 = std::max( b0, std::min( n_bins-1, int( (ref.aabb.max[axis]-lo)*scale ) ) );
+				if( b0 == b1 ){ bin_aabbs[b0] += ref.aabb; }
+				else{
+					for( int b=b0; b<=b1; ++b ){
+						float b_lo = b==0 ? lo : lo + width*float(b);
+						float b_hi = b==n_bins-1 ? node_aabb.max[axis] : lo + width*float(b+1);
+						bin_aabbs[b] += clip_ref( state, ref, axis, b_lo, b_hi );
+					}
+				}
+				entries[b0]++;
+				exits[b1]++;
+			}
+
+			AABB right; int right_count = 0;
+			for( int b=n_bins-1; b>0; --b ){
+				right += bin_aabbs[b]; right_count += exits[b];
+				right_aabbs[b] = right; right_counts[b] = right_count;
+			}
+			AABB left; int left_count = 0;
+			for( int b=0; b<n_bins-1; ++b ){
+				left += bin_aabbs[b]; left_count += entries[b];
+				if( left_count == 0 || right_counts[b+1] == 0 ){ continue; }
+				float cost = left.surface_area()*left_count + right_aabbs[b+1].surface_area()*right_counts[b+1];
+				if( cost < spatial_cost ){ spatial_cost = cost; spatial_axis = axis; spatial_bin = b; }
+			}
+
+		} // end loop axes
+
+		float best_cost = std::min( obj_cost, spatial_cost );
+		float node_area = node_aabb.surface_area();
+		float split_cost = node_area > 0.f ? state.traversal_cost + best_cost/node_area : state.traversal_cost;
+		leaf = n <= state.max_leaf_size && ( ( obj_axis < 0 && spatial_axis < 0 ) || split_cost >= float(n) );
+	}
+
+	if( leaf ){
+		bvh.nodes[idx].offset = bvh.prim_indices.size();
+		bvh.nodes[idx].n_prims = n;
+		for( int i=0; i<n; ++i ){ bvh.prim_indices.push_back( refs[i].prim ); }
+		std::vector< SBVHRef >().swap( refs );
+		return idx;
+	}
+
+	std::vector< SBVHRef > left_refs, right_refs;
+	if( spatial_axis >= 0 && spatial_cost < obj_cost ){
+
+		const int axis = spatial_axis;
+		const float pos = node_aabb.min[axis] + ( node_aabb.max[axis]-node_aabb.min[axis] ) * float(spatial_bin+1) / float(n_bins);
+
+		// References on one side of the plane stay there
+		AABB left, right;
+		std::vector< int > straddling;
+		for( int i=0; i<n; ++i ){
+			if( refs[i].aabb.max[axis] <= pos ){ left_refs.push_back( refs[i] ); left += refs[i].aabb; }
+			else if( refs[i].aabb.min[axis] >= pos ){ right_refs.push_back( refs[i] ); right += refs[i].aabb; }
+			else{ straddling.push_back( i ); }
+		}
+
+		// Straddling references are split, unless moving them to one side is cheaper
+		// (reference unsplitting) or the duplication budget is used up.
+		const float inf = std::numeric_limits<float>::max();
+		for( int i=0; i<straddling.size(); ++i ){
+			const SBVHRef &ref = refs[ straddling[i] ];
+			float n_l = left_refs.size(), n_r = right_refs.size();
+			AABB left_ref = left; left_ref += ref.aabb;
+			AABB right_ref = right; right_ref += ref.aabb;
+			float cost_l = left_ref.surface_area()*(n_l+1.f) + right.surface_area()*n_r;
+			float cost_r = left.surface_area()*n_l + right_ref.surface_area()*(n_r+1.f);
+			float cost_split = inf;
+			AABB clip_l, clip_r;
+			if( state.budget > 0 ){
+				clip_l = clip_ref( state, ref, axis, -inf, pos );
+				clip_r = clip_ref( state, ref, axis, pos, inf );
+				AABB left_split = left; left_split += clip_l;
+				AABB right_split = right; right_split += clip_r;
+				cost_split = left_split.surface_area()*(n_l+1.f) + right_split.surface_area()*(n_r+1.f);
+			}
+
+			if( cost_split < cost_l && cost_split < cost_r ){
+				SBVHRef l = ref; l.aabb = clip_l;
+				SBVHRef r = ref; r.aabb = clip_r;
+				left_refs.push_back( l ); left += clip_l;
+				right_refs.push_back( r ); right += clip_r;
+				state.budget--;
+			}
+			else if( cost_l <= cost_r ){ left_refs.push_back( ref ); left = left_ref; }
+			else{ right_refs.push_back( ref ); right = right_ref; }
+		}
+
+		// Unsplitting can empty a side, then use the object split instead
+		if( left_refs.size()==0 || right_refs.size()==0 ){
+			state.budget += left_refs.size() + right_refs.size() - n;
+			left_refs.clear(); right_refs.clear();
+		}
+	}
+
+	if( left_refs.size()==0 ){
+		int mid = n/2;
+		if( obj_axis >= 0 ){
+			float scale = float(n_bins) / ( cent_aabb.max[obj_axis] - cent_aabb.min[obj_axis] );
+			float cmin = cent_aabb.min[obj_axis];
+			SBVHRef *split = std::partition( &refs[0], &refs[0]+n, [&]( const SBVHRef &ref ){
+				return std::min( n_bins-1, int( (ref.aabb.center()[obj_axis]-cmin)*scale ) ) <= obj_bin;
+			});
+			mid = split - &refs[0];
+		}
+		if( mid == 0 || mid == n ){ mid = n/2; }
+		left_refs.assign( refs.begin(), refs.begin()+mid );
+		right_refs.assign( refs.begin()+mid, refs.end() );
+	}
+
+	// Free this level's references before going deeper
+	std::vector< SBVHRef >().swap( refs );
+	sbvh_split( bvh, state, left_refs, depth+1 );
+	int right = sbvh_split( bvh, state, right_refs, depth+1 );
+	bvh.nodes[idx].offset = right;
+	bvh.nodes[idx].n_prims = 0;
+	return idx;
+
+} // end sbvh split
+
+
+//
+//	Refit
+//
+
+
+void BVHBuilder::refit( FlatBVH &bvh ){
+	if( bvh.nodes.size()==0 ){ return; }
+	#pragma omp parallel
+	{
+		#pragma omp single
+		refit_node( bvh, 0 );
+	}
+} // end refit
+
+
+AABB BVHBuilder::refit_node( FlatBVH &bvh, const int node ){
+
+	FlatNode &curr = bvh.nodes[node];
+	AABB aabb;
+
+	if( curr.is_leaf() ){
+		for( int i=0; i<curr.n_prims; ++i ){
+			trimesh::vec bmin, bmax; bvh.prim_aabb( bvh.prim_indices[ curr.offset+i ], bmin, bmax );
+			aabb += bmin; aabb += bmax;
+		}
+	}
+
+	// Children are always after their parent in the array, and the
+	// left subtree is every node between the parent and the right child.
+	else {
+		AABB left;
+		if( curr.offset-node-1 > task_size ){
+			#pragma omp task shared( bvh, left )
+			left = refit_node( bvh, node+1 );
+		}
+		else { left = refit_node( bvh, node+1 ); }
+		aabb = refit_node( bvh, curr.offset );
+		#pragma omp taskwait
+		aabb += left;
+	}
+
+	curr.bmin = aabb.min;
+	curr.bmax = aabb.max;
+	return aabb;
+
+} // end refit node
+
+
+//
+//	Treelet restructuring (Karras & Aila 2013)
+//
+
+
+BVHStats BVHBuilder::optimize_treelets( FlatBVH &bvh, int iterations, int max_leaf_size, float traversal_cost ){
+
+	BVHStats stats;
+	std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	const int n_nodes = bvh.nodes.size();
+	if( n_nodes < 3 ){ bvh.get_stats( stats, traversal_cost ); return stats; }
+
+	TreeletTree tree;
+	tree.max_leaf_size = max_leaf_size;
+	tree.traversal_cost = traversal_cost;
+	tree.left.resize( n_nodes );
+	tree.right.resize( n_nodes );
+	tree.n_prims.resize( n_nodes );
+	tree.aabbs.resize( n_nodes );
+	tree.costs.resize( n_nodes );
+	tree.collapsed.resize( n_nodes, 0 );
+
+	// Children are after their parent, so going backwards fills in counts and costs bottom up
+	for( int i=n_nodes-1; i>=0; --i ){
+		const FlatNode &node = bvh.nodes[i];
+		tree.aabbs[i] = node.bounds();
+		const float area = tree.aabbs[i].surface_area();
+		if( node.is_leaf() ){
+			tree.left[i] = -1; tree.right[i] = -1;
+			tree.n_prims[i] = node.n_prims;
+			tree.costs[i] = area * node.n_prims;
+		}
+		else {
+			tree.left[i] = i+1; tree.right[i] = node.offset;
+			tree.n_prims[i] = tree.n_prims[i+1] + tree.n_prims[node.offset];
+			tree.costs[i] = traversal_cost*area + tree.costs[i+1] + tree.costs[node.offset];
+		}
+	}
+
+	for( int i=0; i<iterations; ++i ){
+		#pragma omp parallel
+		{
+			#pragma omp single
+			optimize_subtree( tree, 0, treelet_size << i );
+		}
+	}
+
+	// Write the new topology depth first
+	FlatBVH result;
+	result.nodes.reserve( n_nodes );
+	result.prim_indices.reserve( bvh.prim_indices.size() );
+	emit_treelets( bvh, tree, result, 0 );
+	bvh.nodes.swap( result.nodes );
+	bvh.prim_indices.swap( result.prim_indices );
+	stats.add_timing( "treelets", start );
+
+	bvh.get_stats( stats, traversal_cost );
+	return stats;
+
+} // end optimize treelets
+
+
+void BVHBuilder::optimize_subtree( TreeletTree &tree, const int node, const int min_prims ){
+
+	if( tree.left[node] < 0 || tree.collapsed[node] || tree.n_prims[node] < min_prims ){ return; }
+
+	// Children are finished before their parent forms a treelet over them
+	const int left = tree.left[node], right = tree.right[node];
+	if( tree.n_prims[node] > task_size ){
+		#pragma omp task shared( tree )
+		optimize_subtree( tree, left, min_prims );
+		optimize_subtree( tree, right, min_prims );
+		#pragma omp taskwait
+	}
+	else {
+		optimize_subtree( tree, left, min_prims );
+		optimize_subtree( tree, right, min_prims );
+	}
+
+	optimize_treelet( tree, node );
+
+} // end optimize subtree
+
+
+void BVHBuilder::optimize_treelet( TreeletTree &tree, const int node ){
+
+	// Grow the treelet by expanding the leaf with the largest area
+	int leaves[ treelet_size ];
+	int internals[ treelet_size ];
+	int n_leaves = 2, n_internals = 1;
+	leaves[0] = tree.left[node]; leaves[1] = tree.right[node];
+	internals[0] = node;
+
+	while( n_leaves < treelet_size ){
+		int expand = -1;
+		float max_area = -1.f;
+		for( int i=0; i<n_leaves; ++i ){
+			const int idx = leaves[i];
+			if( tree.left[idx] < 0 || tree.collapsed[idx] ){ continue; }
+			float area = tree.aabbs[idx].surface_area();
+			if( area > max_area ){ max_area = area; expand = i; }
+		}
+		if( expand < 0 ){ break; }
+		const int idx = leaves[expand];
+		internals[ n_internals++ ] = idx;
+		leaves[expand] = tree.left[idx];
+		leaves[ n_leaves++ ] = tree.right[idx];
+	}
+	if( n_leaves < 3 ){ return; }
+
+	// Optimal cost of every subset of leaves. Proper subsets of s are smaller
+	// numbers than s, so they are always done by the time s is reached.
+	const int n_subsets = 1 << n_leaves;
+	AABB subset_aabb[ 1 << treelet_size ];
+	float subset_cost[ 1 << treelet_size ];
+	int subset_prims[ 1 << treelet_size ];
+	int subset_split[ 1 << treelet_size ]; // left partition, 0 to make a leaf
+	const float inf = std::numeric_limits<float>::max();
+
+	for( int s=1; s<n_subsets; ++s ){
+
+		// Single leaf of the treelet, keeps its subtree
+		const int rest = s & (s-1);
+		if( rest == 0 ){
+			int i = 0; while( !( s & (1<<i) ) ){ ++i; }
+			subset_aabb[s] = tree.aabbs[ leaves[i] ];
+			subset_prims[s] = tree.n_prims[ leaves[i] ];
+			subset_cost[s] = tree.costs[ leaves[i] ];
+			subset_split[s] = -1;
+			continue;
+		}
+		subset_aabb[s] = subset_aabb[ rest ]; subset_aabb[s] += subset_aabb[ s^rest ];
+		subset_prims[s] = subset_prims[ rest ] + subset_prims[ s^rest ];
+
+		// Try every partition, skipping mirrored ones by keeping the lowest bit on the right
+		float best = inf;
+		int best_split = 0;
+		const int delta = ( s-1 ) & s;
+		int p = ( -delta ) & s;
+		while( p != 0 ){
+			float cost = subset_cost[p] + subset_cost[ s^p ];
+			if( cost < best ){ best = cost; best_split = p; }
+			p = ( p-delta ) & s;
+		}
+
+		const float area = subset_aabb[s].surface_area();
+		subset_cost[s] = tree.traversal_cost*area + best;
+		subset_split[s] = best_split;
+		if( subset_prims[s] <= tree.max_leaf_size ){
+			float leaf_cost = area * subset_prims[s];
+			if( leaf_cost < subset_cost[s] ){ subset_cost[s] = leaf_cost; subset_split[s] = 0; }
+		}
+	}
+
+	const int full = n_subsets-1;
+	if( !( subset_cost[full] < tree.costs[node] ) ){ return; }
+
+	// Rebuild the treelet top down, reusing its internal nodes with the root staying in place.
+	// Collapsed nodes keep a subtree so that their primitives can be gathered when flattening.
+	int stack_sets[ treelet_size ], stack_nodes[ treelet_size ];
+	stack_sets[0] = full; stack_nodes[0] = node;
+	int n_stack = 1;
+	while( n_stack > 0 ){
+		--n_stack;
+		const int s = stack_sets[ n_stack ], idx = stack_nodes[ n_stack ];
+
+		int left_set = subset_split[s];
+		tree.collapsed[idx] = ( left_set == 0 );
+		if( left_set == 0 ){ left_set = s & ( -s ); } // any partition works under a leaf
+		const int sets[2] = { left_set, s^left_set };
+		int children[2];
+		for( int i=0; i<2; ++i ){
+			if( subset_split[ sets[i] ] < 0 ){
+				int j = 0; while( !( sets[i] & (1<<j) ) ){ ++j; }
+				children[i] = leaves[j];
+			}
+			else {
+				children[i] = internals[ --n_internals ];
+				stack_sets[ n_stack ] = sets[i]; stack_nodes[ n_stack ] = children[i];
+				++n_stack;
+			}
+		}
+		tree.left[idx] = children[0];
+		tree.right[idx] = children[1];
+		tree.aabbs[idx] = subset_aabb[s];
+		tree.costs[idx] = subset_cost[s];
+		tree.n_prims[idx] = subset_prims[s];
+	}
+
+} // end optimize treelet
+
+
+int BVHBuilder::emit_treelets( const FlatBVH &old_bvh, const TreeletTree &tree, FlatBVH &bvh, const int node ){
+
+	const int idx = bvh.nodes.size();
+	bvh.nodes.push_back( FlatNode() );
+	bvh.nodes[idx].bmin = tree.aabbs[node].min;
+	bvh.nodes[idx].bmax = tree.aabbs[node].max;
+
+	if( tree.left[node] < 0 || tree.collapsed[node] ){
+		bvh.nodes[idx].offset = bvh.prim_indices.size();
+		gather_prims( old_bvh, tree, bvh, node );
+		bvh.nodes[idx].n_prims = bvh.prim_indices.size() - bvh.nodes[idx].offset;
+	}
+	else {
+		emit_treelets( old_bvh, tree, bvh, tree.left[node] );
+		int right = emit_treelets( old_bvh, tree, bvh, tree.right[node] );
+		bvh.nodes[idx].offset = right;
+		bvh.nodes[idx].n_prims = 0;
+	}
+	return idx;
+
+} // end emit treelets
+
+
+void BVHBuilder::gather_prims( const FlatBVH &old_bvh, const TreeletTree &tree, FlatBVH &bvh, const int node ){
+	if( tree.left[node] < 0 ){
+		const FlatNode &leaf = old_bvh.nodes[node];
+		for( int i=0; i<leaf.n_prims; ++i ){ bvh.prim_indices.push_back( old_bvh.prim_indices[ leaf.offset+i ] ); }
+		return;
+	}
+	gather_prims( old_bvh, tree, bvh, tree.left[node] );
+	gather_prims( old_bvh, tree, bvh, tree.right[node] );
+}
+
+
+//
+//	Dynamic BVH
+//
+
+
+void DynamicBVH::get_edges( std::vector<trimesh::vec> &edges, int node ) const {
+	if( node < 0 ){ node = root; }
+	if( node < 0 ){ return; }
+	AABB aabb = nodes[node].aabb;
+	aabb.get_edges( edges );
+	if( !nodes[node].is_leaf() ){
+		get_edges( edges, nodes[node].left );
+		get_edges( edges, nodes[node].right );
+	}
+}
+
+
+double DynamicBVH::sah_cost( float traversal_cost ) const {
+	if( root < 0 ){ return 0.0; }
+	double root_area = nodes[root].aabb.surface_area();
+	if( root_area <= 0.0 ){ return double( size() ); }
+
+	// Walk the tree since the pool also holds free nodes
+	double cost = 0.0;
+	std::vector<int> stack( 1, root );
+	while( stack.size() ){
+		const DynamicNode &node = nodes[ stack.back() ]; stack.pop_back();
+		double area = node.aabb.surface_area() / root_area;
+		if( node.is_leaf() ){ cost += area; }
+		else {
+			cost += area * double( traversal_cost );
+			stack.push_back( node.left );
+			stack.push_back( node.right );
+		}
+	}
+	return cost;
+}
+
+
+int DynamicBVH::alloc_node(){
+	if( free_nodes.size() ){
+		int node = free_nodes.back();
+		free_nodes.pop_back();
+		return node;
+	}
+	nodes.push_back( DynamicNode() );
+	return nodes.size()-1;
+}
+
+
+int DynamicBVH::insert( std::shared_ptr<BaseObject> prim ){
+
+	int handle = -1;
+	if( free_prims.size() ){
+		handle = free_prims.back();
+		free_prims.pop_back();
+		prims[handle] = prim;
+	}
+	else {
+		handle = prims.size();
+		prims.push_back( prim );
+		prim_leaf.push_back( -1 );
+	}
+
+	trimesh::vec bmin, bmax; prim->get_aabb( bmin, bmax );
+	AABB aabb; aabb += bmin; aabb += bmax;
+
+	int leaf = alloc_node();
+	nodes[leaf].aabb = aabb;
+	nodes[leaf].parent = -1;
+	nodes[leaf].left = -1; nodes[leaf].right = -1;
+	nodes[leaf].prim = handle;
+	prim_leaf[handle] = leaf;
+
+	if( root < 0 ){
+		root = leaf;
+		return handle;
+	}
+
+	// Make a new parent for the sibling and the leaf
+	int sibling = find_sibling( aabb );
+	int old_parent = nodes[sibling].parent;
+	int parent = alloc_node();
+	nodes[parent].aabb = nodes[sibling].aabb; nodes[parent].aabb += aabb;
+	nodes[parent].parent = old_parent;
+	nodes[parent].left = sibling; nodes[parent].right = leaf;
+	nodes[parent].prim = -1;
+	nodes[sibling].parent = parent;
+	nodes[leaf].parent = parent;
+
+	if( old_parent < 0 ){ root = parent; }
+	else if( nodes[old_parent].left == sibling ){ nodes[old_parent].left = parent; }
+	else { nodes[old_parent].right = parent; }
+
+	refit_up( old_parent );
+	return handle;
+
+} // end insert
+
+
+void DynamicBVH::remove( int handle ){
+
+	if( handle < 0 || handle >= prims.size() || prims[handle]==NULL ){ return; }
+	int leaf = prim_leaf[handle];
+	prims[handle].reset();
+	prim_leaf[handle] = -1;
+	free_prims.push_back( handle );
+	free_nodes.push_back( leaf );
+
+	if( leaf == root ){
+		root = -1;
+		return;
+	}
+
+	// Collapse the parent into the sibling
+	int parent = nodes[leaf].parent;
+	int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+	int grandparent = nodes[parent].parent;
+	free_nodes.push_back( parent );
+	nodes[sibling].parent = grandparent;
+
+	if( grandparent < 0 ){
+		root = sibling;
+		return;
+	}
+	if( nodes[grandparent].left == parent ){ nodes[grandparent].left = sibling; }
+	else { nodes[grandparent].right = sibling; }
+	refit_up( grandparent );
+
+} // end remove
+
+
+int DynamicBVH::find_sibling( const AABB &aabb ) const {
+
+	// Cost of a sibling is the area of the new parent plus the area added to all of its ancestors.
+	// The ancestor term (inherited) only grows going down, which gives the lower bound for a subtree.
+	const float leaf_area = aabb.surface_area();
+	int best = root;
+	AABB merged = nodes[root].aabb; merged += aabb;
+	float best_cost = merged.surface_area();
+
+	typedef std::pair< float, int > Candidate; // inherited cost, node
+	std::priority_queue< Candidate, std::vector<Candidate>, std::greater<Candidate> > queue;
+	queue.push( Candidate( 0.f, root ) );
+
+	while( queue.size() ){
+		Candidate c = queue.top(); queue.pop();
+		const DynamicNode &node = nodes[ c.second ];
+		AABB merged = node.aabb; merged += aabb;
+		float merged_area = merged.surface_area();
+		float cost = merged_area + c.first;
+		if( cost < best_cost ){
+			best_cost = cost;
+			best = c.second;
+		}
+		if( node.is_leaf() ){ continue; }
+
+		float inherited = c.first + merged_area - node.aabb.surface_area();
+		if( leaf_area + inherited < best_cost ){
+			queue.push( Candidate( inherited, node.left ) );
+			queue.push( Candidate( inherited, node.right ) );
+		}
+	}
+
+	return best;
+
+} // end find sibling
+
+
+void DynamicBVH::refit_up( int node ){
+	while( node >= 0 ){
+		DynamicNode &curr = nodes[node];
+		curr.aabb = nodes[ curr.left ].aabb;
+		curr.aabb += nodes[ curr.right ].aabb;
+		rotate( node );
+		node = curr.parent;
+	}
+}
+
+
+void DynamicBVH::rotate( int node ){
+
+	// Tries swapping a child with one of the other child's children (Kopta et al. 2012),
+	// and keeps the swap that shrinks the surface area of the changed child the most.
+	const int children[2] = { nodes[node].left, nodes[node].right };
+	int best_child = -1, best_grandchild = -1;
+	float best_diff = 0.f;
+
+	for( int i=0; i<2; ++i ){
+		const int child = children[i];
+		const int other = children[1-i];
+		if( nodes[other].is_leaf() ){ continue; }
+
+		const int grandchildren[2] = { nodes[other].left, nodes[other].right };
+		const float other_area = nodes[other].aabb.surface_area();
+		for( int j=0; j<2; ++j ){
+			// child moves under other, next to the grandchild that stays
+			AABB swapped = nodes[ child ].aabb; swapped += nodes[ grandchildren[1-j] ].aabb;
+			float diff = swapped.surface_area() - other_area;
+			if( diff < best_diff ){
+				best_diff = diff;
+				best_child = child;
+				best_grandchild = grandchildren[j];
+			}
+		}
+	}
+
+	if( best_child < 0 ){ return; }
+
+	const int other = nodes[best_grandchild].parent;
+	DynamicNode &curr = nodes[node];
+	if( curr.left == best_child ){ curr.left = best_grandchild; }
+	else { curr.right = best_grandchild; }
+	if( nodes[other].left == best_grandchild ){ nodes[other].left = best_child; }
+	else { nodes[other].right = best_child; }
+	nodes[best_grandchild].parent = node;
+	nodes[best_child].parent = other;
+
+	nodes[other].aabb = nodes[ nodes[other].left ].aabb;
+	nodes[other].aabb += nodes[ nodes[other].right ].aabb;
+
+} // end rotate
+
+
+//
+//	Wide BVH
+//
+
+
+template< int N > int BVHBuilder::make_tree_wide( const FlatBVH &bvh, WideBVH<N> &wide ){
+
+	wide.clear();
+	if( bvh.nodes.size()==0 ){ return 0; }
+	static_cast< BVHPrimitives& >( wide ) = bvh;
+	wide.prim_indices = bvh.prim_indices;
+	wide.nodes.reserve( bvh.nodes.size() / (N-1) + 1 );
+	collapse_wide( bvh, wide, 0 );
+
+	return wide.nodes.size();
+
+} // end make tree wide
+
+
+template< int N > int BVHBuilder::collapse_wide( const FlatBVH &bvh, WideBVH<N> &wide, const int node ){
+
+	// Replace the interior child with the largest area by its children until there are N
+	int children[N];
+	int n_children = 0;
+	if( bvh.nodes[node].is_leaf() ){ children[ n_children++ ] = node; }
+	else {
+		children[ n_children++ ] = node+1;
+		children[ n_children++ ] = bvh.nodes[node].offset;
+	}
+	while( n_children < N ){
+		int expand = -1;
+		float max_area = -1.f;
+		for( int i=0; i<n_children; ++i ){
+			if( bvh.nodes[ children[i] ].is_leaf() ){ continue; }
+			float area = bvh.nodes[ children[i] ].bounds().surface_area();
+			if( area > max_area ){ max_area = area; expand = i; }
+		}
+		if( expand < 0 ){ break; }
+		const int c = children[expand];
+		children[expand] = c+1;
+		children[ n_children++ ] = bvh.nodes[c].offset;
+	}
+
+	const int idx = wide.nodes.size();
+	wide.nodes.push_back( WideNode<N>() );
+	const float inf = std::numeric_limits<float>::infinity();
+	for( int i=0; i<N; ++i ){
+
+		if( i >= n_children ){
+			WideNode<N> &wnode = wide.nodes[idx];
+			for( int j=0; j<3; ++j ){ wnode.bmin[j][i] = inf; wnode.bmax[j][i] = -inf; }
+			wnode.child[i] = -1;
+			wnode.n_prims[i] = -1;
+			continue;
+		}
+
+		const FlatNode &child = bvh.nodes[ children[i] ];
+		int child_idx = child.offset;
+		if( !child.is_leaf() ){ child_idx = collapse_wide( bvh, wide, children[i] ); }
+
+		// Recursion may have moved the nodes array
+		WideNode<N> &wnode = wide.nodes[idx];
+		for( int j=0; j<3; ++j ){ wnode.bmin[j][i] = child.bmin[j]; wnode.bmax[j][i] = child.bmax[j]; }
+		wnode.child[i] = child_idx;
+		wnode.n_prims[i] = child.n_prims;
+	}
+	return idx;
+
+} // end collapse wide
+
+template int BVHBuilder::make_tree_wide<4>( const FlatBVH &bvh, WideBVH<4> &wide );
+template int BVHBuilder::make_tree_wide<8>( const FlatBVH &bvh, WideBVH<8> &wide );
+
+
+template< int N, typename T > int BVHBuilder::make_tree_quantized( const WideBVH<N> &wide, QuantizedBVH<N,T> &qbvh ){
+
+	qbvh.clear();
+	static_cast< BVHPrimitives& >( qbvh ) = wide;
+	qbvh.prim_indices = wide.prim_indices;
+	qbvh.nodes.resize( wide.nodes.size() );
+	const int n_nodes = wide.nodes.size();
+	const float max_q = float( std::numeric_limits<T>::max() );
+
+	#pragma omp parallel for
+	for( int n=0; n<n_nodes; ++n ){
+
+		const WideNode<N> &node = wide.nodes[n];
+		QuantizedNode<N,T> &qnode = qbvh.nodes[n];
+
+		for( int j=0; j<3; ++j ){
+
+			// Grid over the bounds of the used slots
+			float lo = std::numeric_limits<float>::max(), hi = -lo;
+			for( int i=0; i<N; ++i ){
+				if( node.child[i] < 0 ){ continue; }
+				lo = std::min( lo, node.bmin[j][i] );
+				hi = std::max( hi, node.bmax[j][i] );
+			}
+			float scale = hi > lo ? ( hi - lo ) / max_q : 1.f;
+			while( lo + max_q*scale < hi ){ scale = std::nextafter( scale, std::numeric_limits<float>::max() ); }
+			qnode.origin[j] = lo;
+			qnode.scale[j] = scale;
+
+			for( int i=0; i<N; ++i ){
+				if( node.child[i] < 0 ){
+					qnode.qmin[j][i] = T( max_q ); qnode.qmax[j][i] = 0;
+					continue;
+				}
+
+				// Round outward, then step until the decoded value is really outside
+				float qmin = std::max( std::floor( ( node.bmin[j][i] - lo ) / scale ), 0.f );
+				float qmax = std::min( std::ceil( ( node.bmax[j][i] - lo ) / scale ), max_q );
+				while( qmin > 0.f && lo + qmin*scale > node.bmin[j][i] ){ qmin -= 1.f; }
+				while( qmax < max_q && lo + qmax*scale < node.bmax[j][i] ){ qmax += 1.f; }
+				qnode.qmin[j][i] = T( qmin );
+				qnode.qmax[j][i] = T( qmax );
+			}
+		}
+
+		for( int i=0; i<N; ++i ){
+			assert( node.n_prims[i] < 65536 );
+			qnode.child[i] = node.child[i];
+			qnode.n_prims[i] = std::max( node.n_prims[i], 0 );
+		}
+	}
+
+	return qbvh.nodes.size();
+
+} // end make tree quantized
+
+template int BVHBuilder::make_tree_quantized<4,unsigned char>( const WideBVH<4> &wide, QuantizedBVH<4,unsigned char> &qbvh );
+template int BVHBuilder::make_tree_quantized<8,unsigned char>( const WideBVH<8> &wide, QuantizedBVH<8,unsigned char> &qbvh );
+template int BVHBuilder::make_tree_quantized<4,unsigned short>( const WideBVH<4> &wide, QuantizedBVH<4,unsigned short> &qbvh );
+template int BVHBuilder::make_tree_quantized<8,unsigned short>( const WideBVH<8> &wide, QuantizedBVH<8,unsigned short> &qbvh );
+
+
+// Ray with the inverse direction and which slab is hit first on each axis
+struct WideRay {
+	float origin[3];
+	float inv_dir[3];
+	int sign[3]; // 1 if the direction is negative, so the ray enters through bmax
+};
+
+// Stack of the wide traversal, with room for N-1 children at each level. A tree deeper
+// than that goes on in a new traversal of the subtree when the stack is full.
+static const int wide_stack_size = 1024;
+
+
+// Returns a bit mask of the children hit within [t_min,t_max] and their entry distances.
+// A NaN distance (the ray lies on a slab) is ignored by keeping the current interval.
+template< int N > struct SlabScalar {
+	inline int operator()( const WideNode<N> &node, const WideRay &ray, const float t_min, const float t_max, float *t_near ) const {
+		int mask = 0;
+		for( int i=0; i<N; ++i ){
+			float t0 = t_min, t1 = t_max;
+			for( int j=0; j<3; ++j ){
+				const float near = ray.sign[j] ? node.bmax[j][i] : node.bmin[j][i];
+				const float far = ray.sign[j] ? node.bmin[j][i] : node.bmax[j][i];
+				t0 = std::max( t0, ( near - ray.origin[j] ) * ray.inv_dir[j] );
+				t1 = std::min( t1, ( far - ray.origin[j] ) * ray.inv_dir[j] );
+			}
+			if( t0 <= t1 ){ mask |= ( 1 << i ); t_near[i] = t0; }
+		}
+		return mask;
+	}
+};
+
+
+#if defined(__SSE2__)
+#define MCL_HAVE_SSE 1
+#include <immintrin.h>
+
+// Four children at once. max/min return the second operand if either is NaN,
+// so the current interval goes second to ignore NaN distances.
+static inline int slab_test_sse( const float * const near[3], const float * const far[3], const WideRay &ray,
+	const float t_min, const float t_max, float *t_near ){
+	__m128 t0 = _mm_set1_ps( t_min );
+	__m128 t1 = _mm_set1_ps( t_max );
+	for( int j=0; j<3; ++j ){
+		const __m128 origin = _mm_set1_ps( ray.origin[j] );
+		const __m128 inv_dir = _mm_set1_ps( ray.inv_dir[j] );
+		t0 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( near[j] ), origin ), inv_dir ), t0 );
+		t1 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( far[j] ), origin ), inv_dir ), t1 );
+	}
+	_mm_storeu_ps( t_near, t0 );
+	return _mm_movemask_ps( _mm_cmple_ps( t0, t1 ) );
+}
+
+template< int N > struct SlabSSE {
+	inline int operator()( const WideNode<N> &node, const WideRay &ray, const float t_min, const float t_max, float *t_near ) const {
+		int mask = 0;
+		for( int i=0; i<N; i+=4 ){
+			const float *near[3], *far[3];
+			for( int j=0; j<3; ++j ){
+				near[j] = ( ray.sign[j] ? node.bmax[j] : node.bmin[j] ) + i;
+				far[j] = ( ray.sign[j] ? node.bmin[j] : node.bmax[j] ) + i;
+			}
+			mask |= slab_test_sse( near, far, ray, t_min, t_max, t_near+i ) << i;
+		}
+		return mask;
+	}
+};
+
+
+// Loads four quantized values as floats
+static inline __m128 load_quantized( const unsigned char *q ){
+	int bytes; std::memcpy( &bytes, q, sizeof(int) );
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_unpacklo_epi8( _mm_cvtsi32_si128( bytes ), zero );
+	return _mm_cvtepi32_ps( _mm_unpacklo_epi16( v, zero ) );
+}
+
+static inline __m128 load_quantized( const unsigned short *q ){
+	__m128i v = _mm_loadl_epi64( reinterpret_cast<const __m128i*>( q ) );
+	return _mm_cvtepi32_ps( _mm_unpacklo_epi16( v, _mm_setzero_si128() ) );
+}
+
+// Decodes four children at a time of a quantized node and tests them like slab_test_sse.
+// Planes are decoded the same way they were rounded, so they stay conservative.
+template< typename T > struct SlabQuantizedSSE {
+	template< int N > inline int operator()( const QuantizedNode<N,T> &node, const WideRay &ray, const float t_min, const float t_max, float *t_near ) const {
+		int mask = 0;
+		for( int i=0; i<N; i+=4 ){
+			__m128 t0 = _mm_set1_ps( t_min );
+			__m128 t1 = _mm_set1_ps( t_max );
+			for( int j=0; j<3; ++j ){
+				const __m128 scale = _mm_set1_ps( node.scale[j] );
+				const __m128 node_origin = _mm_set1_ps( node.origin[j] );
+				const __m128 origin = _mm_set1_ps( ray.origin[j] );
+				const __m128 inv_dir = _mm_set1_ps( ray.inv_dir[j] );
+				const T *near = ( ray.sign[j] ? node.qmax[j] : node.qmin[j] ) + i;
+				const T *far = ( ray.sign[j] ? node.qmin[j] : node.qmax[j] ) + i;
+				const __m128 near_plane = _mm_add_ps( node_origin, _mm_mul_ps( load_quantized( near ), scale ) );
+				const __m128 far_plane = _mm_add_ps( node_origin, _mm_mul_ps( load_quantized( far ), scale ) );
+				t0 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( near_plane, origin ), inv_dir ), t0 );
+				t1 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( far_plane, origin ), inv_dir ), t1 );
+			}
+			_mm_storeu_ps( t_near+i, t0 );
+			mask |= _mm_movemask_ps( _mm_cmple_ps( t0, t1 ) ) << i;
+		}
+		return mask;
+	}
+};
+#endif
+
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define MCL_HAVE_AVX 1
+
+// Compiled for AVX on its own, only called if the cpu supports it
+__attribute__((target("avx")))
+static int slab_test_avx( const WideNode<8> &node, const WideRay &ray, const float t_min, const float t_max, float *t_near ){
+	__m256 t0 = _mm256_set1_ps( t_min );
+	__m256 t1 = _mm256_set1_ps( t_max );
+	for( int j=0; j<3; ++j ){
+		const __m256 origin = _mm256_set1_ps( ray.origin[j] );
+		const __m256 inv_dir = _mm256_set1_ps( ray.inv_dir[j] );
+		const float *near = ray.sign[j] ? node.bmax[j] : node.bmin[j];
+		const float *far = ray.sign[j] ? node.bmin[j] : node.bmax[j];
+		t0 = _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_loadu_ps( near ), origin ), inv_dir ), t0 );
+		t1 = _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_loadu_ps( far ), origin ), inv_dir ), t1 );
+	}
+	_mm256_storeu_ps( t_near, t0 );
+	return _mm256_movemask_ps( _mm256_cmp_ps( t0, t1, _CMP_LE_OQ ) );
+}
+
+struct SlabAVX {
+	inline int operator()( const WideNode<8> &node, const WideRay &ray, const float t_min, const float t_max, float *t_near ) const {
+		return slab_test_avx( node, ray, t_min, t_max, t_near );
+	}
+};
+#endif
+
+
+// Decodes the bounds of a quantized node for one of the slab tests above
+template< int N, typename T, typename SlabTest > struct SlabQuantized {
+	SlabTest slab_test;
+	inline int operator()( const QuantizedNode<N,T> &qnode, const WideRay &ray, const float t_min, const float t_max, float *t_near ) const {
+		WideNode<N> node;
+		for( int j=0; j<3; ++j ){
+			for( int i=0; i<N; ++i ){
+				node.bmin[j][i] = qnode.origin[j] + float( qnode.qmin[j][i] ) * qnode.scale[j];
+				node.bmax[j][i] = qnode.origin[j] + float( qnode.qmax[j][i] ) * qnode.scale[j];
+			}
+		}
+		return slab_test( node, ray, t_min, t_max, t_near );
+	}
+};
+
+
+// Works on any tree with nodes that have child and n_prims arrays, like WideNode
+template< int N, typename Tree, typename SlabTest >
+static inline bool wide_ray_intersect( const Tree &bvh, intersect::Ray &ray, intersect::Payload &payload, const SlabTest &slab_test, const int root=0 ){
+
+	if( bvh.nodes.size()==0 ){ return false; }
+
+	WideRay wray;
+	for( int j=0; j<3; ++j ){
+		wray.origin[j] = ray.origin[j];
+		wray.inv_dir[j] = 1.f / ray.direction[j];
+		wray.sign[j] = ( wray.inv_dir[j] < 0.f );
+	}
+
+	// Nodes with their entry distance, the nearest child is on top
+	int stack_node[ wide_stack_size ];
+	float stack_t[ wide_stack_size ];
+	stack_node[0] = root; stack_t[0] = payload.t_min;
+	int n_stack = 1;
+	bool hit = false;
+
+	while( n_stack > 0 ){
+
+		--n_stack;
+		if( stack_t[n_stack] > payload.t_max ){ continue; }
+		if( n_stack+N > wide_stack_size ){
+			if( wide_ray_intersect<N>( bvh, ray, payload, slab_test, stack_node[n_stack] ) ){ hit = true; }
+			continue;
+		}
+		const typename Tree::Node &node = bvh.nodes[ stack_node[n_stack] ];
+
+		float t_near[N];
+		int mask = slab_test( node, wray, float(payload.t_min), float(payload.t_max), t_near );
+
+		// Leaves are checked right away, interior children are pushed far to near
+		int order[N];
+		int n_order = 0;
+		for( int i=0; i<N; ++i ){
+			if( !( mask & ( 1 << i ) ) || node.child[i] < 0 ){ continue; }
+			if( node.n_prims[i] > 0 ){
+				for( int k=0; k<node.n_prims[i]; ++k ){
+					int prim = bvh.prim_indices[ node.child[i]+k ];
+					if( bvh.prim_ray_intersect( prim, ray, payload ) ){ hit = true; }
+				}
+				continue;
+			}
+			int k = n_order++;
+			while( k > 0 && t_near[ order[k-1] ] < t_near[i] ){ order[k] = order[k-1]; --k; }
+			order[k] = i;
+		}
+
+		for( int k=0; k<n_order; ++k ){
+			stack_node[n_stack] = node.child[ order[k] ];
+			stack_t[n_stack] = t_near[ order[k] ];
+			++n_stack;
+		}
+	}
+
+	return hit;
+
+} // end wide ray intersect
+
+
+bool BVHTraversal::has_avx(){
+#ifdef MCL_HAVE_AVX
+	static const bool avx = __builtin_cpu_supports( "avx" );
+	return avx;
+#else
+	return false;
+#endif
+}
+
+
+bool BVHTraversal::ray_intersect( const BVH4 &bvh, intersect::Ray &ray, intersect::Payload &payload ){
+#ifdef MCL_HAVE_SSE
+	return wide_ray_intersect<4>( bvh, ray, payload, SlabSSE<4>() );
+#else
+	return wide_ray_intersect<4>( bvh, ray, payload, SlabScalar<4>() );
+#endif
+}
+
+
+bool BVHTraversal::ray_intersect( const BVH8 &bvh, intersect::Ray &ray, intersect::Payload &payload ){
+#ifdef MCL_HAVE_AVX
+	if( has_avx() ){ return wide_ray_intersect<8>( bvh, ray, payload, SlabAVX() ); }
+#endif
+#ifdef MCL_HAVE_SSE
+	return wide_ray_intersect<8>( bvh, ray, payload, SlabSSE<8>() );
+#else
+	return wide_ray_intersect<8>( bvh, ray, payload, SlabScalar<8>() );
+#endif
+}
+
+
+template< int N, typename T > bool BVHTraversal::ray_intersect( const QuantizedBVH<N,T> &bvh, intersect::Ray &ray, intersect::Payload &payload ){
+#ifdef MCL_HAVE_SSE
+	return wide_ray_intersect<N>( bvh, ray, payload, SlabQuantizedSSE<T>() );
+#else
+	return wide_ray_intersect<N>( bvh, ray, payload, SlabQuantized< N, T, SlabScalar<N> >() );
+#endif
+}
+
+template bool BVHTraversal::ray_intersect<4,unsigned char>( const QuantizedBVH<4,unsigned char> &bvh, intersect::Ray &ray, intersect::Payload &payload );
+template bool BVHTraversal::ray_intersect<8,unsigned char>( const QuantizedBVH<8,unsigned char> &bvh, intersect::Ray &ray, intersect::Payload &payload );
+template bool BVHTraversal::ray_intersect<4,unsigned short>( const QuantizedBVH<4,unsigned short> &bvh, intersect::Ray &ray, intersect::Payload &payload );
+template bool BVHTraversal::ray_intersect<8,unsigned short>( const QuantizedBVH<8,unsigned short> &bvh, intersect::Ray &ray, intersect::Payload &payload );
+
+
+//
+//	Ray packets
+//
+
+
+// Rays of a packet in SoA layout, with the bounds of their origins and inverse
+// directions for interval arithmetic. Axes that have a zero direction are left out.
+template< int N > struct PacketRays {
+	float origin[3][N], dir[3][N], inv_dir[3][N], t_min[N], t_max[N];
+	int hit_prim[N];
+	char filled[N]; // payload filled by a single ray test (not a packet triangle test)
+	int sign[3];
+	float origin_lo[3], origin_hi[3], inv_lo[3], inv_hi[3];
+	bool interval[3];
+	float t_min_lo, t_max_hi;
+	float avg_dir[3];
+};
+
+
+// Min and max of the product of two intervals
+static inline void interval_mul( const float a_lo, const float a_hi, const float b_lo, const float b_hi, float &lo, float &hi ){
+	const float p0 = a_lo*b_lo, p1 = a_lo*b_hi, p2 = a_hi*b_lo, p3 = a_hi*b_hi;
+	lo = std::min( std::min( p0, p1 ), std::min( p2, p3 ) );
+	hi = std::max( std::max( p0, p1 ), std::max( p2, p3 ) );
+}
+
+
+// True if no ray of the packet can hit the node. The entry and exit distances
+// of every ray are within the interval bounds, so this is conservative.
+template< int N > static inline bool packet_cull( const FlatNode &node, const PacketRays<N> &packet ){
+	float t0 = packet.t_min_lo, t1 = packet.t_max_hi;
+	for( int j=0; j<3; ++j ){
+		if( !packet.interval[j] ){ continue; }
+		const float near = packet.sign[j] ? node.bmax[j] : node.bmin[j];
+		const float far = packet.sign[j] ? node.bmin[j] : node.bmax[j];
+		float lo, hi;
+		interval_mul( near - packet.origin_hi[j], near - packet.origin_lo[j], packet.inv_lo[j], packet.inv_hi[j], lo, hi );
+		t0 = std::max( t0, lo );
+		interval_mul( far - packet.origin_hi[j], far - packet.origin_lo[j], packet.inv_lo[j], packet.inv_hi[j], lo, hi );
+		t1 = std::min( t1, hi );
+	}
+	return t0 > t1;
+}
+
+
+#ifdef MCL_HAVE_SSE
+
+// Slab test of the rays in mask, returns the ones that hit. If the first ray misses,
+// the whole packet is likely to, which is checked with interval arithmetic first.
+template< int N > static inline int packet_slab( const FlatNode &node, const PacketRays<N> &packet, const int mask ){
+	const int first = helper::count_trailing_zeros( mask );
+	const float origin[3] = { packet.origin[0][first], packet.origin[1][first], packet.origin[2][first] };
+	const float inv_dir[3] = { packet.inv_dir[0][first], packet.inv_dir[1][first], packet.inv_dir[2][first] };
+	float t_first;
+	if( !flat_slab( node, origin, inv_dir, packet.sign, packet.t_min[first], packet.t_max[first], t_first ) &&
+		packet_cull( node, packet ) ){ return 0; }
+	int hits = 0;
+	for( int i=0; i<N; i+=4 ){
+		if( ( ( mask >> i ) & 15 ) == 0 ){ continue; }
+		__m128 t0 = _mm_loadu_ps( packet.t_min+i );
+		__m128 t1 = _mm_loadu_ps( packet.t_max+i );
+		for( int j=0; j<3; ++j ){
+			const __m128 near = _mm_set1_ps( packet.sign[j] ? node.bmax[j] : node.bmin[j] );
+			const __m128 far = _mm_set1_ps( packet.sign[j] ? node.bmin[j] : node.bmax[j] );
+			const __m128 origin = _mm_loadu_ps( packet.origin[j]+i );
+			const __m128 inv_dir = _mm_loadu_ps( packet.inv_dir[j]+i );
+			t0 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( near, origin ), inv_dir ), t0 );
+			t1 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( far, origin ), inv_dir ), t1 );
+		}
+		hits |= _mm_movemask_ps( _mm_cmple_ps( t0, t1 ) ) << i;
+	}
+	return hits & mask;
+}
+
+
+// Number of rays in a packet mask
+static inline int packet_active( const int mask ){
+	return std::bitset< 16 >( mask ).count();
+}
+
+
+// Same arithmetic as intersect::ray_triangle for four rays at once, so the
+// hits and distances match the single ray test exactly.
+template< int N > static inline void packet_triangle( const trimesh::vec &p0, const trimesh::vec &p1, const trimesh::vec &p2,
+	const int prim, PacketRays<N> &packet, const int mask ){
+
+	const trimesh::vec e0 = p1 - p0;
+	const trimesh::vec e1 = p0 - p2;
+	const trimesh::vec n = e1.cross( e0 );
+	const __m128 one = _mm_set1_ps( 1.f ), zero = _mm_setzero_ps();
+
+	for( int i=0; i<N; i+=4 ){
+		const int lanes = ( mask >> i ) & 15;
+		if( lanes == 0 ){ continue; }
+		const __m128 d0 = _mm_loadu_ps( packet.dir[0]+i ), d1 = _mm_loadu_ps( packet.dir[1]+i ), d2 = _mm_loadu_ps( packet.dir[2]+i );
+
+		__m128 den = _mm_mul_ps( _mm_set1_ps( n[0] ), d0 );
+		den = _mm_add_ps( den, _mm_mul_ps( _mm_set1_ps( n[1] ), d1 ) );
+		den = _mm_add_ps( den, _mm_mul_ps( _mm_set1_ps( n[2] ), d2 ) );
+		const __m128 inv_den = _mm_div_ps( one, den );
+		const __m128 e2_0 = _mm_mul_ps( inv_den, _mm_sub_ps( _mm_set1_ps( p0[0] ), _mm_loadu_ps( packet.origin[0]+i ) ) );
+		const __m128 e2_1 = _mm_mul_ps( inv_den, _mm_sub_ps( _mm_set1_ps( p0[1] ), _mm_loadu_ps( packet.origin[1]+i ) ) );
+		const __m128 e2_2 = _mm_mul_ps( inv_den, _mm_sub_ps( _mm_set1_ps( p0[2] ), _mm_loadu_ps( packet.origin[2]+i ) ) );
+
+		// i = direction x e2
+		const __m128 i0 = _mm_sub_ps( _mm_mul_ps( d1, e2_2 ), _mm_mul_ps( d2, e2_1 ) );
+		const __m128 i1 = _mm_sub_ps( _mm_mul_ps( d2, e2_0 ), _mm_mul_ps( d0, e2_2 ) );
+		const __m128 i2 = _mm_sub_ps( _mm_mul_ps( d0, e2_1 ), _mm_mul_ps( d1, e2_0 ) );
+
+		__m128 beta = _mm_mul_ps( i0, _mm_set1_ps( e1[0] ) );
+		beta = _mm_add_ps( beta, _mm_mul_ps( i1, _mm_set1_ps( e1[1] ) ) );
+		beta = _mm_add_ps( beta, _mm_mul_ps( i2, _mm_set1_ps( e1[2] ) ) );
+		__m128 gamma = _mm_mul_ps( i0, _mm_set1_ps( e0[0] ) );
+		gamma = _mm_add_ps( gamma, _mm_mul_ps( i1, _mm_set1_ps( e0[1] ) ) );
+		gamma = _mm_add_ps( gamma, _mm_mul_ps( i2, _mm_set1_ps( e0[2] ) ) );
+		__m128 t = _mm_mul_ps( _mm_set1_ps( n[0] ), e2_0 );
+		t = _mm_add_ps( t, _mm_mul_ps( _mm_set1_ps( n[1] ), e2_1 ) );
+		t = _mm_add_ps( t, _mm_mul_ps( _mm_set1_ps( n[2] ), e2_2 ) );
+
+		const __m128 t_max = _mm_loadu_ps( packet.t_max+i );
+		__m128 hit = _mm_and_ps( _mm_cmplt_ps( t, t_max ), _mm_cmpgt_ps( t, _mm_loadu_ps( packet.t_min+i ) ) );
+		hit = _mm_and_ps( hit, _mm_and_ps( _mm_cmpge_ps( beta, zero ), _mm_cmpge_ps( gamma, zero ) ) );
+		hit = _mm_and_ps( hit, _mm_cmple_ps( _mm_add_ps( beta, gamma ), one ) );
+		const int hits = _mm_movemask_ps( hit ) & lanes;
+		if( hits == 0 ){ continue; }
+
+		float ts[4]; _mm_storeu_ps( ts, t );
+		for( int k=0; k<4; ++k ){
+			if( !( hits & ( 1 << k ) ) ){ continue; }
+			packet.t_max[i+k] = ts[k];
+			packet.hit_prim[i+k] = prim;
+			packet.filled[i+k] = 0;
+		}
+	}
+}
+
+#endif
+
+
+template< int N > int BVHTraversal::ray_intersect_packet( const FlatBVH &bvh, intersect::Ray *rays, intersect::Payload *payloads ){
+
+	static_assert( N==4 || N==8 || N==16, "Packets have 4, 8 or 16 rays" );
+	if( bvh.nodes.size()==0 ){ return 0; }
+
+	// Rays are traced one at a time if the directions are not all in the same octant
+	bool coherent = true;
+	for( int j=0; j<3 && coherent; ++j ){
+		const bool negative = ( 1.f / rays[0].direction[j] ) < 0.f;
+		for( int i=1; i<N; ++i ){ if( ( ( 1.f / rays[i].direction[j] ) < 0.f ) != negative ){ coherent = false; } }
+	}
+
+#ifdef MCL_HAVE_SSE
+	if( coherent ){
+
+		PacketRays<N> packet;
+		double t_max[N];
+		packet.t_min_lo = std::numeric_limits<float>::max();
+		packet.t_max_hi = -std::numeric_limits<float>::max();
+		for( int j=0; j<3; ++j ){
+			packet.sign[j] = ( 1.f / rays[0].direction[j] ) < 0.f;
+			packet.interval[j] = true;
+			packet.origin_lo[j] = packet.inv_lo[j] = std::numeric_limits<float>::max();
+			packet.origin_hi[j] = packet.inv_hi[j] = -std::numeric_limits<float>::max();
+			packet.avg_dir[j] = 0.f;
+		}
+		for( int i=0; i<N; ++i ){
+			for( int j=0; j<3; ++j ){
+				packet.origin[j][i] = rays[i].origin[j];
+				packet.dir[j][i] = rays[i].direction[j];
+				packet.inv_dir[j][i] = 1.f / rays[i].direction[j];
+				if( !std::isfinite( packet.inv_dir[j][i] ) ){ packet.interval[j] = false; }
+				packet.origin_lo[j] = std::min( packet.origin_lo[j], packet.origin[j][i] );
+				packet.origin_hi[j] = std::max( packet.origin_hi[j], packet.origin[j][i] );
+				packet.inv_lo[j] = std::min( packet.inv_lo[j], packet.inv_dir[j][i] );
+				packet.inv_hi[j] = std::max( packet.inv_hi[j], packet.inv_dir[j][i] );
+				packet.avg_dir[j] += packet.dir[j][i];
+			}
+			t_max[i] = payloads[i].t_max;
+			packet.t_min[i] = payloads[i].t_min;
+			packet.t_max[i] = payloads[i].t_max;
+			packet.t_min_lo = std::min( packet.t_min_lo, packet.t_min[i] );
+			packet.t_max_hi = std::max( packet.t_max_hi, packet.t_max[i] );
+			packet.hit_prim[i] = -1;
+			packet.filled[i] = 0;
+		}
+
+		// Nodes with the rays that reached them, children are tested when popped
+		const int all = int( ( 1u << N ) - 1u );
+		const int min_rays = std::max( 2, N/4 );
+		int stack_node[ flat_stack_size ];
+		int stack_mask[ flat_stack_size ];
+		stack_node[0] = 0; stack_mask[0] = all;
+		int n_stack = 1;
+
+		while( n_stack > 0 ){
+
+			--n_stack;
+			const int idx = stack_node[n_stack];
+			const FlatNode &node = bvh.nodes[idx];
+			const int mask = packet_slab( node, packet, stack_mask[n_stack] );
+			if( mask == 0 ){ continue; }
+
+			// The packet has diverged if only a few rays reach the node, and the rest of
+			// the subtree is traced one ray at a time instead of with the whole packet.
+			// So is a subtree below the depth the stack can hold.
+			if( packet_active( mask ) < min_rays || n_stack+2 > flat_stack_size ){
+				for( int i=0; i<N; ++i ){
+					if( !( mask & ( 1 << i ) ) ){ continue; }
+					int hit_prim = -1;
+					payloads[i].t_max = packet.t_max[i];
+					if( flat_ray_intersect( bvh, rays[i], payloads[i], hit_prim, idx ) ){
+						packet.t_max[i] = payloads[i].t_max;
+						packet.hit_prim[i] = hit_prim;
+						packet.filled[i] = 1;
+					}
+				}
+				packet.t_max_hi = -std::numeric_limits<float>::max();
+				for( int i=0; i<N; ++i ){ packet.t_max_hi = std::max( packet.t_max_hi, packet.t_max[i] ); }
+				continue;
+			}
+
+			if( node.is_leaf() ){
+				for( int k=0; k<node.n_prims; ++k ){
+					const int prim = bvh.prim_indices[ node.offset+k ];
+					trimesh::vec p0, p1, p2;
+					if( bvh.prim_triangle( prim, p0, p1, p2 ) ){ packet_triangle( p0, p1, p2, prim, packet, mask ); continue; }
+					for( int i=0; i<N; ++i ){
+						if( !( mask & ( 1 << i ) ) ){ continue; }
+						payloads[i].t_max = packet.t_max[i];
+						if( bvh.prim_ray_intersect( prim, rays[i], payloads[i] ) ){
+							packet.t_max[i] = payloads[i].t_max;
+							packet.hit_prim[i] = prim;
+							packet.filled[i] = 1;
+						}
+					}
+				}
+				packet.t_max_hi = -std::numeric_limits<float>::max();
+				for( int i=0; i<N; ++i ){ packet.t_max_hi = std::max( packet.t_max_hi, packet.t_max[i] ); }
+				continue;
+			}
+
+			// The child further along the packet's average direction is pushed first
+			const int left = idx+1, right = node.offset;
+			float d = 0.f;
+			for( int j=0; j<3; ++j ){
+				d += packet.avg_dir[j] * ( ( bvh.nodes[right].bmin[j] + bvh.nodes[right].bmax[j] ) -
+					( bvh.nodes[left].bmin[j] + bvh.nodes[left].bmax[j] ) );
+			}
+			stack_node[n_stack] = d < 0.f ? left : right; stack_mask[n_stack] = mask; ++n_stack;
+			stack_node[n_stack] = d < 0.f ? right : left; stack_mask[n_stack] = mask; ++n_stack;
+		}
+
+		// Triangle hits get their payload from the single ray test, which gives the same distance
+		int hits = 0;
+		for( int i=0; i<N; ++i ){
+			if( packet.hit_prim[i] < 0 ){ payloads[i].t_max = t_max[i]; continue; }
+			if( !packet.filled[i] ){
+				payloads[i].t_max = t_max[i];
+				if( !bvh.prim_ray_intersect( packet.hit_prim[i], rays[i], payloads[i] ) ){ continue; }
+			}
+			hits |= ( 1 << i );
+		}
+		return hits;
+
+	} // end packet traversal
+#endif
+
+	int hits = 0;
+	for( int i=0; i<N; ++i ){
+		if( ray_intersect( bvh, rays[i], payloads[i] ) ){ hits |= ( 1 << i ); }
+	}
+	return hits;
+
+} // end ray intersect packet
+
+template int BVHTraversal::ray_intersect_packet<4>( const FlatBVH &bvh, intersect::Ray *rays, intersect::Payload *payloads );
+template int BVHTraversal::ray_intersect_packet<8>( const FlatBVH &bvh, intersect::Ray *rays, intersect::Payload *payloads );
+template int BVHTraversal::ray_intersect_packet<16>( const FlatBVH &bvh, intersect::Ray *rays, intersect::Payload *payloads );
+
+
+void BVHTraversal::ray_intersect_packets( const FlatBVH &bvh, std::vector< intersect::Ray > &rays,
+	std::vector< intersect::Payload > &payloads, int packet_size ){
+
+	const int n_rays = rays.size();
+	if( payloads.size() != n_rays ){ payloads.assign( n_rays, intersect::Payload() ); }
+	if( packet_size != 4 && packet_size != 16 ){ packet_size = 8; }
+
+	// The rays left over at the end are traced one at a time
+	const int n_packets = n_rays / packet_size;
+	#pragma omp parallel for schedule(dynamic,16)
+	for( int p=0; p<n_packets; ++p ){
+		const int i = p*packet_size;
+		if( packet_size == 4 ){ ray_intersect_packet<4>( bvh, &rays[i], &payloads[i] ); }
+		else if( packet_size == 8 ){ ray_intersect_packet<8>( bvh, &rays[i], &payloads[i] ); }
+		else{ ray_intersect_packet<16>( bvh, &rays[i], &payloads[i] ); }
+	}
+	for( int i=n_packets*packet_size; i<n_rays; ++i ){ ray_intersect( bvh, rays[i], payloads[i] ); }
 
+} // end ray intersect packets
@@ -0,0 +1,198 @@
+// Copyright 2016 Matthew Overby.
+// 
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#include "MCL/BVHCache.hpp"
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#if defined(__unix__) || defined(__APPLE__)
+#define MCL_HAVE_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace mcl;
+
+
+// FNV-1a over 32 bit words instead of bytes, used on blocks of primitive bounds
+// and then on the block hashes. n_bytes must be a multiple of four.
+static inline unsigned long long fnv1a( const void *data, size_t n_bytes, unsigned long long hash=14695981039346656037ull ){
+	const unsigned char *bytes = static_cast<const unsigned char*>( data );
+	for( size_t i=0; i<n_bytes; i+=4 ){
+		unsigned int word; std::memcpy( &word, bytes+i, 4 );
+		hash = ( hash ^ word ) * 1099511628211ull;
+	}
+	return hash;
+}
+
+
+unsigned long long BVHCache::geometry_hash( const BVHPrimitives &prims ){
+
+	// Blocks are hashed in parallel and combined in order, so the result does not depend on the threads
+	const int block_size = 4096;
+	const int n_prims = prims.num_prims();
+	const int n_blocks = ( n_prims + block_size - 1 ) / block_size;
+	std::vector< unsigned long long > block_hashes( n_blocks );
+
+	#pragma omp parallel for
+	for( int b=0; b<n_blocks; ++b ){
+		unsigned long long hash = 14695981039346656037ull;
+		const int end = std::min( n_prims, (b+1)*block_size );
+		for( int i=b*block_size; i<end; ++i ){
+			trimesh::vec bmin, bmax; prims.prim_aabb( i, bmin, bmax );
+			float bounds[6] = { bmin[0], bmin[1], bmin[2], bmax[0], bmax[1], bmax[2] };
+			hash = fnv1a( bounds, sizeof(bounds), hash );
+			trimesh::vec p[3];
+			if( prims.prim_triangle( i, p[0], p[1], p[2] ) ){ hash = fnv1a( p, sizeof(p), hash ); }
+		}
+		block_hashes[b] = hash;
+	}
+
+	long long count = n_prims;
+	unsigned long long hash = fnv1a( &count, sizeof(count) );
+	if( n_blocks > 0 ){ hash = fnv1a( &block_hashes[0], n_blocks*sizeof(unsigned long long), hash ); }
+	return hash;
+
+} // end geometry hash
+
+
+void BVHCache::make_header( Header &header, const FlatBVH &bvh, unsigned long long hash, const std::string &builder ){
+	std::memset( &header, 0, sizeof(Header) );
+	std::memcpy( header.magic, "MCLBVH", 6 );
+	header.version = version;
+	header.node_size = sizeof(FlatNode);
+	header.hash = hash;
+	std::strncpy( header.builder, builder.c_str(), sizeof(header.builder)-1 );
+	header.n_prims = bvh.num_prims();
+	header.n_nodes = bvh.nodes.size();
+	header.n_indices = bvh.prim_indices.size();
+}
+
+
+bool BVHCache::save( std::string filename, const FlatBVH &bvh, unsigned long long hash, std::string builder ){
+
+	Header header;
+	make_header( header, bvh, hash, builder );
+
+	// Write to a temporary and rename it, so that a partial file is never loaded
+	std::string tmp_filename = filename + ".tmp";
+	std::ofstream filestream( tmp_filename.c_str(), std::ios::binary );
+	if( !filestream.is_open() ){
+		std::cerr << "\n**BVHCache::save Error: Could not write " << tmp_filename << std::endl;
+		return false;
+	}
+	filestream.write( reinterpret_cast<const char*>( &header ), sizeof(Header) );
+	if( bvh.nodes.size() ){ filestream.write( reinterpret_cast<const char*>( &bvh.nodes[0] ), bvh.nodes.size()*sizeof(FlatNode) ); }
+	if( bvh.prim_indices.size() ){ filestream.write( reinterpret_cast<const char*>( &bvh.prim_indices[0] ), bvh.prim_indices.size()*sizeof(int) ); }
+	filestream.close();
+	if( !filestream ){
+		std::remove( tmp_filename.c_str() );
+		return false;
+	}
+
+	if( std::rename( tmp_filename.c_str(), filename.c_str() ) != 0 ){
+		std::remove( tmp_filename.c_str() );
+		return false;
+	}
+	return true;
+
+} // end save
+
+
+// True if every child offset and leaf range is inside the node and index arrays, and every
+// index is a primitive. Children must come after their parent (depth first order), so that
+// traversal of a file that passes can't loop or read out of bounds.
+static bool valid_tree( const FlatNode *nodes, const long long n_nodes, const int *indices,
+	const long long n_indices, const long long n_prims ){
+
+	bool valid = true;
+	#pragma omp parallel for reduction(&&:valid)
+	for( long long i=0; i<n_nodes; ++i ){
+		const FlatNode &node = nodes[i];
+		if( node.n_prims < 0 ){ valid = false; }
+		else if( node.is_leaf() ){ valid = valid && node.offset >= 0 && node.offset + (long long)node.n_prims <= n_indices; }
+		else{ valid = valid && i+1 < n_nodes && node.offset > i+1 && node.offset < n_nodes; }
+	}
+
+	#pragma omp parallel for reduction(&&:valid)
+	for( long long i=0; i<n_indices; ++i ){
+		valid = valid && indices[i] >= 0 && indices[i] < n_prims;
+	}
+	return valid;
+
+} // end valid tree
+
+
+bool BVHCache::load( std::string filename, FlatBVH &bvh, unsigned long long hash, std::string builder ){
+
+	const char *data = NULL;
+	size_t size = 0;
+
+#ifdef MCL_HAVE_MMAP
+	int fd = open( filename.c_str(), O_RDONLY );
+	if( fd < 0 ){ return false; }
+	struct stat file_stat;
+	if( fstat( fd, &file_stat ) != 0 || file_stat.st_size < sizeof(Header) ){ close( fd ); return false; }
+	size = file_stat.st_size;
+	void *mapped = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( mapped == MAP_FAILED ){ return false; }
+	data = static_cast<const char*>( mapped );
+#else
+	std::ifstream filestream( filename.c_str(), std::ios::binary | std::ios::ate );
+	if( !filestream.is_open() ){ return false; }
+	std::vector<char> buffer( filestream.tellg() );
+	filestream.seekg( 0 );
+	if( buffer.size() < sizeof(Header) || !filestream.read( &buffer[0], buffer.size() ) ){ return false; }
+	data = &buffer[0];
+	size = buffer.size();
+#endif
+
+	// Check the header against what we would have built
+	Header expected, header;
+	make_header( expected, bvh, hash, builder );
+	std::memcpy( &header, data, sizeof(Header) );
+	bool valid = std::memcmp( header.magic, expected.magic, sizeof(header.magic) )==0 &&
+		header.version == expected.version && header.node_size == expected.node_size &&
+		header.hash == expected.hash && std::strncmp( header.builder, expected.builder, sizeof(header.builder) )==0 &&
+		header.n_prims == expected.n_prims && header.n_nodes >= 0 && header.n_indices >= 0 &&
+		size == sizeof(Header) + header.n_nodes*sizeof(FlatNode) + header.n_indices*sizeof(int);
+
+	// The arrays are checked and then copied out of the mapping in one go, since the bvh owns its vectors
+	if( valid ){
+		const FlatNode *nodes = reinterpret_cast<const FlatNode*>( data + sizeof(Header) );
+		const int *indices = reinterpret_cast<const int*>( data + sizeof(Header) + header.n_nodes*sizeof(FlatNode) );
+		valid = valid_tree( nodes, header.n_nodes, indices, header.n_indices, header.n_prims );
+		if( valid ){
+			bvh.nodes.assign( nodes, nodes + header.n_nodes );
+			bvh.prim_indices.assign( indices, indices + header.n_indices );
+		}
+	}
+
+#ifdef MCL_HAVE_MMAP
+	munmap( const_cast<char*>( data ), size );
+#endif
+	return valid;
+
+} // end load
@@ -0,0 +1,453 @@
+// Copyright 2016 Matthew Overby.
+// 
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#include "MCL/BVHQuery.hpp"
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace mcl;
+
+
+// Squared distance from p to the box, zero if it is inside
+static inline float box_dist2( const trimesh::vec &bmin, const trimesh::vec &bmax, const trimesh::vec &p ){
+	float d2 = 0.f;
+	for( int i=0; i<3; ++i ){
+		float d = std::max( std::max( bmin[i]-p[i], p[i]-bmax[i] ), 0.f );
+		d2 += d*d;
+	}
+	return d2;
+}
+
+static inline float node_dist2( const FlatNode &node, const trimesh::vec &p ){ return box_dist2( node.bmin, node.bmax, p ); }
+
+
+//
+//	Closest point
+//
+
+
+trimesh::vec BVHQuery::closest_point_triangle( const trimesh::vec &p, const trimesh::vec &a,
+	const trimesh::vec &b, const trimesh::vec &c, trimesh::vec &bary ){
+
+	const trimesh::vec ab = b-a, ac = c-a, ap = p-a;
+	const float d1 = ab.dot(ap), d2 = ac.dot(ap);
+	if( d1 <= 0.f && d2 <= 0.f ){ bary = trimesh::vec(1,0,0); return a; }
+
+	const trimesh::vec bp = p-b;
+	const float d3 = ab.dot(bp), d4 = ac.dot(bp);
+	if( d3 >= 0.f && d4 <= d3 ){ bary = trimesh::vec(0,1,0); return b; }
+
+	const float vc = d1*d4 - d3*d2;
+	if( vc <= 0.f && d1 >= 0.f && d3 <= 0.f ){
+		const float v = d1 / ( d1-d3 );
+		bary = trimesh::vec( 1.f-v, v, 0.f );
+		return a + ab*v;
+	}
+
+	const trimesh::vec cp = p-c;
+	const float d5 = ab.dot(cp), d6 = ac.dot(cp);
+	if( d6 >= 0.f && d5 <= d6 ){ bary = trimesh::vec(0,0,1); return c; }
+
+	const float vb = d5*d2 - d1*d6;
+	if( vb <= 0.f && d2 >= 0.f && d6 <= 0.f ){
+		const float w = d2 / ( d2-d6 );
+		bary = trimesh::vec( 1.f-w, 0.f, w );
+		return a + ac*w;
+	}
+
+	const float va = d3*d6 - d5*d4;
+	if( va <= 0.f && (d4-d3) >= 0.f && (d5-d6) >= 0.f ){
+		const float w = (d4-d3) / ( (d4-d3) + (d5-d6) );
+		bary = trimesh::vec( 0.f, 1.f-w, w );
+		return b + (c-b)*w;
+	}
+
+	// Inside the face
+	const float denom = 1.f / ( va+vb+vc );
+	const float v = vb*denom, w = vc*denom;
+	bary = trimesh::vec( 1.f-v-w, v, w );
+	return a + ab*v + ac*w;
+
+} // end closest point triangle
+
+
+bool BVHQuery::closest_point( const FlatBVH &bvh, const trimesh::vec &point, ClosestPoint &result, float max_dist ){
+	NodeHeap heap;
+	return closest_point( bvh, point, result, max_dist, heap );
+}
+
+
+void BVHQuery::closest_points( const FlatBVH &bvh, const std::vector< trimesh::vec > &points,
+	std::vector< ClosestPoint > &results, float max_dist ){
+
+	const int n_points = points.size();
+	results.resize( n_points );
+	#pragma omp parallel
+	{
+		NodeHeap heap;
+		#pragma omp for schedule(dynamic,256)
+		for( int i=0; i<n_points; ++i ){
+			results[i] = ClosestPoint();
+			closest_point( bvh, points[i], results[i], max_dist, heap );
+		}
+	}
+
+} // end closest points
+
+
+bool BVHQuery::closest_point( const FlatBVH &bvh, const trimesh::vec &point, ClosestPoint &result, float max_dist, NodeHeap &heap ){
+
+	if( bvh.nodes.size()==0 ){ return false; }
+
+	// Squared distance of the best point so far, only closer nodes are visited
+	float best2 = max_dist < std::sqrt( std::numeric_limits<float>::max() ) ? max_dist*max_dist : std::numeric_limits<float>::max();
+	bool found = false;
+
+	std::greater< std::pair< float, int > > farther;
+	heap.clear();
+	float root2 = node_dist2( bvh.nodes[0], point );
+	if( root2 <= best2 ){ heap.push_back( std::make_pair( root2, 0 ) ); }
+
+	while( heap.size() ){
+
+		std::pop_heap( heap.begin(), heap.end(), farther );
+		const float node2 = heap.back().first;
+		const int node_idx = heap.back().second;
+		const FlatNode &node = bvh.nodes[ node_idx ];
+		heap.pop_back();
+
+		// Everything left is at least this far
+		if( node2 > best2 ){ break; }
+
+		if( node.is_leaf() ){
+			for( int i=0; i<node.n_prims; ++i ){
+				const int prim = bvh.prim_indices[ node.offset+i ];
+				trimesh::vec p0, p1, p2, bary;
+				if( !bvh.prim_triangle( prim, p0, p1, p2 ) ){ continue; }
+				trimesh::vec cp = closest_point_triangle( point, p0, p1, p2, bary );
+				float d2 = trimesh::dist2( point, cp );
+				if( d2 < best2 || ( !found && d2 <= best2 ) ){
+					best2 = d2; found = true;
+					result.prim = prim;
+					result.point = cp;
+					result.bary = bary;
+				}
+			}
+			continue;
+		}
+
+		const int children[2] = { node_idx+1, node.offset };
+		for( int i=0; i<2; ++i ){
+			float child2 = node_dist2( bvh.nodes[ children[i] ], point );
+			if( child2 > best2 ){ continue; }
+			heap.push_back( std::make_pair( child2, children[i] ) );
+			std::push_heap( heap.begin(), heap.end(), farther );
+		}
+	}
+
+	if( found ){ result.dist = std::sqrt( best2 ); }
+	return found;
+
+} // end closest point
+
+
+//
+//	Range queries
+//
+
+// Stack of the range queries. Both children are pushed, and a tree deeper than the stack
+// goes on in a new query of the subtree when it is full.
+static const int range_stack_size = 256;
+
+struct BoxTest {
+	AABB box;
+	inline bool operator()( const trimesh::vec &bmin, const trimesh::vec &bmax ) const {
+		return bmin[0] <= box.max[0] && bmax[0] >= box.min[0] &&
+			bmin[1] <= box.max[1] && bmax[1] >= box.min[1] &&
+			bmin[2] <= box.max[2] && bmax[2] >= box.min[2];
+	}
+};
+
+struct SphereTest {
+	trimesh::vec center;
+	float radius2;
+	inline bool operator()( const trimesh::vec &bmin, const trimesh::vec &bmax ) const {
+		return box_dist2( bmin, bmax, center ) <= radius2;
+	}
+};
+
+// Visits the primitives below root whose bounds pass the test until visit returns false,
+// and returns false if it did
+template< typename Test, typename Visit > static bool range_query( const FlatBVH &bvh, const Test &test, const Visit &visit, const int root=0 ){
+
+	if( bvh.nodes.size()==0 ){ return true; }
+
+	int stack[ range_stack_size ];
+	int stack_size = 0;
+	stack[ stack_size++ ] = root;
+
+	while( stack_size > 0 ){
+
+		const int node_idx = stack[ --stack_size ];
+		const FlatNode &node = bvh.nodes[ node_idx ];
+		if( !test( node.bmin, node.bmax ) ){ continue; }
+		if( stack_size+2 > range_stack_size ){
+			if( !range_query( bvh, test, visit, node_idx ) ){ return false; }
+			continue;
+		}
+
+		if( node.is_leaf() ){
+			for( int i=0; i<node.n_prims; ++i ){
+				const int prim = bvh.prim_indices[ node.offset+i ];
+				trimesh::vec bmin, bmax;
+				bvh.prim_aabb( prim, bmin, bmax );
+				if( test( bmin, bmax ) && !visit( prim ) ){ return false; }
+			}
+			continue;
+		}
+
+		stack[ stack_size++ ] = node.offset;
+		stack[ stack_size++ ] = node_idx+1;
+	}
+
+	return true;
+
+} // end range query
+
+
+// Appends to the buffer, then removes the duplicated references of a split bvh
+template< typename Test > static int range_query( const FlatBVH &bvh, const Test &test, std::vector<int> &prims ){
+	const int start = prims.size();
+	range_query( bvh, test, [&prims]( int prim ){ prims.push_back( prim ); return true; } );
+	if( bvh.prim_indices.size() > bvh.num_prims() ){
+		std::sort( prims.begin()+start, prims.end() );
+		prims.erase( std::unique( prims.begin()+start, prims.end() ), prims.end() );
+	}
+	return prims.size()-start;
+}
+
+
+int BVHQuery::overlap_box( const FlatBVH &bvh, const AABB &box, std::vector<int> &prims ){
+	BoxTest test; test.box = box;
+	return range_query( bvh, test, prims );
+}
+
+
+int BVHQuery::overlap_sphere( const FlatBVH &bvh, const trimesh::vec &center, float radius, std::vector<int> &prims ){
+	SphereTest test; test.center = center; test.radius2 = radius*radius;
+	return range_query( bvh, test, prims );
+}
+
+
+void BVHQuery::overlap_box( const FlatBVH &bvh, const AABB &box, const std::function<bool (int)> &visitor ){
+	BoxTest test; test.box = box;
+	range_query( bvh, test, visitor );
+}
+
+
+void BVHQuery::overlap_sphere( const FlatBVH &bvh, const trimesh::vec &center, float radius, const std::function<bool (int)> &visitor ){
+	SphereTest test; test.center = center; test.radius2 = radius*radius;
+	range_query( bvh, test, visitor );
+}
+
+
+//
+//	Dual tree overlap
+//
+
+// Pairs of subtrees are spawned as tasks above this depth
+static const int overlap_task_depth = 8;
+
+struct DualTreeState {
+	const FlatBVH *a, *b;
+	const std::vector< AABB > *aabbs_a, *aabbs_b;
+	bool self, skip_adjacent;
+	std::vector< std::vector< std::pair<int,int> > > *thread_pairs;
+};
+
+static inline bool boxes_overlap( const trimesh::vec &amin, const trimesh::vec &amax, const trimesh::vec &bmin, const trimesh::vec &bmax ){
+	return amin[0] <= bmax[0] && amax[0] >= bmin[0] &&
+		amin[1] <= bmax[1] && amax[1] >= bmin[1] &&
+		amin[2] <= bmax[2] && amax[2] >= bmin[2];
+}
+
+static inline float half_area( const FlatNode &node ){
+	trimesh::vec e = node.bmax - node.bmin;
+	return e[0]*e[1] + e[1]*e[2] + e[2]*e[0];
+}
+
+// True if both primitives are triangles of the same mesh with a vertex index in common
+static inline bool share_vertex( const BVHPrimitives &prims, const int pa, const int pb ){
+	if( !prims.is_triangle( pa ) || !prims.is_triangle( pb ) ){ return false; }
+	const FlatTriangle &ta = prims.tris[pa], &tb = prims.tris[pb];
+	if( ta.mesh != tb.mesh ){ return false; }
+	for( int i=0; i<3; ++i ){
+		if( ta.v[i]==tb.v[0] || ta.v[i]==tb.v[1] || ta.v[i]==tb.v[2] ){ return true; }
+	}
+	return false;
+}
+
+// Tests the primitives of two leaves, or of one leaf against itself
+static void leaf_pairs( const DualTreeState &state, const FlatNode &na, const FlatNode &nb, const bool same ){
+
+	int thread = 0;
+#ifdef _OPENMP
+	thread = omp_get_thread_num();
+#endif
+	std::vector< std::pair<int,int> > &pairs = (*state.thread_pairs)[ thread ];
+	for( int i=0; i<na.n_prims; ++i ){
+		const int pa = state.a->prim_indices[ na.offset+i ];
+		const AABB &aabb_a = (*state.aabbs_a)[pa];
+		for( int j = same ? i+1 : 0; j<nb.n_prims; ++j ){
+			const int pb = state.b->prim_indices[ nb.offset+j ];
+			const AABB &aabb_b = (*state.aabbs_b)[pb];
+			if( state.self && pa==pb ){ continue; }
+			if( !boxes_overlap( aabb_a.min, aabb_a.max, aabb_b.min, aabb_b.max ) ){ continue; }
+			if( !state.self ){ pairs.push_back( std::make_pair( pa, pb ) ); continue; }
+			if( state.skip_adjacent && share_vertex( *state.a, pa, pb ) ){ continue; }
+			pairs.push_back( std::make_pair( std::min( pa, pb ), std::max( pa, pb ) ) );
+		}
+	}
+
+} // end leaf pairs
+
+
+static void dual_tree( const DualTreeState &state, const int ia, const int ib, const int depth ){
+
+	const FlatNode &na = state.a->nodes[ia];
+	const FlatNode &nb = state.b->nodes[ib];
+	const bool parallel = depth < overlap_task_depth;
+
+	// A subtree against itself is its children against themselves and each other
+	if( state.self && ia==ib ){
+		if( na.is_leaf() ){ leaf_pairs( state, na, na, true ); return; }
+		const int left = ia+1, right = na.offset;
+		if( parallel ){
+			#pragma omp task shared( state )
+			dual_tree( state, left, left, depth+1 );
+			#pragma omp task shared( state )
+			dual_tree( state, right, right, depth+1 );
+		}
+		else {
+			dual_tree( state, left, left, depth+1 );
+			dual_tree( state, right, right, depth+1 );
+		}
+		dual_tree( state, left, right, depth+1 );
+		#pragma omp taskwait
+		return;
+	}
+
+	if( !boxes_overlap( na.bmin, na.bmax, nb.bmin, nb.bmax ) ){ return; }
+	if( na.is_leaf() && nb.is_leaf() ){ leaf_pairs( state, na, nb, false ); return; }
+
+	// Descend into the larger node
+	const bool split_a = nb.is_leaf() || ( !na.is_leaf() && half_area( na ) >= half_area( nb ) );
+	const int first_a = split_a ? ia+1 : ia, second_a = split_a ? na.offset : ia;
+	const int first_b = split_a ? ib : ib+1, second_b = split_a ? ib : nb.offset;
+	if( parallel ){
+		#pragma omp task shared( state )
+		dual_tree( state, first_a, first_b, depth+1 );
+	}
+	else { dual_tree( state, first_a, first_b, depth+1 ); }
+	dual_tree( state, second_a, second_b, depth+1 );
+	#pragma omp taskwait
+
+} // end dual tree
+
+
+// Bounds of every primitive in parallel
+static void overlap_bounds( const FlatBVH &bvh, std::vector< AABB > &aabbs ){
+	const int n_prims = bvh.num_prims();
+	aabbs.resize( n_prims );
+	#pragma omp parallel for
+	for( int i=0; i<n_prims; ++i ){ bvh.prim_aabb( i, aabbs[i].min, aabbs[i].max ); }
+}
+
+
+// Runs the traversal from the roots and gathers the pairs of each thread
+static int overlap_pairs( DualTreeState &state, OverlapPairs &result ){
+
+	result.pairs.clear();
+	int n_threads = 1;
+#ifdef _OPENMP
+	n_threads = omp_get_max_threads();
+#endif
+	result.thread_pairs.resize( n_threads );
+	for( int i=0; i<result.thread_pairs.size(); ++i ){ result.thread_pairs[i].clear(); }
+	if( state.a->nodes.size()==0 || state.b->nodes.size()==0 ){ return 0; }
+	state.thread_pairs = &result.thread_pairs;
+
+	#pragma omp parallel
+	{
+		#pragma omp single
+		dual_tree( state, 0, 0, 0 );
+	}
+
+	size_t n_pairs = 0;
+	for( int i=0; i<result.thread_pairs.size(); ++i ){ n_pairs += result.thread_pairs[i].size(); }
+	result.pairs.reserve( n_pairs );
+	for( int i=0; i<result.thread_pairs.size(); ++i ){
+		result.pairs.insert( result.pairs.end(), result.thread_pairs[i].begin(), result.thread_pairs[i].end() );
+	}
+
+	// Order doesn't depend on the threads, and references duplicated by a split bvh only count once
+	std::sort( result.pairs.begin(), result.pairs.end() );
+	if( state.a->prim_indices.size() > state.a->num_prims() || state.b->prim_indices.size() > state.b->num_prims() ){
+		result.pairs.erase( std::unique( result.pairs.begin(), result.pairs.end() ), result.pairs.end() );
+	}
+	return result.pairs.size();
+
+} // end overlap pairs
+
+
+int BVHQuery::overlap( const FlatBVH &a, const FlatBVH &b, OverlapPairs &result ){
+
+	overlap_bounds( a, result.aabbs_a );
+	overlap_bounds( b, result.aabbs_b );
+
+	DualTreeState state;
+	state.a = &a; state.b = &b;
+	state.aabbs_a = &result.aabbs_a; state.aabbs_b = &result.aabbs_b;
+	state.self = false;
+	state.skip_adjacent = false;
+	return overlap_pairs( state, result );
+
+} // end overlap
+
+
+int BVHQuery::self_overlap( const FlatBVH &bvh, OverlapPairs &result, bool skip_adjacent ){
+
+	overlap_bounds( bvh, result.aabbs_a );
+	result.aabbs_b.clear();
+
+	DualTreeState state;
+	state.a = &bvh; state.b = &bvh;
+	state.aabbs_a = &result.aabbs_a; state.aabbs_b = &result.aabbs_a;
+	state.self = true;
+	state.skip_adjacent = skip_adjacent;
+	return overlap_pairs( state, result );
+
+} // end self overlap
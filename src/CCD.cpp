@@ -0,0 +1,443 @@
+// Copyright 2016 Matthew Overby.
+// 
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#include "MCL/CCD.hpp"
+#include <algorithm>
+#include <cmath>
+
+using namespace mcl;
+
+typedef trimesh::Vec<3,double> dvec;
+
+static inline dvec to_double( const trimesh::vec &v ){ return dvec( v[0], v[1], v[2] ); }
+
+
+//
+//	Swept meshes
+//
+
+
+void SweptMesh::get_aabb( trimesh::vec &bmin, trimesh::vec &bmax ){
+	AABB aabb;
+	for( int i=0; i<faces->size(); ++i ){
+		for( int j=0; j<3; ++j ){ aabb += (*x0)[ (*faces)[i][j] ]; aabb += (*x1)[ (*faces)[i][j] ]; }
+	}
+	bmin = aabb.min; bmax = aabb.max;
+}
+
+
+bool SweptMesh::get_triangle_view( TriangleView &view ){
+	view.vertices = x0;
+	view.end_vertices = x1;
+	view.faces = faces;
+	return true;
+}
+
+
+void CCD::make_swept_bvh( FlatBVH &bvh, const std::vector< trimesh::vec > &x0,
+	const std::vector< trimesh::vec > &x1, const std::vector< trimesh::TriMesh::Face > &faces ){
+	std::vector< std::shared_ptr<BaseObject> > objects;
+	objects.push_back( std::shared_ptr<BaseObject>( new SweptMesh( x0, x1, faces ) ) );
+	BVHBuilder::make_tree_sah( bvh, objects );
+}
+
+
+//
+//	Root finding
+//
+
+// Most roots kept for a pair, which is also how many times a pair that moves in a plane is checked
+static const int max_roots = 9;
+
+// Coefficients of the cubic (P x Q) . R over t in [0,1] where P = P0 + t*dP and so on. The
+// vertex-face and edge-edge pairs are coplanar at its roots. The vectors are read with a stride
+// so a block of pairs can be stored by component. Tol is the size of the cubic below which it
+// is treated as zero. Written without branches so it vectorizes over pairs.
+template< int stride > static inline void coplanar_cubic( const double *v, double &c0, double &c1, double &c2, double &c3, double &tol ){
+
+	const double p0x = v[0], p0y = v[stride], p0z = v[2*stride];
+	const double dpx = v[3*stride], dpy = v[4*stride], dpz = v[5*stride];
+	const double q0x = v[6*stride], q0y = v[7*stride], q0z = v[8*stride];
+	const double dqx = v[9*stride], dqy = v[10*stride], dqz = v[11*stride];
+	const double r0x = v[12*stride], r0y = v[13*stride], r0z = v[14*stride];
+	const double drx = v[15*stride], dry = v[16*stride], drz = v[17*stride];
+
+	// P x Q = N0 + t*N1 + t^2*N2
+	const double n0x = p0y*q0z - p0z*q0y, n0y = p0z*q0x - p0x*q0z, n0z = p0x*q0y - p0y*q0x;
+	const double n1x = p0y*dqz - p0z*dqy + dpy*q0z - dpz*q0y;
+	const double n1y = p0z*dqx - p0x*dqz + dpz*q0x - dpx*q0z;
+	const double n1z = p0x*dqy - p0y*dqx + dpx*q0y - dpy*q0x;
+	const double n2x = dpy*dqz - dpz*dqy, n2y = dpz*dqx - dpx*dqz, n2z = dpx*dqy - dpy*dqx;
+
+	c0 = n0x*r0x + n0y*r0y + n0z*r0z;
+	c1 = n0x*drx + n0y*dry + n0z*drz + n1x*r0x + n1y*r0y + n1z*r0z;
+	c2 = n1x*drx + n1y*dry + n1z*drz + n2x*r0x + n2y*r0y + n2z*r0z;
+	c3 = n2x*drx + n2y*dry + n2z*drz;
+
+	// Bound on the cubic from the lengths of the vectors
+	const double p = std::abs(p0x) + std::abs(p0y) + std::abs(p0z) + std::abs(dpx) + std::abs(dpy) + std::abs(dpz);
+	const double q = std::abs(q0x) + std::abs(q0y) + std::abs(q0z) + std::abs(dqx) + std::abs(dqy) + std::abs(dqz);
+	const double r = std::abs(r0x) + std::abs(r0y) + std::abs(r0z) + std::abs(drx) + std::abs(dry) + std::abs(drz);
+	tol = 1e-10 * p*q*r;
+}
+
+
+// Positive if the cubic can't have a root in [0,1]. The cubic is within the convex hull
+// of its Bernstein coefficients, so it can't if they all have the same sign. This is how
+// far the hull is from zero, so the cull stays in doubles and vectorizes with the cubic.
+static inline double bernstein_gap( const double c0, const double c1, const double c2, const double c3, const double tol ){
+	const double b0 = c0;
+	const double b1 = c0 + c1/3.0;
+	const double b2 = c0 + (2.0/3.0)*c1 + c2/3.0;
+	const double b3 = c0 + c1 + c2 + c3;
+	const double lo = std::min( std::min( b0, b1 ), std::min( b2, b3 ) );
+	const double hi = std::max( std::max( b0, b1 ), std::max( b2, b3 ) );
+	return std::max( lo-tol, -tol-hi );
+}
+
+
+// Cubics of n pairs and their Bernstein gaps, with the vectors and coefficients of
+// the pairs stored by component with the given stride. This is the SIMD loop of CCD.
+template< int stride > static void cubic_block( const double *v, const int n, double *c, double *tol, double *gap ){
+	#pragma omp simd
+	for( int i=0; i<n; ++i ){
+		coplanar_cubic<stride>( &v[i], c[i], c[stride+i], c[2*stride+i], c[3*stride+i], tol[i] );
+		gap[i] = bernstein_gap( c[i], c[stride+i], c[2*stride+i], c[3*stride+i], tol[i] );
+	}
+}
+
+
+static inline double eval_cubic( const double *c, const double t ){ return c[0] + t*( c[1] + t*( c[2] + t*c[3] ) ); }
+
+
+// Roots of the cubic in [0,1] in increasing order, or a few evenly spaced times if it is
+// zero everywhere (the pair moves in a plane). The cubic is split into monotone intervals
+// at the roots of its derivative, and each interval with a sign change is bisected.
+static int cubic_roots( const double *c, const double tol, double *roots ){
+
+	int n_roots = 0;
+	if( std::abs(c[0]) <= tol && std::abs(c[1]) <= tol && std::abs(c[2]) <= tol && std::abs(c[3]) <= tol ){
+		for( int i=0; i<max_roots; ++i ){ roots[n_roots++] = double(i)/double(max_roots-1); }
+		return n_roots;
+	}
+
+	// Ends of the monotone intervals
+	double ends[4] = { 0.0, 1.0, 1.0, 1.0 };
+	int n_ends = 1;
+	const double a = 3.0*c[3], b = 2.0*c[2], d = c[1];
+	if( a != 0.0 ){
+		const double disc = b*b - 4.0*a*d;
+		if( disc >= 0.0 ){
+			// Stable form of the quadratic formula
+			const double s = -0.5*( b + ( b >= 0.0 ? std::sqrt(disc) : -std::sqrt(disc) ) );
+			double t0 = s/a, t1 = s != 0.0 ? d/s : t0;
+			if( t0 > t1 ){ std::swap( t0, t1 ); }
+			if( t0 > 0.0 && t0 < 1.0 ){ ends[ n_ends++ ] = t0; }
+			if( t1 > 0.0 && t1 < 1.0 && t1 != t0 ){ ends[ n_ends++ ] = t1; }
+		}
+	}
+	else if( b != 0.0 ){
+		const double t0 = -d/b;
+		if( t0 > 0.0 && t0 < 1.0 ){ ends[ n_ends++ ] = t0; }
+	}
+	ends[ n_ends++ ] = 1.0;
+
+	for( int i=0; i+1<n_ends; ++i ){
+		double lo = ends[i], hi = ends[i+1];
+		double f_lo = eval_cubic( c, lo );
+		const double f_hi = eval_cubic( c, hi );
+		if( std::abs( f_lo ) <= tol ){
+			if( n_roots==0 || roots[n_roots-1] < lo ){ roots[ n_roots++ ] = lo; }
+			continue;
+		}
+		if( ( f_lo < 0.0 ) == ( f_hi < 0.0 ) || std::abs( f_hi ) <= tol ){ continue; }
+		for( int j=0; j<64 && hi-lo > 1e-12; ++j ){
+			const double mid = 0.5*( lo+hi );
+			const double f_mid = eval_cubic( c, mid );
+			if( ( f_mid < 0.0 ) == ( f_lo < 0.0 ) ){ lo = mid; f_lo = f_mid; }
+			else { hi = mid; }
+		}
+		// The earlier end, so the impact isn't past the contact
+		roots[ n_roots++ ] = lo;
+	}
+	if( std::abs( eval_cubic( c, 1.0 ) ) <= tol && ( n_roots==0 || roots[n_roots-1] < 1.0 ) ){ roots[ n_roots++ ] = 1.0; }
+
+	return n_roots;
+
+} // end cubic roots
+
+
+//
+//	Proximity at a root
+//
+
+// Squared distance from p to the triangle (Ericson 2005), in double
+static double point_triangle_dist2( const dvec &p, const dvec &a, const dvec &b, const dvec &c ){
+
+	const dvec ab = b-a, ac = c-a, ap = p-a;
+	const double d1 = ab.dot(ap), d2 = ac.dot(ap);
+	if( d1 <= 0.0 && d2 <= 0.0 ){ return trimesh::len2( ap ); }
+	const dvec bp = p-b;
+	const double d3 = ab.dot(bp), d4 = ac.dot(bp);
+	if( d3 >= 0.0 && d4 <= d3 ){ return trimesh::len2( bp ); }
+	const double vc = d1*d4 - d3*d2;
+	if( vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0 ){ return trimesh::len2( ap - ab*( d1/(d1-d3) ) ); }
+	const dvec cp = p-c;
+	const double d5 = ab.dot(cp), d6 = ac.dot(cp);
+	if( d6 >= 0.0 && d5 <= d6 ){ return trimesh::len2( cp ); }
+	const double vb = d5*d2 - d1*d6;
+	if( vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0 ){ return trimesh::len2( ap - ac*( d2/(d2-d6) ) ); }
+	const double va = d3*d6 - d5*d4;
+	if( va <= 0.0 && (d4-d3) >= 0.0 && (d5-d6) >= 0.0 ){ return trimesh::len2( bp - (c-b)*( (d4-d3)/((d4-d3)+(d5-d6)) ) ); }
+	const double denom = va+vb+vc;
+	if( denom <= 0.0 ){ return std::min( std::min( trimesh::len2( ap ), trimesh::len2( bp ) ), trimesh::len2( cp ) ); } // degenerate
+	return trimesh::len2( ap - ab*( vb/denom ) - ac*( vc/denom ) );
+
+} // end point triangle dist
+
+
+// Squared distance between the segments (p0,p1) and (q0,q1) (Ericson 2005), in double
+static double segment_segment_dist2( const dvec &p0, const dvec &p1, const dvec &q0, const dvec &q1 ){
+
+	const dvec d1 = p1-p0, d2 = q1-q0, r = p0-q0;
+	const double a = d1.dot(d1), e = d2.dot(d2), f = d2.dot(r);
+	const double eps = 1e-20;
+	double s = 0.0, t = 0.0;
+	if( a <= eps && e <= eps ){ return trimesh::len2( r ); }
+	if( a <= eps ){ t = std::min( std::max( f/e, 0.0 ), 1.0 ); }
+	else {
+		const double c = d1.dot(r);
+		if( e <= eps ){ s = std::min( std::max( -c/a, 0.0 ), 1.0 ); }
+		else {
+			const double b = d1.dot(d2);
+			const double denom = a*e - b*b;
+			s = denom > 0.0 ? std::min( std::max( (b*f - c*e)/denom, 0.0 ), 1.0 ) : 0.0;
+			t = ( b*s + f ) / e;
+			if( t < 0.0 ){ t = 0.0; s = std::min( std::max( -c/a, 0.0 ), 1.0 ); }
+			else if( t > 1.0 ){ t = 1.0; s = std::min( std::max( (b-c)/a, 0.0 ), 1.0 ); }
+		}
+	}
+	return trimesh::len2( ( p0 + d1*s ) - ( q0 + d2*t ) );
+
+} // end segment segment dist
+
+
+// Positions of the four vertices of a pair at time t
+static inline void lerp4( const dvec *x0, const dvec *x1, const double t, dvec *x ){
+	for( int i=0; i<4; ++i ){ x[i] = x0[i] + ( x1[i]-x0[i] )*t; }
+}
+
+// Earliest root at which the pair is within thickness, or -1. Vertex-face pairs are
+// (p,a,b,c) and edge-edge pairs are (a,b,c,d).
+static double pair_toi( const int type, const dvec *x0, const dvec *x1, const double *c, const double tol, const double thickness ){
+	double roots[ max_roots ];
+	const int n_roots = cubic_roots( c, tol, roots );
+	const double thickness2 = thickness*thickness;
+	for( int i=0; i<n_roots; ++i ){
+		dvec x[4];
+		lerp4( x0, x1, roots[i], x );
+		const double d2 = type==CCD::Impact::VertexFace ?
+			point_triangle_dist2( x[0], x[1], x[2], x[3] ) : segment_segment_dist2( x[0], x[1], x[2], x[3] );
+		if( d2 <= thickness2 ){ return roots[i]; }
+	}
+	return -1.0;
+}
+
+// Differences that make the cubic of a pair, P, Q and R at the start and their change over the
+// step, by component: P0.x P0.y P0.z dP.x ... with stride between them
+static inline void pair_vectors( const int type, const dvec *x0, const dvec *x1, double *v, const int stride ){
+	dvec P0, Q0, R0, P1, Q1, R1;
+	if( type==CCD::Impact::VertexFace ){
+		P0 = x0[2]-x0[1]; Q0 = x0[3]-x0[1]; R0 = x0[0]-x0[1];
+		P1 = x1[2]-x1[1]; Q1 = x1[3]-x1[1]; R1 = x1[0]-x1[1];
+	}
+	else {
+		P0 = x0[1]-x0[0]; Q0 = x0[3]-x0[2]; R0 = x0[2]-x0[0];
+		P1 = x1[1]-x1[0]; Q1 = x1[3]-x1[2]; R1 = x1[2]-x1[0];
+	}
+	for( int i=0; i<3; ++i ){
+		v[i*stride] = P0[i]; v[(3+i)*stride] = P1[i]-P0[i];
+		v[(6+i)*stride] = Q0[i]; v[(9+i)*stride] = Q1[i]-Q0[i];
+		v[(12+i)*stride] = R0[i]; v[(15+i)*stride] = R1[i]-R0[i];
+	}
+}
+
+
+static bool pair_toi( const int type, const trimesh::vec *x0_, const trimesh::vec *x1_, double &toi, const double thickness ){
+	dvec x0[4], x1[4];
+	for( int i=0; i<4; ++i ){ x0[i] = to_double( x0_[i] ); x1[i] = to_double( x1_[i] ); }
+	double v[18], c[4], tol;
+	double gap;
+	pair_vectors( type, x0, x1, v, 1 );
+	cubic_block<1>( v, 1, c, &tol, &gap );
+	if( gap > 0.0 ){ return false; }
+	toi = pair_toi( type, x0, x1, c, tol, thickness );
+	return toi >= 0.0;
+}
+
+
+bool CCD::vertex_face_toi( const trimesh::vec &p0, const trimesh::vec &a0, const trimesh::vec &b0, const trimesh::vec &c0,
+	const trimesh::vec &p1, const trimesh::vec &a1, const trimesh::vec &b1, const trimesh::vec &c1,
+	double &toi, double thickness ){
+	const trimesh::vec x0[4] = { p0, a0, b0, c0 }, x1[4] = { p1, a1, b1, c1 };
+	return pair_toi( Impact::VertexFace, x0, x1, toi, thickness );
+}
+
+
+bool CCD::edge_edge_toi( const trimesh::vec &a0, const trimesh::vec &b0, const trimesh::vec &c0, const trimesh::vec &d0,
+	const trimesh::vec &a1, const trimesh::vec &b1, const trimesh::vec &c1, const trimesh::vec &d1,
+	double &toi, double thickness ){
+	const trimesh::vec x0[4] = { a0, b0, c0, d0 }, x1[4] = { a1, b1, c1, d1 };
+	return pair_toi( Impact::EdgeEdge, x0, x1, toi, thickness );
+}
+
+
+//
+//	Self impacts
+//
+
+// Pairs are solved in blocks of this many, the cubics of a block are made in one SIMD loop
+static const int ccd_block_size = 256;
+
+static inline bool impact_less( const CCD::Impact &a, const CCD::Impact &b ){
+	if( a.type != b.type ){ return a.type < b.type; }
+	for( int i=0; i<4; ++i ){ if( a.v[i] != b.v[i] ){ return a.v[i] < b.v[i]; } }
+	return false;
+}
+
+static inline bool impact_equal( const CCD::Impact &a, const CCD::Impact &b ){
+	return a.type==b.type && a.v[0]==b.v[0] && a.v[1]==b.v[1] && a.v[2]==b.v[2] && a.v[3]==b.v[3];
+}
+
+static inline bool impact_earlier( const CCD::Impact &a, const CCD::Impact &b ){
+	return a.toi < b.toi || ( a.toi == b.toi && impact_less( a, b ) );
+}
+
+// True if the swept bounds of vertices i[0..n) and j[0..m) overlap
+static inline bool swept_overlap( const std::vector< trimesh::vec > &x0, const std::vector< trimesh::vec > &x1,
+	const int *i, const int n, const int *j, const int m ){
+	AABB a, b;
+	for( int k=0; k<n; ++k ){ a += x0[ i[k] ]; a += x1[ i[k] ]; }
+	for( int k=0; k<m; ++k ){ b += x0[ j[k] ]; b += x1[ j[k] ]; }
+	for( int k=0; k<3; ++k ){
+		if( a.min[k] > b.max[k] || a.max[k] < b.min[k] ){ return false; }
+	}
+	return true;
+}
+
+
+int CCD::self_impacts( const FlatBVH &swept_bvh, const std::vector< trimesh::vec > &x0, const std::vector< trimesh::vec > &x1,
+	const std::vector< trimesh::TriMesh::Face > &faces, std::vector< Impact > &impacts, double thickness ){
+
+	impacts.clear();
+	if( swept_bvh.num_prims() != faces.size() ){
+		std::cerr << "\n**CCD Error: The swept bvh was not made from these faces" << std::endl;
+		return 0;
+	}
+
+	// Triangle pairs with overlapping sweeps. Adjacent triangles are kept,
+	// pairs of elements that share a vertex are left out below instead.
+	OverlapPairs tri_pairs;
+	BVHQuery::self_overlap( swept_bvh, tri_pairs, false );
+	const int n_tri_pairs = tri_pairs.pairs.size();
+
+	// Each triangle pair makes up to six vertex-face and nine edge-edge pairs
+	std::vector< Impact > pairs( 15*n_tri_pairs );
+	#pragma omp parallel for
+	for( int i=0; i<n_tri_pairs; ++i ){
+		const trimesh::TriMesh::Face &fa = faces[ tri_pairs.pairs[i].first ];
+		const trimesh::TriMesh::Face &fb = faces[ tri_pairs.pairs[i].second ];
+		Impact *out = &pairs[15*i];
+		for( int j=0; j<15; ++j ){ out[j].type = -1; }
+
+		for( int side=0; side<2; ++side ){
+			const trimesh::TriMesh::Face &f = side==0 ? fa : fb;
+			const trimesh::TriMesh::Face &g = side==0 ? fb : fa;
+			for( int j=0; j<3; ++j ){
+				if( f[j]==g[0] || f[j]==g[1] || f[j]==g[2] ){ continue; }
+				if( !swept_overlap( x0, x1, &f[j], 1, &g[0], 3 ) ){ continue; }
+				Impact &vf = out[ 3*side+j ];
+				vf.type = Impact::VertexFace;
+				vf.v[0] = f[j]; vf.v[1] = g[0]; vf.v[2] = g[1]; vf.v[3] = g[2];
+			}
+		}
+
+		for( int j=0; j<3; ++j ){
+			int ea[2] = { std::min( fa[j], fa[(j+1)%3] ), std::max( fa[j], fa[(j+1)%3] ) };
+			for( int k=0; k<3; ++k ){
+				int eb[2] = { std::min( fb[k], fb[(k+1)%3] ), std::max( fb[k], fb[(k+1)%3] ) };
+				if( ea[0]==eb[0] || ea[0]==eb[1] || ea[1]==eb[0] || ea[1]==eb[1] ){ continue; }
+				if( !swept_overlap( x0, x1, ea, 2, eb, 2 ) ){ continue; }
+				const bool a_first = ea[0] < eb[0] || ( ea[0]==eb[0] && ea[1] < eb[1] );
+				Impact &ee = out[ 6+3*j+k ];
+				ee.type = Impact::EdgeEdge;
+				ee.v[0] = a_first ? ea[0] : eb[0]; ee.v[1] = a_first ? ea[1] : eb[1];
+				ee.v[2] = a_first ? eb[0] : ea[0]; ee.v[3] = a_first ? eb[1] : ea[1];
+			}
+		}
+	}
+
+	// A vertex-face or edge-edge pair comes from every triangle pair that has it, so keep one of each
+	pairs.erase( std::remove_if( pairs.begin(), pairs.end(), []( const Impact &p ){ return p.type < 0; } ), pairs.end() );
+	std::sort( pairs.begin(), pairs.end(), impact_less );
+	pairs.erase( std::unique( pairs.begin(), pairs.end(), impact_equal ), pairs.end() );
+	const int n_pairs = pairs.size();
+	const int n_blocks = ( n_pairs + ccd_block_size-1 ) / ccd_block_size;
+
+	#pragma omp parallel for schedule(dynamic)
+	for( int b=0; b<n_blocks; ++b ){
+		const int begin = b*ccd_block_size;
+		const int n = std::min( ccd_block_size, n_pairs-begin );
+
+		// Gather the vectors of the block into arrays of each component
+		double v[ 18*ccd_block_size ];
+		for( int i=0; i<n; ++i ){
+			const Impact &p = pairs[begin+i];
+			dvec px0[4], px1[4];
+			for( int j=0; j<4; ++j ){ px0[j] = to_double( x0[ p.v[j] ] ); px1[j] = to_double( x1[ p.v[j] ] ); }
+			pair_vectors( p.type, px0, px1, &v[i], ccd_block_size );
+		}
+
+		// Cubics and the Bernstein cull on all of the block at once
+		double c[ 4*ccd_block_size ], tol[ ccd_block_size ];
+		double gap[ ccd_block_size ];
+		cubic_block<ccd_block_size>( v, n, c, tol, gap );
+
+		// Roots of the ones that are left
+		for( int i=0; i<n; ++i ){
+			Impact &p = pairs[begin+i];
+			p.toi = -1.0;
+			if( gap[i] > 0.0 ){ continue; }
+			dvec px0[4], px1[4];
+			for( int j=0; j<4; ++j ){ px0[j] = to_double( x0[ p.v[j] ] ); px1[j] = to_double( x1[ p.v[j] ] ); }
+			const double ci[4] = { c[i], c[ccd_block_size+i], c[2*ccd_block_size+i], c[3*ccd_block_size+i] };
+			p.toi = pair_toi( p.type, px0, px1, ci, tol[i], thickness );
+		}
+	}
+
+	for( int i=0; i<n_pairs; ++i ){
+		if( pairs[i].toi >= 0.0 ){ impacts.push_back( pairs[i] ); }
+	}
+	std::sort( impacts.begin(), impacts.end(), impact_earlier );
+	return impacts.size();
+
+} // end self impacts
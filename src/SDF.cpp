@@ -0,0 +1,299 @@
+// Copyright 2016 Matthew Overby.
+// 
+// MCLSCENE Uses the BSD 2-Clause License (http://www.opensource.org/licenses/BSD-2-Clause)
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other materials
+//    provided with the distribution.
+// THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR  A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE UNIVERSITY OF MINNESOTA, DULUTH OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+// IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// By Matt Overby (http://www.mattoverby.net)
+
+
+#include "MCL/SDF.hpp"
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace mcl;
+
+
+//
+//	Build
+//
+
+// Bricks whose samples are looked up together, bounds the memory of the closest point results
+static const int sdf_chunk_size = 256;
+
+// Brick coordinates are 21 bits
+static const int sdf_max_brick = (1<<21)-1;
+
+// -1 if p is inside the surface, by the majority of the crossing parities of three rays.
+// Directions are skewed so the rays don't run along axis aligned edges.
+static float parity_sign( const FlatBVH &bvh, const trimesh::vec &p, const float eps ){
+
+	static const trimesh::vec dirs[3] = { trimesh::vec( 0.8728f, 0.3906f, 0.2926f ),
+		trimesh::vec( -0.3312f, 0.8847f, 0.3281f ), trimesh::vec( 0.2113f, -0.4142f, 0.8853f ) };
+
+	int inside = 0;
+	for( int i=0; i<3; ++i ){
+		intersect::Ray ray;
+		ray.origin = p;
+		ray.direction = dirs[i];
+		int crossings = 0;
+		double t = 0.0;
+		for( int j=0; j<256; ++j ){
+			intersect::Payload payload;
+			payload.t_min = t + eps;
+			if( !BVHTraversal::ray_intersect( bvh, ray, payload ) ){ break; }
+			t = payload.t_max;
+			++crossings;
+		}
+		inside += crossings & 1;
+	}
+	return inside >= 2 ? -1.f : 1.f;
+
+} // end parity sign
+
+
+void SDF::make( const FlatBVH &bvh, float voxel_size_, float band_ ){
+
+	clear();
+	voxel_size = voxel_size_;
+	band = band_;
+	if( bvh.nodes.size()==0 || voxel_size <= 0.f ){ return; }
+
+	// Sample (0,0,0) is past the band so brick coordinates are never negative
+	AABB bounds = bvh.bounds();
+	const float margin = band + voxel_size;
+	origin = bounds.min - trimesh::vec( margin, margin, margin );
+	const float brick_width = brick_size*voxel_size;
+
+	// Every brick that overlaps the bounds of a triangle grown by the band. Samples that
+	// are within band of the surface are in one of these.
+	const int n_prims = bvh.num_prims();
+	#pragma omp parallel
+	{
+		std::vector< unsigned long long > keys;
+		#pragma omp for
+		for( int i=0; i<n_prims; ++i ){
+			trimesh::vec bmin, bmax;
+			bvh.prim_aabb( i, bmin, bmax );
+			int lo[3], hi[3];
+			for( int j=0; j<3; ++j ){
+				lo[j] = std::max( 0, int( std::floor( ( bmin[j]-band-origin[j] ) / brick_width ) ) );
+				hi[j] = std::min( sdf_max_brick, int( std::floor( ( bmax[j]+band-origin[j] ) / brick_width ) ) );
+			}
+			for( int z=lo[2]; z<=hi[2]; ++z ){
+				for( int y=lo[1]; y<=hi[1]; ++y ){
+					for( int x=lo[0]; x<=hi[0]; ++x ){ keys.push_back( brick_key( x, y, z ) ); }
+				}
+			}
+		}
+		std::sort( keys.begin(), keys.end() );
+		keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+		#pragma omp critical (sdf_keys)
+		brick_keys.insert( brick_keys.end(), keys.begin(), keys.end() );
+	}
+	std::sort( brick_keys.begin(), brick_keys.end() );
+	brick_keys.erase( std::unique( brick_keys.begin(), brick_keys.end() ), brick_keys.end() );
+
+	const int n_bricks = brick_keys.size();
+	brick_map.reserve( n_bricks );
+	for( int i=0; i<n_bricks; ++i ){ brick_map[ brick_keys[i] ] = i; }
+	values.resize( size_t(n_bricks)*brick_samples );
+
+	const int row = brick_size+1;
+	const float eps = 1e-4f * voxel_size;
+	std::vector< trimesh::vec > points;
+	std::vector< ClosestPoint > closest;
+	for( int chunk=0; chunk<n_bricks; chunk += sdf_chunk_size ){
+		const int chunk_end = std::min( n_bricks, chunk+sdf_chunk_size );
+
+		// Unsigned distances of every sample in the chunk, up to the band
+		points.resize( (chunk_end-chunk)*brick_samples );
+		#pragma omp parallel for
+		for( int b=chunk; b<chunk_end; ++b ){
+			const unsigned long long key = brick_keys[b];
+			const int base[3] = { int( key>>42 )*brick_size, int( (key>>21) & sdf_max_brick )*brick_size, int( key & sdf_max_brick )*brick_size };
+			trimesh::vec *p = &points[ (b-chunk)*brick_samples ];
+			for( int z=0; z<row; ++z ){
+				for( int y=0; y<row; ++y ){
+					for( int x=0; x<row; ++x ){
+						*(p++) = origin + trimesh::vec( base[0]+x, base[1]+y, base[2]+z )*voxel_size;
+					}
+				}
+			}
+		}
+		BVHQuery::closest_points( bvh, points, closest, band );
+
+		// Signs along each row of x. A sample has the sign of the one before it unless their
+		// distances add up to less than the spacing, which is when the surface could be between them.
+		#pragma omp parallel for schedule(dynamic)
+		for( int b=chunk; b<chunk_end; ++b ){
+			const int first = (b-chunk)*brick_samples;
+			float *brick = &values[ size_t(b)*brick_samples ];
+			for( int r=0; r<row*row; ++r ){
+				float sign = 1.f, prev = 0.f;
+				for( int x=0; x<row; ++x ){
+					const int idx = r*row + x;
+					const float dist = closest[ first+idx ].prim >= 0 ? closest[ first+idx ].dist : band;
+					if( x==0 || prev + dist <= voxel_size*1.001f ){ sign = parity_sign( bvh, points[ first+idx ], eps ); }
+					brick[idx] = sign*dist;
+					prev = dist;
+				}
+			}
+		}
+	}
+
+} // end make
+
+
+//
+//	Lookup
+//
+
+
+const float *SDF::find_cell( const trimesh::vec &p, int *cell, float *frac ) const {
+	if( voxel_size <= 0.f ){ return NULL; }
+	int brick[3];
+	for( int i=0; i<3; ++i ){
+		const float q = ( p[i]-origin[i] ) / voxel_size;
+		if( !( q >= 0.f && q < float( brick_size )*sdf_max_brick ) ){ return NULL; }
+		const float f = std::floor( q );
+		brick[i] = int(f) / brick_size;
+		cell[i] = int(f) - brick[i]*brick_size;
+		frac[i] = q - f;
+	}
+	std::unordered_map< unsigned long long, int >::const_iterator it = brick_map.find( brick_key( brick[0], brick[1], brick[2] ) );
+	if( it == brick_map.end() ){ return NULL; }
+	return &values[ size_t(it->second)*brick_samples ];
+}
+
+
+bool SDF::distance( const trimesh::vec &p, float &dist ) const {
+	trimesh::vec grad;
+	return distance( p, dist, grad );
+}
+
+
+bool SDF::distance( const trimesh::vec &p, float &dist, trimesh::vec &grad ) const {
+
+	int cell[3]; float f[3];
+	const float *brick = find_cell( p, cell, f );
+	if( brick == NULL ){ return false; }
+
+	// Corners of the cell, c[z][y][x]
+	const int row = brick_size+1;
+	const float *c0 = &brick[ ( cell[2]*row + cell[1] )*row + cell[0] ];
+	const float c000 = c0[0], c001 = c0[1], c010 = c0[row], c011 = c0[row+1];
+	const float *c1 = c0 + row*row;
+	const float c100 = c1[0], c101 = c1[1], c110 = c1[row], c111 = c1[row+1];
+
+	// Along x, then y, then z
+	const float x00 = c000 + f[0]*( c001-c000 ), x01 = c010 + f[0]*( c011-c010 );
+	const float x10 = c100 + f[0]*( c101-c100 ), x11 = c110 + f[0]*( c111-c110 );
+	const float y0 = x00 + f[1]*( x01-x00 ), y1 = x10 + f[1]*( x11-x10 );
+	dist = y0 + f[2]*( y1-y0 );
+
+	// Derivatives of the same interpolation, per unit of length
+	const float dx0 = ( c001-c000 ) + f[1]*( ( c011-c010 ) - ( c001-c000 ) );
+	const float dx1 = ( c101-c100 ) + f[1]*( ( c111-c110 ) - ( c101-c100 ) );
+	grad[0] = ( dx0 + f[2]*( dx1-dx0 ) ) / voxel_size;
+	grad[1] = ( ( x01-x00 ) + f[2]*( ( x11-x10 ) - ( x01-x00 ) ) ) / voxel_size;
+	grad[2] = ( y1-y0 ) / voxel_size;
+	return true;
+
+} // end distance
+
+
+//
+//	File IO
+//
+
+
+bool SDF::save( std::string filename, unsigned long long hash ) const {
+
+	Header header;
+	std::memset( &header, 0, sizeof(Header) );
+	std::memcpy( header.magic, "MCLSDF", 6 );
+	header.version = version;
+	header.brick_size = brick_size;
+	header.hash = hash;
+	for( int i=0; i<3; ++i ){ header.origin[i] = origin[i]; }
+	header.voxel_size = voxel_size;
+	header.band = band;
+	header.n_bricks = brick_keys.size();
+
+	// Write to a temporary and rename it, so that a partial file is never loaded
+	std::string tmp_filename = filename + ".tmp";
+	std::ofstream filestream( tmp_filename.c_str(), std::ios::binary );
+	if( !filestream.is_open() ){
+		std::cerr << "\n**SDF::save Error: Could not write " << tmp_filename << std::endl;
+		return false;
+	}
+	filestream.write( reinterpret_cast<const char*>( &header ), sizeof(Header) );
+	if( brick_keys.size() ){
+		filestream.write( reinterpret_cast<const char*>( &brick_keys[0] ), brick_keys.size()*sizeof(unsigned long long) );
+		filestream.write( reinterpret_cast<const char*>( &values[0] ), values.size()*sizeof(float) );
+	}
+	filestream.close();
+	if( !filestream ){
+		std::remove( tmp_filename.c_str() );
+		return false;
+	}
+
+	if( std::rename( tmp_filename.c_str(), filename.c_str() ) != 0 ){
+		std::remove( tmp_filename.c_str() );
+		return false;
+	}
+	return true;
+
+} // end save
+
+
+bool SDF::load( std::string filename, unsigned long long hash ){
+
+	std::ifstream filestream( filename.c_str(), std::ios::binary | std::ios::ate );
+	if( !filestream.is_open() ){ return false; }
+	const size_t size = filestream.tellg();
+	filestream.seekg( 0 );
+
+	Header header;
+	if( size < sizeof(Header) || !filestream.read( reinterpret_cast<char*>( &header ), sizeof(Header) ) ){ return false; }
+	bool valid = std::memcmp( header.magic, "MCLSDF", 6 )==0 && header.version == version &&
+		header.brick_size == brick_size && header.hash == hash && header.n_bricks >= 0 &&
+		size == sizeof(Header) + header.n_bricks*( sizeof(unsigned long long) + brick_samples*sizeof(float) );
+	if( !valid ){ return false; }
+
+	clear();
+	brick_keys.resize( header.n_bricks );
+	values.resize( size_t(header.n_bricks)*brick_samples );
+	if( header.n_bricks > 0 ){
+		filestream.read( reinterpret_cast<char*>( &brick_keys[0] ), brick_keys.size()*sizeof(unsigned long long) );
+		filestream.read( reinterpret_cast<char*>( &values[0] ), values.size()*sizeof(float) );
+		if( !filestream ){ clear(); return false; }
+	}
+
+	origin = trimesh::vec( header.origin[0], header.origin[1], header.origin[2] );
+	voxel_size = header.voxel_size;
+	band = header.band;
+	brick_map.reserve( brick_keys.size() );
+	for( int i=0; i<brick_keys.size(); ++i ){ brick_map[ brick_keys[i] ] = i; }
+	return true;
+
+} // end load
@@ -20,6 +20,7 @@
 // By Matt Overby (http://www.mattoverby.net)
 
 #include "MCL/SceneManager.hpp"
+#include <boost/filesystem.hpp>
 
 using namespace mcl;
 using namespace trimesh;
@@ -185,10 +186,7 @@ bool SceneManager::build_components(){
 			// Call the builders
 			for( int i=0; i<obj_builders.size(); ++i ){
 				std::shared_ptr<BaseObject> obj = obj_builders[i]( components[j] );
-				if( obj != NULL ){
-					objects.push_back( obj );
-					objects_map[name] = obj;
-				}
+				if( obj != NULL ){ add_object( obj, name ); }
 			}
 
 		} // end build object
@@ -204,43 +202,222 @@ bool SceneManager::build_components(){
 
 
 
-void SceneManager::build_bvh( int split_mode ){
+// Runs one of the builders and returns its stats, 0=object median, 1=linear (parallel), 2=sah, 3=trbvh, 4=sbvh
+static BVHStats build_tree( FlatBVH &bvh, const std::vector< std::shared_ptr<BaseObject> > &objects, int split_mode ){
 
-	if( root_bvh==NULL ){ root_bvh = std::shared_ptr<BVHNode>( new BVHNode() ); }
-	else{ root_bvh.reset( new BVHNode() ); }
-//	std::chrono::time_point<std::chrono::system_clock> start, end;
+	BVHStats stats;
 
 	if( split_mode == 0 ){
-//		std::cout << "spatial bvh begin: " << std::flush;
-//		start = std::chrono::system_clock::now();
-		int num_nodes = BVHBuilder::make_tree_spatial( root_bvh, objects );
-//		end = std::chrono::system_clock::now();
-//		std::chrono::duration<double> elapsed_seconds = end-start;
-//		std::cout << elapsed_seconds.count() << "s\n";
+		stats = BVHBuilder::make_tree_spatial( bvh, objects );
 	}
 
 	else if( split_mode == 1 ){
-//		std::cout << "linear bvh begin: " << std::flush;
-//		start = std::chrono::system_clock::now();
-		int num_nodes = BVHBuilder::make_tree_lbvh( root_bvh, objects );
-//		end = std::chrono::system_clock::now();
-//		std::chrono::duration<double> elapsed_seconds = end-start;
-//		std::cout << elapsed_seconds.count() << "s\n";
+		stats = BVHBuilder::make_tree_lbvh( bvh, objects );
 	}
 
-} // end build bvh
+	else if( split_mode == 2 ){
+		stats = BVHBuilder::make_tree_sah( bvh, objects );
+	}
+
+	else if( split_mode == 3 ){
+		BVHStats linear = BVHBuilder::make_tree_lbvh( bvh, objects );
+		stats = BVHBuilder::optimize_treelets( bvh );
+		stats.timings.insert( stats.timings.begin(), linear.timings.begin(), linear.timings.end() );
+	}
+
+	else if( split_mode == 4 ){
+		stats = BVHBuilder::make_tree_sbvh( bvh, objects );
+	}
+
+	return stats;
+
+} // end build tree
 
 
-std::shared_ptr<BVHNode> SceneManager::get_bvh( bool recompute, std::string type ){
+// Split mode of a type name, linear if unknown
+static int bvh_split_mode( std::string type ){
 	int split_mode=1;
 	if( parse::to_lower(type)=="spatial" ){ split_mode=0; }
 	else if( parse::to_lower(type)=="linear" ){ split_mode=1; }
+	else if( parse::to_lower(type)=="sah" ){ split_mode=2; }
+	else if( parse::to_lower(type)=="trbvh" ){ split_mode=3; }
+	else if( parse::to_lower(type)=="sbvh" ){ split_mode=4; }
+	return split_mode;
+}
+
 
-	if( recompute || root_bvh==NULL ){ build_bvh( split_mode ); }
+void SceneManager::build_bvh( int split_mode ){
+
+	if( root_bvh==NULL ){ root_bvh = std::shared_ptr<FlatBVH>( new FlatBVH() ); }
+	else{ root_bvh->clear(); }
+
+	// The builders run with default parameters, so the type names them in the cache
+	static const char *bvh_types[] = { "spatial", "linear", "sah", "trbvh", "sbvh" };
+	std::string cache_file = "";
+	unsigned long long hash = 0;
+	if( bvh_cache_dir.size() ){
+		root_bvh->add_objects( objects );
+		hash = BVHCache::geometry_hash( *root_bvh );
+		std::stringstream ss; ss << bvh_cache_dir << "/bvh_" << std::hex << hash << "_" << bvh_types[split_mode] << ".bin";
+		cache_file = ss.str();
+		std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+		if( BVHCache::load( cache_file, *root_bvh, hash, bvh_types[split_mode] ) ){
+			bvh_stats = BVHStats();
+			bvh_stats.add_timing( "cache load", start );
+			root_bvh->get_stats( bvh_stats );
+			bvh_mode = split_mode;
+			bvh_cost = bvh_stats.sah_cost;
+			return;
+		}
+	}
+	bvh_stats = build_tree( *root_bvh, objects, split_mode );
+
+	bvh_mode = split_mode;
+	bvh_cost = bvh_stats.sah_cost;
+
+	if( cache_file.size() ){
+		boost::filesystem::create_directories( bvh_cache_dir );
+		if( !BVHCache::save( cache_file, *root_bvh, hash, bvh_types[split_mode] ) ){
+			std::cerr << "\n**SceneManager Error: Unable to save bvh cache " << cache_file << std::endl;
+		}
+	}
+
+} // end build bvh
+
+
+std::shared_ptr<FlatBVH> SceneManager::get_bvh( bool recompute, std::string type ){
+	if( recompute || root_bvh==NULL ){ build_bvh( bvh_split_mode( type ) ); }
 	return root_bvh;
 }
 
 
+std::shared_ptr<FlatBVH> SceneManager::get_instance_bvh( bool recompute, std::string type ){
+
+	if( instance_bvh!=NULL && !recompute ){ return instance_bvh; }
+
+	// Bottom levels are only built for objects that don't have one yet
+	for( int i=0; i<objects.size(); ++i ){
+		if( object_blas.count( objects[i].get() ) ){ continue; }
+		std::shared_ptr<FlatBVH> blas( new FlatBVH() );
+		BVHBuilder::make_tree_sah( *blas, std::vector< std::shared_ptr<BaseObject> >( 1, objects[i] ) );
+		object_blas[ objects[i].get() ] = blas;
+		instances.push_back( std::shared_ptr<BVHInstance>( new BVHInstance( objects[i], blas ) ) );
+	}
+
+	if( instance_bvh==NULL ){ instance_bvh = std::shared_ptr<FlatBVH>( new FlatBVH() ); }
+	else{ instance_bvh->clear(); }
+	std::vector< std::shared_ptr<BaseObject> > top_level( instances.begin(), instances.end() );
+	build_tree( *instance_bvh, top_level, bvh_split_mode( type ) );
+	return instance_bvh;
+
+} // end get instance bvh
+
+
+std::shared_ptr<FlatBVH> SceneManager::refit_bvh( float rebuild_ratio ){
+
+	if( root_bvh==NULL ){
+		build_bvh( bvh_mode );
+		return root_bvh;
+	}
+
+	BVHBuilder::refit( *root_bvh );
+
+	// Deformation makes boxes grow and overlap, so rebuild once the tree is bad enough
+	double cost = root_bvh->sah_cost();
+	if( cost > bvh_cost*rebuild_ratio ){ build_bvh( bvh_mode ); }
+
+	return root_bvh;
+
+} // end refit bvh
+
+
+std::shared_ptr<DynamicBVH> SceneManager::get_dynamic_bvh( bool recompute ){
+
+	if( dynamic_bvh!=NULL && !recompute ){ return dynamic_bvh; }
+	if( dynamic_bvh==NULL ){ dynamic_bvh = std::shared_ptr<DynamicBVH>( new DynamicBVH() ); }
+	else{ dynamic_bvh->clear(); }
+	dynamic_handles.clear();
+
+	for( int i=0; i<objects.size(); ++i ){ insert_dynamic( objects[i] ); }
+	return dynamic_bvh;
+
+} // end get dynamic bvh
+
+
+void SceneManager::insert_dynamic( std::shared_ptr<BaseObject> obj ){
+	std::vector< std::shared_ptr<BaseObject> > prims;
+	obj->get_primitives( prims );
+	std::vector<int> &handles = dynamic_handles[ obj.get() ];
+	handles.reserve( handles.size() + prims.size() );
+	for( int i=0; i<prims.size(); ++i ){ handles.push_back( dynamic_bvh->insert( prims[i] ) ); }
+}
+
+
+void SceneManager::add_object( std::shared_ptr<BaseObject> obj, std::string name ){
+
+	objects.push_back( obj );
+	if( name.size() ){ objects_map[name] = obj; }
+	obj->set_material_id( material_id( obj->get_material() ) );
+	std::shared_ptr<trimesh::TriMesh> mesh = obj->get_TriMesh();
+	if( mesh != NULL ){ meshes.push_back( mesh ); }
+	if( dynamic_bvh!=NULL ){ insert_dynamic( obj ); }
+	root_bvh = NULL;
+	instance_bvh = NULL;
+
+} // end add object
+
+
+int SceneManager::material_id( const std::string &name ){
+	if( name.size()==0 ){ return -1; }
+	std::unordered_map< std::string, int >::iterator it = material_ids.find( name );
+	if( it != material_ids.end() ){ return it->second; }
+	const int id = material_names.size();
+	material_ids[name] = id;
+	material_names.push_back( name );
+	return id;
+}
+
+
+std::shared_ptr<BaseMaterial> SceneManager::get_material( int id ){
+	if( id < 0 || id >= material_names.size() ){ return NULL; }
+	std::unordered_map< std::string, std::shared_ptr<BaseMaterial> >::iterator it = materials_map.find( material_names[id] );
+	if( it == materials_map.end() ){ return NULL; }
+	return it->second;
+}
+
+
+bool SceneManager::remove_object( std::shared_ptr<BaseObject> obj ){
+
+	std::vector< std::shared_ptr<BaseObject> >::iterator it = std::find( objects.begin(), objects.end(), obj );
+	if( it == objects.end() ){ return false; }
+	objects.erase( it );
+
+	std::unordered_map< std::string, std::shared_ptr<BaseObject> >::iterator map_it = objects_map.begin();
+	while( map_it != objects_map.end() ){
+		if( map_it->second == obj ){ map_it = objects_map.erase( map_it ); }
+		else{ ++map_it; }
+	}
+
+	if( dynamic_bvh!=NULL ){
+		std::vector<int> &handles = dynamic_handles[ obj.get() ];
+		for( int i=0; i<handles.size(); ++i ){ dynamic_bvh->remove( handles[i] ); }
+		dynamic_handles.erase( obj.get() );
+	}
+
+	object_blas.erase( obj.get() );
+	for( int i=instances.size()-1; i>=0; --i ){
+		if( instances[i]->object == obj ){ instances.erase( instances.begin()+i ); }
+	}
+
+	root_bvh = NULL;
+	instance_bvh = NULL;
+	meshes.clear();
+	build_meshes();
+	return true;
+
+} // end remove object
+
+
 mcl::Component &SceneManager::get( std::string name ){
 	for( int i=0; i<components.size(); ++i ){
 		if( components[i].name == name ){ return components[i]; }
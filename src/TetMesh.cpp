@@ -233,6 +233,17 @@ bool TetMesh::need_surface(){
 } // end create boundary mesh
 
 
+bool TetMesh::get_triangle_view( TriangleView &view ){
+	tris->need_faces();
+	tris->need_normals();
+	view.vertices = &vertices;
+	view.normals = &normals;
+	view.faces = &faces;
+	view.material = material_id;
+	return true;
+}
+
+
 void TetMesh::make_tri_refs(){
 
 	using namespace trimesh;
@@ -246,7 +257,7 @@ void TetMesh::make_tri_refs(){
 	for( int i=0; i<faces.size(); ++i ){
 		TriMesh::Face f = faces[i];
 		std::shared_ptr<BaseObject> tri(
-			new TriangleRef( &vertices[f[0]], &vertices[f[1]], &vertices[f[2]], &normals[f[0]], &normals[f[1]], &normals[f[2]], material )
+			new TriangleRef( &vertices[f[0]], &vertices[f[1]], &vertices[f[2]], &normals[f[0]], &normals[f[1]], &normals[f[2]], material_id )
 		);
 		tri_refs.push_back( tri );
 	} // end loop faces